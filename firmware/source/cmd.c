@@ -25,6 +25,14 @@
 #include "telem.h"
 #include "leg_ctrl.h"
 #include "hall.h"
+#include "odometry.h"
+#include "sys_service.h"
+#include "estop.h"
+#include "teleop.h"
+#include "nvparams.h"
+#include "ota.h"
+#include "pay_pool.h"
+#include "flashmem.h"
 #include "version.h"
 
 #include "settings.h" //major config defines, sys-service, hall, etc
@@ -49,7 +57,49 @@ extern volatile char g_radio_duty_cycle;
 // use an array of function pointer to avoid a number of case statements
 // CMD_VECTOR_SIZE is defined in cmd_const.h
 void (*cmd_func[CMD_VECTOR_SIZE])(unsigned char, unsigned char, unsigned char*);
-//char cmd_len[CMD_VECTOR_SIZE];
+// minimum argument length of each command, shorter frames are refused
+unsigned char cmd_len[CMD_VECTOR_SIZE];
+
+// recently executed sequenced commands, for duplicate suppression; an entry
+// older than CMD_SEQ_TIMEOUT T5 ticks is ignored, so a restarted host that
+// reuses a sequence number is not mistaken for a resend
+static unsigned char seqNum[CMD_SEQ_WINDOW];
+static unsigned char seqResult[CMD_SEQ_WINDOW];
+static unsigned long seqTime[CMD_SEQ_WINDOW];
+static unsigned char seqNext = 0;
+
+// set while the records of a CMD_MULTI frame are dispatched; confirmations
+// sent through cmdReply() are then replaced by a single CMD_MULTI ack
+static char cmdInMulti = 0;
+
+// received commands, moved off the radio by cmdPump() in the T5 ISR and run
+// from the main loop by cmdHandleRadioRxBuffer(). Priority commands are
+// applied by cmdPump() right away; their entry keeps what is left to send.
+typedef struct {
+    Payload pld;
+    unsigned char applied; // already run by cmdPump()
+    unsigned char result; // CMD_RESULT_*, for the ack
+    unsigned char duplicate;
+    unsigned char replied; // confirmation held back, echoes the arguments
+    unsigned long arrival; // swatch time taken off the radio, us
+    unsigned long done; // swatch time cmdPump() finished it, us
+} cmdQueueEntry;
+
+static cmdQueueEntry cmdQueue[CMD_QUEUE_SIZE];
+static volatile unsigned int cmdHead = 0; //written only by the T5 ISR
+static volatile unsigned int cmdTail = 0; //written only by the main loop
+static char cmdInPump = 0;
+static char cmdPumpReplied;
+static volatile unsigned int cmdDropped = 0; // written only by the T5 ISR
+
+// payloads cmdPump() is done with but may not free, as the main loop uses
+// the heap unmasked; freed by cmdHandleRadioRxBuffer()
+static Payload cmdSpent[CMD_SPENT_SIZE];
+static volatile unsigned int cmdSpentHead = 0; //written only by the T5 ISR
+static volatile unsigned int cmdSpentTail = 0; //written only by the main loop
+
+// latency statistics, updated only from the main loop
+static cmdStatsStruct cmdStats;
 
 /*-----------------------------------------------------------------------------
  *          Declaration of static functions
@@ -89,6 +139,49 @@ static void cmdHallTelemetry(unsigned char status, unsigned char length, unsigne
 static void cmdZeroPos(unsigned char status, unsigned char length, unsigned char *frame);
 static void cmdSetHallGains(unsigned char status, unsigned char length, unsigned char *frame);
 static void cmdSetTailQueue(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdHallEdgeStream(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdGetOdometry(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSetOdometry(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSetHeading(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSetTelemFields(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdGetTelemHeader(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdTelemStream(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdReadbackAck(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdGetTelemStats(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdCircularLog(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdLogTrigger(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdGetLogDir(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSelectLog(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdClearLogDir(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdMulti(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdEmergencyStop(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdTeleop(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSaveParams(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdLoadParams(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdDefaultParams(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdReplyParams(unsigned char status, unsigned char type, unsigned int result);
+static void cmdGetParam(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdSetParam(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdListParams(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdOtaBegin(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdOtaData(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdOtaVerify(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdOtaAbort(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdOtaStatus(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdWritePM(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdReplyOta(unsigned char status, unsigned char type, unsigned int result);
+
+static void cmdReply(unsigned char status, unsigned char type, unsigned char length, unsigned char *data);
+static unsigned char cmdDispatch(unsigned char status, unsigned char type, unsigned char length, unsigned char *frame);
+static void cmdHandleSequenced(unsigned char seq, unsigned char type, unsigned char length, unsigned char *frame);
+static char cmdSeqFind(unsigned char seq, unsigned char *result);
+static void cmdSeqRecord(unsigned char seq, unsigned char result);
+static void cmdSendAck(unsigned char seq, unsigned char type, unsigned char result, unsigned char duplicate);
+static char cmdIsPriority(unsigned char type);
+static void cmdPump(void);
+static void cmdStatsUpdate(cmdQueueEntry *entry, unsigned long start, unsigned long end);
+static void cmdGetCmdStats(unsigned char status, unsigned char length, unsigned char *frame);
+static void cmdGetPoolStats(unsigned char status, unsigned char length, unsigned char *frame);
 
 /*-----------------------------------------------------------------------------
  *          Public functions
@@ -98,10 +191,14 @@ void cmdSetup(void) {
     unsigned int i;
 
     // initialize the array of func pointers with Nop()
-    for (i = 0; i < MAX_CMD_FUNC; ++i) {
+    for (i = 0; i <= MAX_CMD_FUNC; ++i) {
         cmd_func[i] = &cmdNop;
-        //cmd_len[i] = 0; //0 indicated an unpoplulated command
+        cmd_len[i] = 0; //0 indicated an unpoplulated command
+    }
+    for (i = 0; i < CMD_SEQ_WINDOW; i++) {
+        seqNum[i] = 0;
     }
+    memset(&cmdStats, 0, sizeof(cmdStats));
 
     cmd_func[CMD_ECHO] = &cmdEcho;
     cmd_func[CMD_SET_THRUST] = &cmdSetThrust;
@@ -132,45 +229,119 @@ void cmdSetup(void) {
     cmd_func[CMD_ZERO_POS] = &cmdZeroPos;
     cmd_func[CMD_SET_HALL_GAINS] = &cmdSetHallGains;
     cmd_func[CMD_SET_TAIL_QUEUE] = &cmdSetTailQueue;
+    cmd_func[CMD_HALL_EDGE_STREAM] = &cmdHallEdgeStream;
+    cmd_func[CMD_GET_ODOMETRY] = &cmdGetOdometry;
+    cmd_func[CMD_SET_ODOMETRY] = &cmdSetOdometry;
+    cmd_func[CMD_SET_HEADING] = &cmdSetHeading;
+    cmd_func[CMD_SET_TELEM_FIELDS] = &cmdSetTelemFields;
+    cmd_func[CMD_GET_TELEM_HEADER] = &cmdGetTelemHeader;
+    cmd_func[CMD_TELEM_STREAM] = &cmdTelemStream;
+    cmd_func[CMD_READBACK_ACK] = &cmdReadbackAck;
+    cmd_func[CMD_GET_TELEM_STATS] = &cmdGetTelemStats;
+    cmd_func[CMD_CIRCULAR_LOG] = &cmdCircularLog;
+    cmd_func[CMD_LOG_TRIGGER] = &cmdLogTrigger;
+    cmd_func[CMD_GET_LOG_DIR] = &cmdGetLogDir;
+    cmd_func[CMD_SELECT_LOG] = &cmdSelectLog;
+    cmd_func[CMD_CLEAR_LOG_DIR] = &cmdClearLogDir;
+    cmd_func[CMD_MULTI] = &cmdMulti;
+    cmd_func[CMD_EMERGENCY_STOP] = &cmdEmergencyStop;
+    cmd_func[CMD_GET_CMD_STATS] = &cmdGetCmdStats;
+    cmd_func[CMD_GET_POOL_STATS] = &cmdGetPoolStats;
+    cmd_func[CMD_TELEOP] = &cmdTeleop;
+    cmd_func[CMD_SAVE_PARAMS] = &cmdSaveParams;
+    cmd_func[CMD_LOAD_PARAMS] = &cmdLoadParams;
+    cmd_func[CMD_DEFAULT_PARAMS] = &cmdDefaultParams;
+    cmd_func[CMD_GET_PARAM] = &cmdGetParam;
+    cmd_func[CMD_SET_PARAM] = &cmdSetParam;
+    cmd_func[CMD_LIST_PARAMS] = &cmdListParams;
+    cmd_func[CMD_OTA_BEGIN] = &cmdOtaBegin;
+    cmd_func[CMD_OTA_DATA] = &cmdOtaData;
+    cmd_func[CMD_OTA_VERIFY] = &cmdOtaVerify;
+    cmd_func[CMD_OTA_ABORT] = &cmdOtaAbort;
+    cmd_func[CMD_OTA_STATUS] = &cmdOtaStatus;
+    cmd_func[CMD_WRITE_PM] = &cmdWritePM;
 
     //Set up command length vector
-    /*cmd_len[CMD_SET_THRUST_OPENLOOP] = LEN_CMD_SET_THRUST_OPENLOOP;
-    cmd_len[CMD_SET_THRUST_CLOSEDLOOP] = LEN_CMD_SET_THRUST_CLOSEDLOOP;
-    cmd_len[CMD_SET_PID_GAINS] = LEN_CMD_SET_PID_GAINS;
-    cmd_len[CMD_GET_PID_TELEMETRY] = LEN_CMD_GET_PID_TELEMETRY;
-    cmd_len[CMD_SET_CTRLD_TURN_RATE] = LEN_CMD_SET_CTRLD_TURN_RATE;
-    cmd_len[CMD_GET_IMU_LOOP_ZGYRO] = LEN_CMD_GET_IMU_LOOP_ZGYRO;
-    cmd_len[CMD_SET_MOVE_QUEUE] = LEN_CMD_SET_MOVE_QUEUE;
-    cmd_len[CMD_SET_STEERING_GAINS] = LEN_CMD_SET_STEERING_GAINS;
-    cmd_len[CMD_SOFTWARE_RESET] = LEN_CMD_SOFTWARE_RESET;
-    cmd_len[CMD_SPECIAL_TELEMETRY] = LEN_CMD_SPECIAL_TELEMETRY;
-    cmd_len[CMD_ERASE_SECTORS] = LEN_CMD_ERASE_SECTORS;
-    cmd_len[CMD_FLASH_READBACK] = LEN_CMD_FLASH_READBACK;
-    cmd_len[CMD_SLEEP] = LEN_CMD_SLEEP;
-     * */
+    //Commands not listed take no arguments, or check their own length
+    cmd_len[CMD_SET_THRUST_OPENLOOP] = sizeof(_args_cmdSetThrustOpenLoop);
+    cmd_len[CMD_SET_THRUST_CLOSEDLOOP] = sizeof(_args_cmdSetThrustClosedLoop);
+    cmd_len[CMD_SET_PID_GAINS] = sizeof(_args_cmdSetPIDGains);
+    cmd_len[CMD_SET_CTRLD_TURN_RATE] = sizeof(_args_cmdSetCtrldTurnRate);
+    cmd_len[CMD_SET_MOVE_QUEUE] = sizeof(unsigned int); //segment count
+    cmd_len[CMD_SET_STEERING_GAINS] = sizeof(_args_cmdSetSteeringGains);
+    cmd_len[CMD_SPECIAL_TELEMETRY] = sizeof(_args_cmdSpecialTelemetry);
+    cmd_len[CMD_ERASE_SECTORS] = sizeof(unsigned long); //eraseAhead optional
+    cmd_len[CMD_FLASH_READBACK] = sizeof(_args_cmdFlashReadback);
+    cmd_len[CMD_SLEEP] = sizeof(char);
+    cmd_len[CMD_SET_VEL_PROFILE] = sizeof(_args_cmdSetVelProfile);
+    cmd_len[CMD_HALL_TELEMETRY] = sizeof(_args_cmdHallTelemetry);
+    cmd_len[CMD_SET_HALL_GAINS] = sizeof(_args_cmdSetPIDGains);
+    cmd_len[CMD_HALL_EDGE_STREAM] = sizeof(_args_cmdHallEdgeStream);
+    cmd_len[CMD_SET_ODOMETRY] = sizeof(_args_cmdSetOdometry);
+    cmd_len[CMD_SET_HEADING] = sizeof(_args_cmdSetHeading);
+    cmd_len[CMD_SET_TELEM_FIELDS] = sizeof(_args_cmdSetTelemFields);
+    cmd_len[CMD_TELEM_STREAM] = sizeof(_args_cmdTelemStream);
+    cmd_len[CMD_READBACK_ACK] = sizeof(unsigned long) + sizeof(unsigned int);
+    cmd_len[CMD_CIRCULAR_LOG] = sizeof(_args_cmdCircularLog);
+    cmd_len[CMD_SELECT_LOG] = sizeof(_args_cmdSelectLog);
+    cmd_len[CMD_TELEOP] = sizeof(_args_cmdTeleop);
+    cmd_len[CMD_GET_PARAM] = sizeof(_args_cmdGetParam);
+    cmd_len[CMD_SET_PARAM] = sizeof(unsigned int); //value count
+    cmd_len[CMD_LIST_PARAMS] = sizeof(_args_cmdListParams);
+    cmd_len[CMD_OTA_BEGIN] = sizeof(_args_cmdOtaBegin);
+    cmd_len[CMD_OTA_DATA] = sizeof(unsigned long) + sizeof(unsigned int); //then data
+
+    //Commands are taken off the radio at 300Hz, see cmdPump()
+    sysServiceInstallT5(cmdPump);
 }
 
 void cmdHandleRadioRxBuffer(void) {
 
     Payload pld;
+    cmdQueueEntry *entry;
     unsigned char command, status;
+    unsigned long start;
+
+    while (cmdSpentTail != cmdSpentHead) {
+        payDelete(cmdSpent[cmdSpentTail]);
+        cmdSpentTail = (cmdSpentTail + 1) % CMD_SPENT_SIZE;
+    }
 
-    if ((pld = radioReceivePayload()) != NULL) {
+    if (cmdTail != cmdHead) {
 
+        entry = &cmdQueue[cmdTail];
+        pld = entry->pld;
         status = payGetStatus(pld);
         command = payGetType(pld);
-
-        //Due to bugs, command may be a surprious value; check explicitly
-        if (command <= MAX_CMD_FUNC) {
-            cmd_func[command](status, pld->data_length, payGetData(pld));
+        start = swatchTic();
+
+        if (entry->applied) {
+            //Run by cmdPump(); send the replies it held back
+            if (entry->replied) {
+                payPoolSend(pld->data_length, payGetData(pld), status, command);
+            }
+            if (status != 0) {
+                cmdSendAck(status, command, entry->result, entry->duplicate);
+            }
+        } else if (status != 0) {
+            //A nonzero status is a sequence number, the command is acknowledged
+            cmdHandleSequenced(status, command, pld->data_length, payGetData(pld));
+        } else {
+            cmdDispatch(status, command, pld->data_length, payGetData(pld));
         }
+        cmdStatsUpdate(entry, start, swatchTic());
 
         payDelete(pld);
+        cmdTail = (cmdTail + 1) % CMD_QUEUE_SIZE;
     }
 
     return;
 }
 
+unsigned char cmdIsQueueEmpty(void) {
+    return (cmdTail == cmdHead) && radioIsRxQueueEmpty();
+}
+
 //////////////////////////////////
 //typedef struct { int dc1, dc2;} _args_cmdSetThrustOpenLoop;
 /////////////////////////////////
@@ -192,6 +363,7 @@ static void cmdSetThrust(unsigned char status, unsigned char length, unsigned ch
     chr_test[2] = frame[2];
     chr_test[3] = frame[3];
 
+    legCtrlReleaseOutputs();
     mcSetDutyCycle(MC_CHANNEL_PWM1, duty_cycle[0]);
     //mcSetDutyCycle(1, duty_cycle[0]);
 }
@@ -257,16 +429,15 @@ static void cmdGetImuLoop(unsigned char status, unsigned char length, unsigned c
 
     while (count) {
 
-        pld = payCreateEmpty(16); // data length = 16
-        paySetData(pld, 4, tic_char);
-        payAppendData(pld, 4, 6, xlReadXYZ());
-        payAppendData(pld, 10, 6, gyroReadXYZ());
-        paySetStatus(pld, status);
-        paySetType(pld, CMD_GET_IMU_DATA);
-
-        radioSendPayload(macGetDestAddr(), pld);
+        pld = payPoolGet(16, status, CMD_GET_IMU_DATA); // data length = 16
+        if (pld != NULL) {
+            paySetData(pld, 4, tic_char);
+            payAppendData(pld, 4, 6, xlReadXYZ());
+            payAppendData(pld, 10, 6, gyroReadXYZ());
+            //Deleted by the radio once sent
+            radioSendPayload(macGetDestAddr(), pld);
+        }
         count--;
-        payDelete(pld);
         delay_ms(4);
         tic = swatchTic();
     }
@@ -326,10 +497,7 @@ static void cmdEraseMemSector(unsigned char status, unsigned char length, unsign
 -----------------------------------------------------------------------------*/
 void cmdEcho(unsigned char status, unsigned char length, unsigned char *frame) {
 
-    char* temp = malloc(length*sizeof(char));
-    strncpy(temp,(char*)frame,length);
-
-    radioSendPayload(macGetDestAddr(), payCreate(length, frame, status, CMD_ECHO));
+    payPoolSend(length, frame, status, CMD_ECHO);
     //Payload pld;
     //pld = payCreateEmpty(1);
     //paySetStatus(pld, status);
@@ -352,6 +520,7 @@ static void cmdSetThrustOpenLoop(unsigned char status, unsigned char length, uns
     //_args_cmdSetThrustOpenLoop* argsPtr = (_args_cmdSetThrustOpenLoop*) (frame);
     PKT_UNPACK(_args_cmdSetThrustOpenLoop, argsPtr, frame);
 
+    legCtrlReleaseOutputs();
     //set motor duty cycles
     //PDC1 = argsPtr->dc1;
     //PDC2 = argsPtr->dc1;
@@ -403,17 +572,18 @@ static void cmdSetPIDGains(unsigned char status, unsigned char length, unsigned
     //Unpack unsigned char* frame into structured values
     //_args_cmdSetPIDGains* argsPtr = (_args_cmdSetPIDGains*) (frame);
     PKT_UNPACK(_args_cmdSetPIDGains, argsPtr, frame);
+    char lockT1IE;
 
+    //Both sides are staged in one T1 tick, so they switch together
+    lockT1IE = _T1IE;
+    _T1IE = 0;
     legCtrlSetGains(0, argsPtr->Kp1, argsPtr->Ki1, argsPtr->Kd1, argsPtr->Kaw1, argsPtr->Kff1);
     legCtrlSetGains(1, argsPtr->Kp2, argsPtr->Ki2, argsPtr->Kd2, argsPtr->Kaw2, argsPtr->Kff2);
+    _T1IE = lockT1IE;
+    memcpy(nvParamGet()->legGains, argsPtr, sizeof(nvParamGet()->legGains));
 
     //Send confirmation packet
-    Payload pld;
-    pld = payCreateEmpty(20);
-    pld->pld_data[0] = status;
-    pld->pld_data[1] = CMD_SET_PID_GAINS;
-    memcpy((pld->pld_data) + 2, frame, 20);
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    cmdReply(status, CMD_SET_PID_GAINS, 20, frame);
 }
 
 static void cmdGetPIDTelemetry(unsigned char status, unsigned char length, unsigned char *frame) {
@@ -423,19 +593,11 @@ static void cmdGetPIDTelemetry(unsigned char status, unsigned char length, unsig
 
 static void cmdSetCtrldTurnRate(unsigned char status, unsigned char length, unsigned char *frame) {
     int rate;
-    Payload pld;
     rate = frame[0] + (frame[1] << 8);
     steeringSetAngRate(rate);
 
     //Send confirmation packet
-    pld = payCreateEmpty(2);
-    //pld->pld_data[0] = status;
-    //pld->pld_data[1] = CMD_SET_CTRLD_TURN_RATE;
-    memcpy((pld->pld_data) + 2, frame, sizeof (int));
-    payAppendData(pld, 0, sizeof (rate), (unsigned char*) (&rate));
-    paySetStatus(pld, status);
-    paySetType(pld, CMD_SET_CTRLD_TURN_RATE);
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    cmdReply(status, CMD_SET_CTRLD_TURN_RATE, sizeof (rate), (unsigned char*) (&rate));
 }
 
 static void cmdGetImuLoopZGyro(unsigned char status, unsigned char length, unsigned char *frame) {
@@ -472,26 +634,23 @@ static void cmdSetSteeringGains(unsigned char status, unsigned char length, unsi
     //int Kp, Ki, Kd, Kaw, ff;
     //  int steerMode;
     //    int idx = 0;
-    Payload pld;
 
     PKT_UNPACK(_args_cmdSetSteeringGains, argsPtr, frame);
     //_args_cmdSetSteeringGains* argsPtr = (_args_cmdSetSteeringGains*) (frame);
 
     steeringSetGains(argsPtr->Kp, argsPtr->Ki, argsPtr->Kd, argsPtr->Kaw, argsPtr->Kff);
     steeringSetMode(argsPtr->steerMode);
+    memcpy(nvParamGet()->steeringGains, argsPtr, sizeof(nvParamGet()->steeringGains));
+    nvParamGet()->steeringMode = argsPtr->steerMode;
 
-    pld = payCreateEmpty(sizeof(_args_cmdSetSteeringGains));
-    pld->pld_data[0] = status;
-    pld->pld_data[1] = CMD_SET_STEERING_GAINS;
-    memcpy((pld->pld_data) + 2, frame, sizeof(_args_cmdSetSteeringGains));
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    cmdReply(status, CMD_SET_STEERING_GAINS, sizeof(_args_cmdSetSteeringGains), frame);
 
 }
 
 static void cmdSoftwareReset(unsigned char status, unsigned char length, unsigned char *frame) {
     delay_ms(10);
     char* resetmsg = "RESET";
-    radioSendPayload(macGetDestAddr(), payCreate(6, (unsigned char*)resetmsg, status, CMD_ECHO));
+    payPoolSend(6, (unsigned char*)resetmsg, status, CMD_ECHO);
     delay_ms(10);
 #ifndef __DEBUG
     __asm__ volatile ("reset");
@@ -512,26 +671,24 @@ static void cmdSpecialTelemetry(unsigned char status, unsigned char length, unsi
     }
 }
 
+// start a background erase; progress is reported with CMD_ERASE_SECTORS
+// packets from telemService(). eraseAhead is optional, older hosts send
+// only the sample count.
 static void cmdEraseSector(unsigned char status, unsigned char length, unsigned char *frame) {
-    //unsigned int numSamples = frame[0] + (frame[1] << 8);
-    unsigned long numSamples = *((unsigned long*) (frame));
+    PKT_UNPACK(_args_cmdEraseSectors, argsPtr, frame);
+    char ahead = 0;
 
-    telemErase(numSamples);
-
-    //Send a confirmation packet
-    Payload pld;
-    pld = payCreateEmpty(4);
-    paySetData(pld, 4, (unsigned char*) (&numSamples));
-    paySetStatus(pld, status);
-    paySetType(pld, CMD_ERASE_SECTORS);
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    if (length > sizeof(unsigned long)) {
+        ahead = argsPtr->eraseAhead;
+    }
+    telemErase(argsPtr->numSamples, ahead);
 }
 
+// start a windowed readback; chunks are sent from telemService() and
+// acknowledged by the host with CMD_READBACK_ACK
 static void cmdFlashReadback(unsigned char status, unsigned char length, unsigned char *frame) {
-    LED_YELLOW = 1;
-    //unsigned int count = frame[0] + (frame[1] << 8);
-    unsigned long count = *((unsigned long*) (frame));
-    telemReadbackSamples(count);
+    PKT_UNPACK(_args_cmdFlashReadback, argsPtr, frame);
+    telemReadbackStart(argsPtr->startSeq, argsPtr->endSeq);
 }
 
 static void cmdSleep(unsigned char status, unsigned char length, unsigned char *frame) {
@@ -540,74 +697,45 @@ static void cmdSleep(unsigned char status, unsigned char length, unsigned char *
         //g_radio_duty_cycle = 1;
     } else {
         //g_radio_duty_cycle = 0;
-        Payload pld;
-        pld = payCreateEmpty(1);
-        paySetData(pld, 1, (unsigned char*) (&sleep)); //echo back a CMD_SLEEP with '0', incdicating a wakeup
-        paySetStatus(pld, status);
-        paySetType(pld, CMD_SLEEP);
-        radioSendPayload((WordVal) macGetDestAddr(), pld);
+        //echo back a CMD_SLEEP with '0', incdicating a wakeup
+        payPoolSend(1, (unsigned char*) (&sleep), status, CMD_SLEEP);
     }
 }
 
 // set up velocity profile structure  - assume 4 set points for now, generalize later
 static void cmdSetVelProfile(unsigned char status, unsigned char length, unsigned char *frame) {
-    Payload pld;
     PKT_UNPACK(_args_cmdSetVelProfile, argsPtr, frame);
 
     hallSetVelProfile(0, argsPtr->intervalsL, argsPtr->deltaL, argsPtr->velL);
     hallSetVelProfile(1, argsPtr->intervalsR, argsPtr->deltaR, argsPtr->velR);
 
     //Send confirmation packet
-    pld = payCreateEmpty(sizeof(_args_cmdSetVelProfile));
-    //pld->pld_data[0] = status;
-    paySetStatus(pld, status);
-    //pld->pld_data[1] = CMD_SET_VEL_PROFILE;
-    paySetType(pld, CMD_SET_VEL_PROFILE);
     // packet length = 48 bytes (24 ints)
-    memcpy((pld->pld_data) + 2, frame, sizeof(_args_cmdSetVelProfile));
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    cmdReply(status, CMD_SET_VEL_PROFILE, sizeof(_args_cmdSetVelProfile), frame);
 }
 
 // report motor position and  reset motor position (from Hall effect sensors)
 // note motor_count is long (4 bytes)
 void cmdZeroPos(unsigned char status, unsigned char length, unsigned char *frame) {
 
-    radioSendPayload(macGetDestAddr(), payCreate(2*sizeof(long),
-            (unsigned char *)(hallGetMotorCounts()), status, CMD_ZERO_POS));
+    payPoolSend(2*sizeof(long),
+            (unsigned char *)(hallGetMotorCounts()), status, CMD_ZERO_POS);
     hallZeroPos(0);
     hallZeroPos(1);
 }
 
 // alternative telemetry which runs at 1 kHz rate inside PID loop
+// log count samples on the 1kHz hall control tick, one every skip ticks,
+// starting startDelay ms from now. Flash must be erased beforehand. Replies
+// with the field mask of the run, 0 if it could not be started.
 static void cmdHallTelemetry(unsigned char status, unsigned char length, unsigned char *frame) {
-    //TODO: Integration of hall telemetry is unfinished. Fuction will currently
-    // do nothing.
-
     PKT_UNPACK(_args_cmdHallTelemetry, argsPtr, frame);
+    unsigned long mask;
 
-    //start time = argsPtr->startDealy + getT1_ticks();
-    //telemSetSkip(argsPtr->skip);
-    //telemSetSamplesToSave(argsPtr->count);
-    //swatchReset(); //This should probably be done within the telem module!
-
-    //int idx = 0;
-    //unsigned long temp;
-    //TelemControl.count = frame[idx] + (frame[idx + 1] << 8);
-    //idx += 2;
-    // start time is relative to current t1_ticks
-    //temp = t1_ticks; // need atomic read due to interrupts
-    //TelemControl.start =
-    //        (unsigned long) (frame[idx] + (frame[idx + 1] << 8))
-    //        + temp;
-    //idx += 2;
-    //samplesToSave = TelemControl.count; // **** this runs sample capture in T5 interrupt
-    
-    //TelemControl.skip = frame[idx]+(frame[idx + 1] << 8);
-    //swatchReset();
-    //if (TelemControl.count > 0) {
-    //    TelemControl.onoff = 1; // use just steering servo sample capture
-    //} // enable telemetry last
-     
+    mask = telemHallLogStart(argsPtr->startDelay, (unsigned int) argsPtr->count,
+            (unsigned int) argsPtr->skip);
+    payPoolSend(sizeof(mask),
+            (unsigned char *) (&mask), status, CMD_HALL_TELEMETRY);
 }
 
 // send robot info when queried
@@ -616,26 +744,23 @@ void cmdWhoAmI(unsigned char status, unsigned char length, unsigned char *frame)
     char* verstr = versionGetString();
     int verlen = strlen(verstr);
     //The cast to unsigned char* is here to prevent a warning
-    Payload pld = payCreate(verlen, (unsigned char*)verstr, status, CMD_WHO_AM_I);
-    radioSendPayload(macGetDestAddr(), pld);
+    payPoolSend(verlen, (unsigned char*)verstr, status, CMD_WHO_AM_I);
 }
 
 static void cmdSetHallGains(unsigned char status, unsigned char length, unsigned char *frame) {
     //Unpack unsigned char* frame into structured values
     PKT_UNPACK(_args_cmdSetPIDGains, argsPtr, frame);
+    char lockT1IE;
 
+    lockT1IE = _T1IE;
+    _T1IE = 0;
     hallSetGains(0, argsPtr->Kp1, argsPtr->Ki1, argsPtr->Kd1, argsPtr->Kaw1, argsPtr->Kff1);
     hallSetGains(1, argsPtr->Kp2, argsPtr->Ki2, argsPtr->Kd2, argsPtr->Kaw2, argsPtr->Kff2);
+    _T1IE = lockT1IE;
+    memcpy(nvParamGet()->hallGains, argsPtr, sizeof(nvParamGet()->hallGains));
 
     //Send confirmation packet
-    Payload pld;
-    pld = payCreateEmpty(20);
-    //pld->pld_data[0] = status;
-    //pld->pld_data[1] = CMD_SET_HALL_GAINS;
-    paySetType(pld, CMD_SET_HALL_GAINS);
-    paySetStatus(pld, status);
-    memcpy((pld->pld_data) + 2, frame, 20);
-    radioSendPayload((WordVal) macGetDestAddr(), pld);
+    cmdReply(status, CMD_SET_HALL_GAINS, 20, frame);
 }
 
 static void cmdSetTailQueue(unsigned char status, unsigned char length, unsigned char *frame) {
@@ -659,3 +784,588 @@ static void cmdSetTailQueue(unsigned char status, unsigned char length, unsigned
         idx += sizeof (tailCmdStruct);
     }
 }
+
+// turn streaming of per-edge hall timestamps on or off
+// edges are sent back as CMD_HALL_EDGE_STREAM packets from telemService()
+static void cmdHallEdgeStream(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdHallEdgeStream, argsPtr, frame);
+    telemHallEdgeStreamOnOff(argsPtr->onoff);
+}
+
+// report dead-reckoning pose: x, y, path length (long, mm), heading (int, BAMS16)
+static void cmdGetOdometry(unsigned char status, unsigned char length, unsigned char *frame) {
+    odoPoseStruct pose;
+    odoGetPose(&pose);
+    payPoolSend(sizeof(odoPoseStruct),
+            (unsigned char *) (&pose), status, CMD_GET_ODOMETRY);
+}
+
+// set stride length calibration and/or zero the pose
+static void cmdSetOdometry(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdSetOdometry, argsPtr, frame);
+
+    if (argsPtr->strideUm != 0) {
+        odoSetStrideLength(argsPtr->strideUm);
+        nvParamGet()->strideUm = argsPtr->strideUm;
+    }
+    if (argsPtr->reset) {
+        odoReset();
+    }
+
+    //Send confirmation packet
+    cmdReply(status, CMD_SET_ODOMETRY, sizeof(_args_cmdSetOdometry), frame);
+}
+
+// switch steering to heading hold; heading is absolute, or relative to the
+// current heading. CMD_SET_CTRLD_TURN_RATE switches back to rate control.
+static void cmdSetHeading(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdSetHeading, argsPtr, frame);
+
+    steeringSetHeading(argsPtr->heading, argsPtr->relative);
+
+    //Send confirmation packet
+    cmdReply(status, CMD_SET_HEADING, sizeof(_args_cmdSetHeading), frame);
+}
+
+// select telemetry fields and encoding for the next run; replies with the mask
+// in effect, the resulting raw record size and the encoding in effect
+static void cmdSetTelemFields(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdSetTelemFields, argsPtr, frame);
+    unsigned long mask;
+    unsigned int recordSize;
+    unsigned int encoding;
+
+    mask = telemSetFieldMask(argsPtr->fieldMask);
+    recordSize = telemGetRecordSize();
+    encoding = telemSetEncoding(argsPtr->encoding);
+
+    Payload pld = payPoolGet(sizeof(mask) + sizeof(recordSize) + sizeof(encoding),
+            status, CMD_SET_TELEM_FIELDS);
+    if (pld == NULL) {
+        return;
+    }
+    payAppendData(pld, 0, sizeof(mask), (unsigned char*) (&mask));
+    payAppendData(pld, sizeof(mask), sizeof(recordSize), (unsigned char*) (&recordSize));
+    payAppendData(pld, sizeof(mask) + sizeof(recordSize), sizeof(encoding),
+            (unsigned char*) (&encoding));
+    radioSendPayload(macGetDestAddr(), pld);
+}
+
+// send the header of the selected run, used by the host to decode records
+static void cmdGetTelemHeader(unsigned char status, unsigned char length, unsigned char *frame) {
+    telemLogHeaderStruct hdr;
+    telemReadLogHeader(&hdr);
+    payPoolSend(sizeof(hdr),
+            (unsigned char *) (&hdr), status, CMD_GET_TELEM_HEADER);
+}
+
+// turn live telemetry streaming on or off; records use the current field mask
+// and are sent back as CMD_TELEM_STREAM packets from telemService()
+static void cmdTelemStream(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdTelemStream, argsPtr, frame);
+    telemStreamOnOff(argsPtr->onoff, argsPtr->skip);
+}
+
+static void cmdReadbackAck(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdReadbackAck, argsPtr, frame);
+    unsigned int numNacks = argsPtr->numNacks;
+    if (numNacks > TELEM_READBACK_MAX_NACKS) {
+        numNacks = TELEM_READBACK_MAX_NACKS;
+    }
+    telemReadbackAck(argsPtr->ackSeq, numNacks, argsPtr->nacks);
+}
+
+// counters of the current or last logged run, including samples dropped
+// because the RAM staging ring or the erased flash area was full
+static void cmdGetTelemStats(unsigned char status, unsigned char length, unsigned char *frame) {
+    telemLogStatsStruct stats;
+    telemGetLogStats(&stats);
+    payPoolSend(sizeof(stats),
+            (unsigned char *) (&stats), status, CMD_GET_TELEM_STATS);
+}
+
+// start or stop circular logging; the log is frozen after a trigger, see
+// telemCircularStart()
+static void cmdCircularLog(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdCircularLog, argsPtr, frame);
+    if (argsPtr->onoff) {
+        telemCircularStart(argsPtr->preSamples, argsPtr->postSamples,
+                argsPtr->triggerMask, argsPtr->accelThreshold);
+    } else {
+        telemCircularStop();
+    }
+}
+
+static void cmdLogTrigger(unsigned char status, unsigned char length, unsigned char *frame) {
+    telemLogTrigger(TELEM_TRIG_COMMAND);
+}
+
+// send the log directory, oldest run first, CMD_LOG_DIR_PER_PKT entries per
+// packet: [first index][run count][entries]. An empty directory is sent as
+// a packet with no entries.
+static void cmdGetLogDir(unsigned char status, unsigned char length, unsigned char *frame) {
+    unsigned int count = telemLogDirCount();
+    unsigned int i, n;
+    struct {
+        unsigned int index;
+        unsigned int count;
+        telemLogDirEntryStruct entries[CMD_LOG_DIR_PER_PKT];
+    } pkt;
+
+    pkt.count = count;
+    i = 0;
+    do {
+        pkt.index = i;
+        for (n = 0; (n < CMD_LOG_DIR_PER_PKT) && (i < count); n++, i++) {
+            telemLogDirGet(i, &pkt.entries[n]);
+        }
+        payPoolSend(2 * sizeof(unsigned int)
+                + n * sizeof(telemLogDirEntryStruct),
+                (unsigned char *) (&pkt), status, CMD_GET_LOG_DIR);
+    } while (i < count);
+}
+
+// select the run to read back; replies with its header, as CMD_GET_TELEM_HEADER
+static void cmdSelectLog(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdSelectLog, argsPtr, frame);
+    telemLogSelect(argsPtr->index);
+    cmdGetTelemHeader(status, 0, frame);
+}
+
+static void cmdClearLogDir(unsigned char status, unsigned char length, unsigned char *frame) {
+    telemLogDirClear();
+}
+
+// several commands in one frame, dispatched in order through cmd_func[].
+// Each record is [type][length][args], args padded to an even length so the
+// next record stays word aligned for PKT_UNPACK. Confirmations are collected
+// into one CMD_MULTI reply listing the types dispatched; a malformed record
+// ends the frame, and is not listed.
+static void cmdMulti(unsigned char status, unsigned char length, unsigned char *frame) {
+    unsigned char types[CMD_MULTI_MAX_RECORDS];
+    unsigned char count = 0;
+    unsigned char idx = 0;
+    unsigned char type, len;
+
+    cmdInMulti = 1;
+    while ((idx + 2 <= length) && (count < CMD_MULTI_MAX_RECORDS)) {
+        type = frame[idx];
+        len = frame[idx + 1];
+        if ((type == CMD_MULTI) || (len > length - idx - 2) ||
+                (cmdDispatch(status, type, len, frame + idx + 2) != CMD_RESULT_OK)) {
+            break;
+        }
+        types[count++] = type;
+        idx += 2 + ((len + 1) & ~1);
+    }
+    cmdInMulti = 0;
+
+    payPoolSend(count, types, status, CMD_MULTI);
+}
+
+// disable the motor outputs, see estop.c; applied from cmdPump(). The robot
+// stays stopped until it is reset.
+static void cmdEmergencyStop(unsigned char status, unsigned char length, unsigned char *frame) {
+    EmergencyStop();
+}
+
+// streamed speed and turn targets, smoothed on the robot, see teleop.c. No
+// reply, to keep the stream light; applied from cmdPump().
+static void cmdTeleop(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdTeleop, argsPtr, frame);
+    teleopSetTarget(argsPtr->speed, argsPtr->turn, argsPtr->seq);
+}
+
+// write the parameters in use (as last set by the setter commands) to flash
+static void cmdSaveParams(unsigned char status, unsigned char length, unsigned char *frame) {
+    cmdReplyParams(status, CMD_SAVE_PARAMS, nvParamSave());
+}
+
+// reload the saved parameters, dropping changes made since the last save.
+// Gains and settings are taken up by the modules at boot, so a reset is
+// needed for the reloaded values to take effect.
+static void cmdLoadParams(unsigned char status, unsigned char length, unsigned char *frame) {
+    cmdReplyParams(status, CMD_LOAD_PARAMS, nvParamLoad());
+}
+
+// return the parameters to the compile time defaults; save to keep them
+static void cmdDefaultParams(unsigned char status, unsigned char length, unsigned char *frame) {
+    nvParamDefaults();
+    cmdReplyParams(status, CMD_DEFAULT_PARAMS, 1);
+}
+
+static void cmdReplyParams(unsigned char status, unsigned char type, unsigned int result) {
+    cmdParamReplyStruct reply;
+
+    reply.result = result;
+    reply.source = nvParamSource();
+    reply.params = *nvParamGet();
+    cmdReply(status, type, sizeof(reply), (unsigned char *) (&reply));
+}
+
+// report one parameter: registry entry and current value. An unknown id
+// is reported with type NVPARAM_TYPE_NONE.
+static void cmdGetParam(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdGetParam, argsPtr, frame);
+    nvParamInfoStruct info;
+
+    nvParamInfo(argsPtr->id, &info);
+    payPoolSend(sizeof(info),
+            (unsigned char *) (&info), status, CMD_GET_PARAM);
+}
+
+// set up to CMD_SET_PARAM_MAX parameters by id, all or none, and applied
+// together; see nvParamSetValues(). Replies with the result and the values
+// in effect afterwards. Values are not saved to flash until CMD_SAVE_PARAMS.
+static void cmdSetParam(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdSetParam, argsPtr, frame);
+    struct {
+        cmdSetParamReplyStruct hdr;
+        nvParamValueStruct values[CMD_SET_PARAM_MAX];
+    } reply;
+    nvParamInfoStruct info;
+    unsigned int i, count;
+
+    count = argsPtr->count;
+    if ((count > CMD_SET_PARAM_MAX) ||
+            (length < sizeof(unsigned int) + count * sizeof(nvParamValueStruct))) {
+        return;
+    }
+    reply.hdr.result = nvParamSetValues(count, argsPtr->values, &reply.hdr.failed);
+    for (i = 0; i < count; i++) {
+        nvParamInfo(argsPtr->values[i].id, &info);
+        reply.values[i].id = info.id;
+        reply.values[i].value = info.value;
+    }
+    cmdReply(status, CMD_SET_PARAM, sizeof(reply.hdr) + count * sizeof(nvParamValueStruct),
+            (unsigned char *) (&reply));
+}
+
+// list the registry, CMD_LIST_PARAMS_PER_PKT entries from id start
+static void cmdListParams(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdListParams, argsPtr, frame);
+    struct {
+        cmdListParamsReplyStruct hdr;
+        nvParamInfoStruct info[CMD_LIST_PARAMS_PER_PKT];
+    } reply;
+
+    reply.hdr.total = NVPARAM_COUNT;
+    reply.hdr.start = argsPtr->start;
+    reply.hdr.count = 0;
+    while ((reply.hdr.count < CMD_LIST_PARAMS_PER_PKT) &&
+            nvParamInfo(reply.hdr.start + reply.hdr.count, &reply.info[reply.hdr.count])) {
+        reply.hdr.count++;
+    }
+    payPoolSend(sizeof(reply.hdr) + reply.hdr.count * sizeof(nvParamInfoStruct),
+            (unsigned char *) (&reply), status, CMD_LIST_PARAMS);
+}
+
+// start a firmware upload into the dfmem staging area, see ota.h
+static void cmdOtaBegin(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdOtaBegin, argsPtr, frame);
+    cmdReplyOta(status, CMD_OTA_BEGIN, otaBegin(argsPtr->length, argsPtr->rawLength,
+            argsPtr->crc, argsPtr->rawCrc));
+}
+
+// one chunk of the image. The host streams a window of chunks and asks for
+// a reply on the last one; the offset in the reply is where to carry on,
+// which is also where to go back to after a lost chunk.
+static void cmdOtaData(unsigned char status, unsigned char length, unsigned char *frame) {
+    PKT_UNPACK(_args_cmdOtaData, argsPtr, frame);
+    unsigned int result;
+
+    result = otaData(argsPtr->offset, argsPtr->data,
+            length - sizeof(unsigned long) - sizeof(unsigned int));
+    if ((argsPtr->flags & CMD_OTA_FLAG_ACK) ||
+            ((result != OTA_OK) && (result != OTA_OUT_OF_ORDER))) {
+        cmdReplyOta(status, CMD_OTA_DATA, result);
+    }
+}
+
+// check the stored image; the reply carries the CRCs and length computed
+static void cmdOtaVerify(unsigned char status, unsigned char length, unsigned char *frame) {
+    cmdReplyOta(status, CMD_OTA_VERIFY, otaVerify());
+}
+
+// drop an upload in progress, so that logging and parameter saves can use
+// the dfmem buffers again
+static void cmdOtaAbort(unsigned char status, unsigned char length, unsigned char *frame) {
+    cmdReplyOta(status, CMD_OTA_ABORT, otaAbort());
+}
+
+// state of the staging area, e.g. VERIFIED once an image is ready
+static void cmdOtaStatus(unsigned char status, unsigned char length, unsigned char *frame) {
+    cmdReplyOta(status, CMD_OTA_STATUS, OTA_OK);
+}
+
+// copy the verified image into program flash and reset into it, see
+// otaApply(); acknowledged first, as the robot does not come back
+static void cmdWritePM(unsigned char status, unsigned char length, unsigned char *frame) {
+    otaStatusStruct ota;
+
+    otaGetStatus(&ota);
+    if (ota.state != OTA_STATE_VERIFIED) {
+        cmdReplyOta(status, CMD_WRITE_PM, OTA_BAD_STATE);
+        return;
+    }
+    cmdReplyOta(status, CMD_WRITE_PM, OTA_OK);
+    delay_ms(10);
+    cmdReplyOta(status, CMD_WRITE_PM, otaApply());
+}
+
+static void cmdReplyOta(unsigned char status, unsigned char type, unsigned int result) {
+    otaStatusStruct reply;
+
+    otaGetStatus(&reply);
+    reply.result = result;
+    payPoolSend(sizeof(reply),
+            (unsigned char *) (&reply), status, type);
+}
+
+// send a confirmation packet; held back while a CMD_MULTI frame is
+// dispatched, which is acknowledged as a whole, and in cmdPump(), which
+// cannot allocate a payload from the ISR
+static void cmdReply(unsigned char status, unsigned char type, unsigned char length, unsigned char *data) {
+    if (cmdInPump) {
+        cmdPumpReplied = 1;
+        return;
+    }
+    if (cmdInMulti) {
+        return;
+    }
+    payPoolSend(length, data, status, type);
+}
+
+// run a command after checking its type and argument length
+static unsigned char cmdDispatch(unsigned char status, unsigned char type, unsigned char length, unsigned char *frame) {
+    //Due to bugs, command may be a surprious value; check explicitly
+    if ((type > MAX_CMD_FUNC) || (cmd_func[type] == &cmdNop)) {
+        return CMD_RESULT_BAD_TYPE;
+    }
+    if (length < cmd_len[type]) {
+        return CMD_RESULT_BAD_LENGTH;
+    }
+    cmd_func[type](status, length, frame);
+    return CMD_RESULT_OK;
+}
+
+// run a command carrying sequence number seq, unless it was already run, and
+// acknowledge it. A resent command is not run again; its first result is
+// sent back.
+static void cmdHandleSequenced(unsigned char seq, unsigned char type, unsigned char length, unsigned char *frame) {
+    unsigned char result;
+    char duplicate;
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    duplicate = cmdSeqFind(seq, &result);
+    _T5IE = lockT5IE;
+
+    if (!duplicate) {
+        result = cmdDispatch(seq, type, length, frame);
+        lockT5IE = _T5IE;
+        _T5IE = 0;
+        cmdSeqRecord(seq, result);
+        _T5IE = lockT5IE;
+    }
+    cmdSendAck(seq, type, result, duplicate);
+}
+
+// look up seq among the recent sequenced commands; the window is shared with
+// cmdPump(), so T5 must be masked from the main loop
+static char cmdSeqFind(unsigned char seq, unsigned char *result) {
+    unsigned long now = getT5_ticks();
+    unsigned char i;
+
+    for (i = 0; i < CMD_SEQ_WINDOW; i++) {
+        if ((seqNum[i] == seq) && (now - seqTime[i] < CMD_SEQ_TIMEOUT)) {
+            *result = seqResult[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void cmdSeqRecord(unsigned char seq, unsigned char result) {
+    seqNum[seqNext] = seq;
+    seqResult[seqNext] = result;
+    seqTime[seqNext] = getT5_ticks();
+    seqNext = (seqNext + 1) % CMD_SEQ_WINDOW;
+}
+
+// CMD_ACK or CMD_NACK: [seq][type][result][duplicate]
+static void cmdSendAck(unsigned char seq, unsigned char type, unsigned char result, unsigned char duplicate) {
+    unsigned char reply[4];
+
+    reply[0] = seq;
+    reply[1] = type;
+    reply[2] = result;
+    reply[3] = duplicate;
+    payPoolSend(sizeof(reply), reply, seq,
+            (result == CMD_RESULT_OK) ? CMD_ACK : CMD_NACK);
+}
+
+// stop, thrust and steering commands, applied as soon as they are received.
+// Their handlers must not allocate, see cmdReply().
+static char cmdIsPriority(unsigned char type) {
+    switch (type) {
+        case CMD_EMERGENCY_STOP:
+        case CMD_SET_THRUST:
+        case CMD_SET_THRUST_OPENLOOP:
+        case CMD_SET_THRUST_CLOSEDLOOP:
+        case CMD_SET_CTRLD_TURN_RATE:
+        case CMD_SET_HEADING:
+        case CMD_TELEOP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// T5: move received payloads from the radio into cmdQueue, applying priority
+// commands on the way, so that a stop takes at most one T5 period however
+// long the main loop is busy. Everything else, replies included, is left to
+// cmdHandleRadioRxBuffer(). The radio is always drained: the last
+// CMD_QUEUE_RESERVED entries are kept for priority commands, and once the
+// main loop is that far behind other commands are dropped, sequenced ones
+// unacknowledged so that the host resends them. A priority command with
+// nothing left to send takes no entry then; it is applied here. Payloads
+// not queued are parked in cmdSpent for the main loop to free; the pump
+// never allocates or frees. Only if the main loop has not run for
+// CMD_SPENT_SIZE such payloads do they wait in the radio queue.
+static void cmdPump(void) {
+    cmdQueueEntry *entry;
+    Payload pld;
+    unsigned int room, spentNext;
+    unsigned char status, type, keep;
+
+    while (!radioIsRxQueueEmpty()) {
+        spentNext = (cmdSpentHead + 1) % CMD_SPENT_SIZE;
+        if (spentNext == cmdSpentTail) {
+            return;
+        }
+        pld = radioReceivePayload();
+        if (pld == NULL) {
+            return;
+        }
+        //The head entry is never read by the main loop, even when full
+        room = (cmdTail + CMD_QUEUE_SIZE - cmdHead - 1) % CMD_QUEUE_SIZE;
+        entry = &cmdQueue[cmdHead];
+        entry->pld = pld;
+        entry->arrival = swatchTic();
+        entry->applied = 0;
+
+        type = payGetType(pld);
+        status = payGetStatus(pld);
+        keep = (room > CMD_QUEUE_RESERVED);
+        if (cmdIsPriority(type)) {
+            cmdInPump = 1;
+            cmdPumpReplied = 0;
+            entry->duplicate = (status != 0) && cmdSeqFind(status, &entry->result);
+            if (!entry->duplicate) {
+                entry->result = cmdDispatch(status, type, pld->data_length,
+                        payGetData(pld));
+                if (status != 0) {
+                    cmdSeqRecord(status, entry->result);
+                }
+            }
+            entry->replied = cmdPumpReplied;
+            entry->done = swatchTic();
+            entry->applied = 1;
+            cmdInPump = 0;
+            if ((status == 0) && !entry->replied) {
+                //Nothing left to send; only the statistics need the entry
+                keep = keep || (room > 0);
+                if (!keep) {
+                    cmdSpent[cmdSpentHead] = pld;
+                    cmdSpentHead = spentNext;
+                    continue;
+                }
+            } else {
+                keep = (room > 0);
+            }
+        }
+        if (!keep) {
+            cmdSpent[cmdSpentHead] = pld;
+            cmdSpentHead = spentNext;
+            cmdDropped++;
+            continue;
+        }
+        cmdHead = (cmdHead + 1) % CMD_QUEUE_SIZE;
+    }
+}
+
+// account one command: queueing is arrival to dispatch start, execution is
+// dispatch start to handler completion, replies included. Commands applied by
+// cmdPump() are not queued; their execution is timed in the ISR, and those
+// that took no entry are not counted. swatchReset()
+// restarts the clock, intervals spanning it are not counted.
+static void cmdStatsUpdate(cmdQueueEntry *entry, unsigned long start, unsigned long end) {
+    unsigned long queued, exec, t;
+    unsigned int depth, bin;
+
+    if (entry->applied) {
+        cmdStats.priority++;
+        start = entry->arrival;
+        end = entry->done;
+    }
+    if ((start < entry->arrival) || (end < start)) {
+        return;
+    }
+    queued = start - entry->arrival;
+    exec = end - start;
+
+    cmdStats.count++;
+    cmdStats.queueSum += queued;
+    if (queued > cmdStats.queueMax) {
+        cmdStats.queueMax = queued;
+    }
+    cmdStats.execSum += exec;
+    if (exec > cmdStats.execMax) {
+        cmdStats.execMax = exec;
+    }
+    depth = (cmdHead - cmdTail + CMD_QUEUE_SIZE) % CMD_QUEUE_SIZE;
+    if (depth > cmdStats.depthMax) {
+        cmdStats.depthMax = depth;
+    }
+
+    //bin 0 below 128us, then one bin per doubling
+    bin = 0;
+    for (t = queued >> 7; t && (bin < CMD_STATS_BINS - 1); t >>= 1) {
+        bin++;
+    }
+    cmdStats.queueHist[bin]++;
+}
+
+// reply with the command latency statistics, and clear them if the optional
+// reset flag is set
+static void cmdGetCmdStats(unsigned char status, unsigned char length, unsigned char *frame) {
+    char reset = (length > 0) && frame[0];
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    cmdStats.dropped = cmdDropped;
+    if (reset) {
+        cmdDropped = 0;
+    }
+    _T5IE = lockT5IE;
+    payPoolSend(sizeof(cmdStats),
+            (unsigned char *) (&cmdStats), status, CMD_GET_CMD_STATS);
+    if (reset) {
+        memset(&cmdStats, 0, sizeof(cmdStats));
+    }
+}
+
+// reply with the TX payload stock counters, see pay_pool.h, and clear them
+// if the optional reset flag is set
+static void cmdGetPoolStats(unsigned char status, unsigned char length, unsigned char *frame) {
+    payPoolStatsStruct stats;
+
+    payPoolGetStats(&stats);
+    payPoolSend(sizeof(stats), (unsigned char *) (&stats), status, CMD_GET_POOL_STATS);
+    if ((length > 0) && frame[0]) {
+        payPoolResetStats();
+    }
+}
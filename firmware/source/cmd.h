@@ -13,9 +13,12 @@
 #include "move_queue.h"
 #include "tail_queue.h"
 #include "hall.h"
+#include "telem.h"
+#include "nvparams.h"
+#include "ota.h"
 
 #define CMD_VECTOR_SIZE				0xFF //full length vector
-#define MAX_CMD_FUNC				0x9F
+#define MAX_CMD_FUNC				0xBF
 
 #define CMD_SET_THRUST_OPENLOOP     0x80
 #define CMD_SET_THRUST_CLOSEDLOOP   0x81
@@ -36,6 +39,36 @@
 #define CMD_ZERO_POS                0x90
 #define CMD_SET_HALL_GAINS          0x91
 #define CMD_SET_TAIL_QUEUE          0x92
+#define CMD_HALL_EDGE_STREAM        0x93
+#define CMD_GET_ODOMETRY            0x94
+#define CMD_SET_ODOMETRY            0x95
+#define CMD_SET_HEADING             0x96
+#define CMD_SET_TELEM_FIELDS        0x97
+#define CMD_GET_TELEM_HEADER        0x98
+#define CMD_TELEM_STREAM            0x99
+#define CMD_READBACK_ACK            0x9A
+#define CMD_GET_TELEM_STATS         0x9B
+#define CMD_CIRCULAR_LOG            0x9C
+#define CMD_LOG_TRIGGER             0x9D
+#define CMD_GET_LOG_DIR             0x9E
+#define CMD_SELECT_LOG              0x9F
+#define CMD_CLEAR_LOG_DIR           0xA0
+#define CMD_MULTI                   0xA1
+#define CMD_EMERGENCY_STOP          0xA2
+#define CMD_GET_CMD_STATS           0xA3
+#define CMD_TELEOP                  0xA4
+#define CMD_SAVE_PARAMS             0xA5
+#define CMD_LOAD_PARAMS             0xA6
+#define CMD_DEFAULT_PARAMS          0xA7
+#define CMD_GET_PARAM               0xA8
+#define CMD_SET_PARAM               0xA9
+#define CMD_LIST_PARAMS             0xAA
+#define CMD_OTA_BEGIN               0xAB
+#define CMD_OTA_DATA                0xAC
+#define CMD_OTA_VERIFY              0xAD
+#define CMD_OTA_ABORT               0xAE
+#define CMD_OTA_STATUS              0xAF
+#define CMD_GET_POOL_STATS          0xB0
 
 //Argument lengths
 //lenghts are in bytes
@@ -58,6 +91,7 @@
 
 void cmdSetup(void);
 void cmdHandleRadioRxBuffer(void);
+unsigned char cmdIsQueueEmpty(void);
 void cmdEcho(unsigned char status, unsigned char length, unsigned char *frame);
 
 
@@ -125,8 +159,10 @@ typedef struct{
 } _args_cmdEraseSector;
 
 //cmdFlashReadback
+//Chunk range [startSeq, endSeq) of the log, see telemReadbackStart()
 typedef struct{
-	unsigned long samples;
+	unsigned long startSeq;
+	unsigned long endSeq;
 } _args_cmdFlashReadback;
 
 //cmdSleep
@@ -141,6 +177,12 @@ typedef struct{
     int velR[NUM_VELS];
 } _args_cmdSetVelProfile;
 
+//cmdEraseSector
+typedef struct {
+    unsigned long numSamples;
+    char eraseAhead; // optional, erase only just ahead of the log
+} _args_cmdEraseSectors;
+
 //cmdHallTelemetry
 typedef struct {
     unsigned long startDelay; // recording start time
@@ -158,5 +200,154 @@ typedef struct {
     int params[3];
 } _args_cmdSetTailQueue;
 
+//cmdHallEdgeStream
+typedef struct {
+    char onoff;
+} _args_cmdHallEdgeStream;
+
+//cmdSetOdometry
+typedef struct {
+    unsigned long strideUm; // 0 leaves stride length unchanged
+    char reset;
+} _args_cmdSetOdometry;
+
+//cmdSetHeading
+typedef struct {
+    int heading; // BAMS16
+    char relative;
+} _args_cmdSetHeading;
+
+//cmdSetTelemFields
+typedef struct {
+    unsigned long fieldMask; // bit n enables field id n, see telem.h
+    unsigned char encoding; // TELEM_ENC_RAW or TELEM_ENC_DELTA
+} _args_cmdSetTelemFields;
+
+//cmdTelemStream
+typedef struct {
+    char onoff;
+    unsigned int skip; // stream rate is 300Hz / skip
+} _args_cmdTelemStream;
+
+//cmdReadbackAck
+typedef struct {
+    unsigned long ackSeq; // all chunks below this were received
+    unsigned int numNacks;
+    unsigned long nacks[TELEM_READBACK_MAX_NACKS]; // missing chunks
+} _args_cmdReadbackAck;
+
+//cmdCircularLog
+typedef struct {
+    unsigned int preSamples; // history kept before the trigger
+    unsigned int postSamples; // samples logged from the trigger on
+    unsigned int triggerMask; // TELEM_TRIG_* sources
+    int accelThreshold; // raw counts, for TELEM_TRIG_ACCEL
+    char onoff;
+} _args_cmdCircularLog;
+
+//cmdGetLogDir
+#define CMD_LOG_DIR_PER_PKT 4
+
+//cmdSelectLog
+typedef struct {
+    unsigned int index; // log directory entry
+} _args_cmdSelectLog;
+
+//cmdMulti
+#define CMD_MULTI_MAX_RECORDS 16
+
+//Received commands waiting for the main loop, see cmdPump()
+#define CMD_QUEUE_SIZE          32
+//Entries only priority commands may take, see cmdPump()
+#define CMD_QUEUE_RESERVED      4
+//Payloads taken off the radio but not queued, freed from the main loop
+#define CMD_SPENT_SIZE          16
+
+//Sequenced commands, status != 0; see cmdHandleSequenced()
+#define CMD_SEQ_WINDOW          16
+#define CMD_SEQ_TIMEOUT         1500 //T5 ticks, 5s
+
+//cmdTeleop
+typedef struct {
+    int speed; // leg controller input, mean of both sides
+    int turn; // half the right - left difference
+    unsigned char seq; // stream counter, older packets are dropped
+} _args_cmdTeleop;
+
+//cmdGetCmdStats
+#define CMD_STATS_BINS          12
+
+//Command latency, in us from the swatch; see cmdStatsUpdate()
+typedef struct {
+    unsigned long count; // commands accounted
+    unsigned long queueSum; // off the radio to dispatch
+    unsigned long queueMax;
+    unsigned long execSum; // dispatch to handler completion
+    unsigned long execMax;
+    unsigned int priority; // applied from the T5 ISR
+    unsigned int depthMax; // deepest command queue seen
+    unsigned int dropped; // main loop too far behind, see cmdPump()
+    unsigned int queueHist[CMD_STATS_BINS]; // [0,128us), then doubling
+} cmdStatsStruct;
+
+//cmdSaveParams, cmdLoadParams, cmdDefaultParams reply
+typedef struct {
+    unsigned int result; // 1 if the operation succeeded
+    unsigned int source; // NVPARAM_SRC_* of the values in use
+    nvParamStruct params;
+} cmdParamReplyStruct;
+
+//cmdGetParam
+typedef struct {
+    unsigned int id; // NVPARAM_IDS
+} _args_cmdGetParam;
+
+//cmdSetParam
+#define CMD_SET_PARAM_MAX       8
+typedef struct {
+    unsigned int count;
+    nvParamValueStruct values[CMD_SET_PARAM_MAX]; // only count are sent
+} _args_cmdSetParam;
+
+//cmdSetParam reply; the values in effect follow
+typedef struct {
+    unsigned int result; // NVPARAM_OK, NVPARAM_BAD_ID, NVPARAM_OUT_OF_RANGE
+    unsigned int failed; // index of the rejected value
+} cmdSetParamReplyStruct;
+
+//cmdListParams
+#define CMD_LIST_PARAMS_PER_PKT 5
+typedef struct {
+    unsigned int start; // first id to list
+} _args_cmdListParams;
+
+//cmdListParams reply header; count nvParamInfoStruct entries follow
+typedef struct {
+    unsigned int total; // NVPARAM_COUNT
+    unsigned int start;
+    unsigned int count;
+} cmdListParamsReplyStruct;
+
+//cmdOtaBegin
+typedef struct {
+    unsigned long length; // compressed image bytes
+    unsigned long rawLength; // decoded bytes
+    unsigned int crc; // CRC-16 of the compressed image
+    unsigned int rawCrc; // CRC-16 of the decoded image
+} _args_cmdOtaBegin;
+
+//cmdOtaData
+#define CMD_OTA_FLAG_ACK        0x01 // reply with the progress
+typedef struct {
+    unsigned long offset; // in the compressed image
+    unsigned int flags;
+    unsigned char data[OTA_CHUNK_MAX]; // up to OTA_CHUNK_MAX bytes sent
+} _args_cmdOtaData;
+
+//Result codes of CMD_ACK / CMD_NACK replies
+#define CMD_RESULT_OK           0
+#define CMD_RESULT_BAD_TYPE     1
+#define CMD_RESULT_BAD_LENGTH   2
+
 #endif // __CMD_H
 
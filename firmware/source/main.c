@@ -26,7 +26,13 @@
 #include "steering.h"
 #include "telem.h"
 #include "hall.h"
+#include "odometry.h"
+#include "gyro_bias.h"
 #include "tail_ctrl.h"
+#include "teleop.h"
+#include "nvparams.h"
+#include "ota.h"
+#include "pay_pool.h"
 
 #include <stdlib.h>
 
@@ -43,9 +49,8 @@ int main(void) {
     wakeTime = 0;
     dcCounter = 0;
 
-    WordVal src_addr_init = {RADIO_SRC_ADDR};
-    WordVal src_pan_id_init = {RADIO_SRC_PAN_ID};
-    WordVal dst_addr_init = {RADIO_DST_ADDR};
+    WordVal src_addr_init, src_pan_id_init, dst_addr_init;
+    nvParamStruct* params;
 
     SetupClock();
     SwitchClocks();
@@ -56,24 +61,35 @@ int main(void) {
     mSET_AND_SAVE_CPU_IP(old_ipl, 1)
 
     swatchSetup();
+    dfmemSetup();
+    nvParamSetup(); //Saved settings, or the defaults in settings.h et al.
+    params = nvParamGet();
+    otaSetup();
+
+    src_addr_init.Val = params->radioSrcAddr;
+    src_pan_id_init.Val = params->radioPanId;
+    dst_addr_init.Val = params->radioDstAddr;
     radioInit(src_addr_init, src_pan_id_init, RADIO_RXPQ_MAX_SIZE, RADIO_TXPQ_MAX_SIZE);
-    radioSetChannel(RADIO_CHANNEL); //Set to my channel
+    radioSetChannel(params->radioChannel); //Set to my channel
     macSetDestAddr(dst_addr_init);
+    payPoolSetup(); //TX payloads, topped up from the main loop
 
-    dfmemSetup();
     xlSetup();
     gyroSetup();
     mcSetup();
     cmdSetup();
     adcSetup();
     telemSetup(); //Timer 5
+    gyroBiasSetup(); //Timer 5, ahead of steering/odometry
 
 #ifdef HALL_SENSORS
     hallSetup();    // Timer 1, Timer 2
+    odoSetup();     // Timer 5, needs hall counts
     //hallSteeringSetup(); //doesn't exist yet
 #else //No hall sensors, standard BEMF control
-    //legCtrlSetup(); // Timer 1
-    //steeringSetup();  //Timer 5
+    legCtrlSetup(); // Timer 1
+    steeringSetup();  //Timer 5, after gyroBiasSetup()
+    teleopSetup(); // after legCtrlSetup(), which configures Timer 1
 #endif
 
     //tailCtrlSetup();
@@ -100,10 +116,12 @@ int main(void) {
         LED_YELLOW = count&0x1000 ? 0 : 1;
         
         cmdHandleRadioRxBuffer();
+        telemService();
+        payPoolRefill();
 
 #ifndef __DEBUG //Idle will not work with debug
         //Simple idle:
-        if (radioIsRxQueueEmpty()) {
+        if (cmdIsQueueEmpty()) {
             Idle();
             //_T1IE = 0;
         }
@@ -0,0 +1,16 @@
+// crc.c
+// Bytewise CRC-16/CCITT, without a table to keep it out of program memory.
+// Pass CRC16_INIT to start, or a previous result to continue over more data.
+
+#include "crc.h"
+
+unsigned int crc16(unsigned int crc, unsigned char *data, unsigned int length) {
+    unsigned int x;
+
+    while (length--) {
+        x = (crc >> 8) ^ *data++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+    }
+    return crc;
+}
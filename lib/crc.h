@@ -0,0 +1,10 @@
+#ifndef __CRC_H
+#define __CRC_H
+
+// CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, no reflection, no final xor.
+// Matches binascii.crc_hqx(data, 0xFFFF) on the host.
+#define CRC16_INIT      0xFFFF
+
+unsigned int crc16(unsigned int crc, unsigned char *data, unsigned int length);
+
+#endif // __CRC_H
@@ -44,6 +44,7 @@
  */
 
 #include "pwm.h"
+#include "telem.h"
 
 /*****************************************************************************
 * Function Name : EmergencyStop
@@ -57,4 +58,5 @@ void EmergencyStop(){
 	PDC2 = 0;
 	PDC3 = 0;
 	PDC4 = 0;
+	telemLogTrigger(TELEM_TRIG_ESTOP); //freeze a circular log around the stop
 }
@@ -19,6 +19,29 @@
 #define FLASH_IMU_PAGE_START_LOC     0x0100
 #define FLASH_IMU_BYTE_START_LOC     0
 
+// Telemetry log: directory page, then runs back to back, each a header page
+// followed by packed records
+//
+#define TELEM_LOG_DIR_PAGE           0
+#define TELEM_LOG_FIRST_RUN_PAGE     1
+
+// Erase blocks at the end of the flash kept out of the telemetry log.
+// The first page of the first one holds the parameter block (nvparams.c).
+//
+#define FLASH_RESERVED_BLOCKS        1
+
+// Firmware update staging area (ota.c), the blocks just below the parameter
+// block: a header page, then the compressed image. Sized for a full
+// dsPIC33FJ128 image, 44K instructions of 3 bytes, plus RLE overhead.
+//
+#define FLASH_OTA_IMAGE_MAX          0x22000UL // bytes, compressed
+#define FLASH_OTA_BLOCKS(geo)        ((FLASH_OTA_IMAGE_MAX + (geo).bytes_per_page \
+                                     * ((unsigned long)(geo).pages_per_block + 1) - 1) \
+                                     / ((unsigned long)(geo).bytes_per_page * (geo).pages_per_block))
+// Pages at the end of the flash not used by the telemetry log
+#define FLASH_RESERVED_PAGES(geo)    ((FLASH_RESERVED_BLOCKS + FLASH_OTA_BLOCKS(geo)) \
+                                     * (geo).pages_per_block)
+
 
 #endif  // __FLASHMEM_H
 
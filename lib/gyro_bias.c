@@ -0,0 +1,170 @@
+// gyro_bias.c
+// Continuous gyro offset estimation while the robot is idle and stationary.
+// Consumers use gyroBiasGetOffsets() in place of gyroGetOffsets().
+
+#include "gyro_bias.h"
+#include "gyro.h"
+#include "xl.h"
+#include "move_queue.h"
+#include "sys_service.h"
+#include "p33Fxxxx.h"
+
+//Inline functions
+#define ABS(a)	   (((a) < 0) ? -(a) : (a))
+
+extern moveCmdT currentMove, idleMove;
+
+static long biasQ8[3]; // full offset, Q8
+static long xlMeanQ4[3]; // accel running mean, Q4
+static long xlVar[3]; // accel running variance, counts^2
+static unsigned int stillCount;
+static long blockSum[3];
+static unsigned int blockCount;
+static unsigned long headingQ16; // BAMS16 in the upper word
+
+//Function to be installed into T5
+static void gyroBiasServiceRoutine(void);
+static unsigned char gyroBiasXlStill(int* xldata);
+
+////   Public functions
+////////////////////////
+
+void gyroBiasSetup(void) {
+    int retval;
+    gyroBiasReset();
+    retval = sysServiceInstallT5(gyroBiasServiceRoutine);
+}
+
+// Start again from the calibration offsets
+void gyroBiasReset(void) {
+    int offsets[3];
+    int xldata[3];
+    int i;
+    char lockT5IE;
+
+    gyroGetOffsets(offsets);
+    xlGetXYZ((unsigned char*) xldata);
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    for (i = 0; i < 3; i++) {
+        biasQ8[i] = (long) offsets[i] << 8;
+        xlMeanQ4[i] = (long) xldata[i] << 4;
+        xlVar[i] = 0;
+    }
+    stillCount = 0;
+    blockCount = 0;
+    _T5IE = lockT5IE;
+}
+
+void gyroBiasGetOffsets(int* offsets) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        offsets[i] = (int) ((biasQ8[i] + 128) >> 8);
+    }
+}
+
+void gyroBiasGetOffsetsQ8(long* offsets) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        offsets[i] = biasQ8[i];
+    }
+}
+
+unsigned char gyroBiasIsStationary(void) {
+    return stillCount >= GYRO_BIAS_HOLDOFF;
+}
+
+int gyroBiasGetHeading(void) {
+    int heading;
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    heading = (int) (headingQ16 >> 16);
+    _T5IE = lockT5IE;
+    return heading;
+}
+
+void gyroBiasSetHeading(int heading) {
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    headingQ16 = (unsigned long) heading << 16;
+    _T5IE = lockT5IE;
+}
+
+////   Private functions
+////////////////////////
+
+// Exponential running variance of each accel axis, 16 sample time constant
+static unsigned char gyroBiasXlStill(int* xldata) {
+    int i;
+    long d;
+    long varSum = 0;
+
+    for (i = 0; i < 3; i++) {
+        xlMeanQ4[i] += (((long) xldata[i] << 4) - xlMeanQ4[i]) >> 4;
+        d = xldata[i] - (xlMeanQ4[i] >> 4);
+        if (ABS(d) > 0x7FFF) {
+            d = 0x7FFF;
+        }
+        xlVar[i] += (d * d - xlVar[i]) >> 4;
+        varSum += xlVar[i];
+    }
+    return varSum < GYRO_BIAS_XL_VAR_THRESH;
+}
+
+/////////       Gyro bias ISR          ////////
+////////  Installed to Timer5 @ 300hz  ////////
+static void gyroBiasServiceRoutine(void) {
+    int gyroData[3];
+    int xldata[3];
+    unsigned char still;
+    long wzQ8;
+    int i;
+
+    gyroGetXYZ((unsigned char*) gyroData);
+    xlGetXYZ((unsigned char*) xldata);
+
+    //Heading from bias corrected gyro Z. The accumulator wraps at one
+    //revolution; integer and fraction parts are scaled separately so fast
+    //turns can't overflow.
+    wzQ8 = ((long) gyroData[2] << 8) - biasQ8[2];
+    headingQ16 += (wzQ8 >> 8) * GYRO_HEADING_BAMS_Q16
+            + (((wzQ8 & 0xFF) * GYRO_HEADING_BAMS_Q16) >> 8);
+
+    still = gyroBiasXlStill(xldata) && (currentMove == idleMove);
+    for (i = 0; i < 3; i++) {
+        if (ABS(gyroData[i] - (int) (biasQ8[i] >> 8)) > GYRO_BIAS_RATE_THRESH) {
+            still = 0;
+        }
+    }
+
+    //Any motion discards the partial block
+    if (!still) {
+        stillCount = 0;
+        blockCount = 0;
+        return;
+    }
+    if (stillCount < GYRO_BIAS_HOLDOFF) {
+        stillCount++;
+        return;
+    }
+
+    if (blockCount == 0) {
+        blockSum[0] = blockSum[1] = blockSum[2] = 0;
+    }
+    for (i = 0; i < 3; i++) {
+        blockSum[i] += gyroData[i];
+    }
+    blockCount++;
+
+    if (blockCount == GYRO_BIAS_BLOCK_LEN) {
+        for (i = 0; i < 3; i++) {
+            biasQ8[i] += (blockSum[i] - biasQ8[i]) >> GYRO_BIAS_BLEND_SHIFT;
+        }
+        blockCount = 0;
+    }
+}
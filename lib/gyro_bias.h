@@ -0,0 +1,31 @@
+#ifndef __GYRO_BIAS_H
+#define __GYRO_BIAS_H
+
+// Online gyro bias estimation. The calibration offsets from gyroSetup() are
+// refined whenever the robot is idle and stationary. The heading integrated
+// from the corrected yaw rate is kept here too, shared by steering and
+// odometry.
+
+// Still samples are averaged in blocks of 256 (~0.85s at 300Hz), so the sum
+// of a block is its mean in Q8. Each block is blended into the estimate with
+// weight 2^-GYRO_BIAS_BLEND_SHIFT.
+#define GYRO_BIAS_BLOCK_LEN         256
+#define GYRO_BIAS_BLEND_SHIFT       2
+// Stationary detection
+#define GYRO_BIAS_XL_VAR_THRESH     400 // sum of accel variances, counts^2
+#define GYRO_BIAS_RATE_THRESH       30  // per axis, ~2 deg/s
+#define GYRO_BIAS_HOLDOFF           60  // samples still before learning, 200ms
+
+// Gyro Z to heading, in BAMS16 (65536 = 1 rev) per count per T5 tick, Q16
+// = 65536/360 [bams/deg] / 14.375 [counts/(deg/s)] / 300 [Hz] * 65536
+#define GYRO_HEADING_BAMS_Q16       2767
+
+void gyroBiasSetup(void); //Timer 5, call before other gyro consumers
+void gyroBiasReset(void);
+void gyroBiasGetOffsets(int* offsets);
+void gyroBiasGetOffsetsQ8(long* offsets);
+unsigned char gyroBiasIsStationary(void);
+int gyroBiasGetHeading(void); // BAMS16
+void gyroBiasSetHeading(int heading);
+
+#endif // __GYRO_BIAS_H
@@ -19,6 +19,8 @@
 #include "p33Fxxxx.h"
 #include "incap.h" // input capture
 #include "sys_service.h"
+#include "nvparams.h"
+#include "pid_shadow.h"
 #include <stdlib.h> // for malloc
 
 //Private Functions
@@ -27,6 +29,9 @@ static void SetupTimer2(void);
 static void SetupInputCapture(void);
 static void hallUpdateBEMF(void);
 static void hallUpdatePID(pidPos *pid);
+static void hallPushEdge(unsigned char chan, unsigned long time);
+static unsigned long hallExtendCapture(unsigned int capture);
+static void hallCountEdge(unsigned int side);
 int medianFilter3(int*);
 
 //Function to be installed into T1, and setup function
@@ -35,11 +40,22 @@ static void hallServiceRoutine(void);
 ///////////////////////////////////
 /////// Local variables ///////////
 //////////////////////////////////
-long old_right_time, right_time, right_delta; // time of last event
+// edge times are extended T2 captures; deltas are computed modulo 2^32
+unsigned long old_right_time, right_time; // time of last event
+long right_delta;
 // unsigned long tic, toc;
-long old_left_time, left_time, left_delta;
+unsigned long old_left_time, left_time;
+long left_delta;
 long motor_count[2]; // 0 = left 1 = right counts on sensor
 
+// Edge ring buffer. Both IC ISRs run at the same priority and can't preempt
+// each other, so they act as the single producer; the consumer (telemetry)
+// only ever advances hallEdgeTail. Indices are free running and masked.
+static hallEdgeStruct hallEdgeBuf[HALL_EDGE_BUF_LEN];
+static volatile unsigned int hallEdgeHead = 0;
+static volatile unsigned int hallEdgeTail = 0;
+static volatile unsigned int hallEdgeOverflows = 0;
+
 MoveQueue hallMoveq;
 moveCmdT hallCurrentMove, hallIdleMove, hallManualMove;
 
@@ -63,6 +79,23 @@ int seqIndex;
 
 static void hallGetSetpoint();
 static void hallSetControl();
+static void hallTakeGains(void);
+static void hallTakeVelProfile(int j);
+
+//Gains and velocity profiles from the main loop are staged here and taken
+//by the T1 routine: gains at the start of a tick, see pid_shadow.h, and
+//profiles at the end of a stride (or at once when the side is not running),
+//so a setpoint is never interpolated from a half written profile. Profiles
+//use the same handshake as the gains.
+typedef struct {
+    int interval[NUM_VELS];
+    int delta[NUM_VELS];
+    int vel[NUM_VELS];
+} hallVelShadowStruct;
+
+static pidShadowStruct gainsShadow[NUM_HALL_PIDS];
+static hallVelShadowStruct velShadow[NUM_HALL_PIDS];
+static volatile char velPending[NUM_HALL_PIDS];
 
 ///////////////////////////////////
 /////// Private Functions /////////
@@ -141,11 +174,14 @@ static void SetupInputCapture() {
 void __attribute__((__interrupt__, no_auto_psv)) _IC8Interrupt(void) {
     //  toc = swatchToc(); // elapsed time since last rising edge
     // Insert ISR code here
-    motor_count[0]++; // increment count for right side - neglect overflow/wrap around
-    //right_time = (long) IC8BUF + ((long) (t2_ticks) << 16);
-    right_time = (long) IC8BUF + (getT2_ticks() << 16);
-    right_delta = right_time - old_right_time;
-    old_right_time = right_time;
+    // drain the capture FIFO, more than one edge may be waiting
+    do {
+        hallCountEdge(0); // increment count for right side
+        right_time = hallExtendCapture(IC8BUF);
+        right_delta = (long) (right_time - old_right_time);
+        old_right_time = right_time;
+        hallPushEdge(0, right_time);
+    } while (IC8CONbits.ICBNE);
 
     LED_RED = ~LED_RED;
     IFS1bits.IC8IF = 0; // Clear CN interrupt
@@ -155,18 +191,64 @@ void __attribute__((__interrupt__, no_auto_psv)) _IC8Interrupt(void) {
 //handler for left leg
 void __attribute__((__interrupt__, no_auto_psv)) _IC7Interrupt(void) {
     // Insert ISR code here
-    motor_count[1]++; // increment count for right side - neglect overflow/wrap around
+    do {
+        hallCountEdge(1); // increment count for left side
 
-    //left_time = (long) IC7BUF + ((long) (t2_ticks) << 16);
-    left_time = (long) IC7BUF + (getT2_ticks() << 16);
-    left_delta = left_time - old_left_time;
-    old_left_time = left_time;
+        left_time = hallExtendCapture(IC7BUF);
+        left_delta = (long) (left_time - old_left_time);
+        old_left_time = left_time;
+        hallPushEdge(1, left_time);
+    } while (IC7CONbits.ICBNE);
 
     LED_GREEN = ~LED_GREEN;
 
     IFS1bits.IC7IF = 0; // Clear CN interrupt
 }
 
+// Extend a 16 bit T2 capture with the T2 overflow count.
+// T2 (priority 5) preempts the IC ISRs (priority 2), so by the time we get here
+// an overflow after the capture may already be counted, or may still be pending.
+// Snapshot count, pending flag and timer with T2 locked out, then attribute the
+// capture to the overflow period it was taken in. Assumes ISR latency is less
+// than one T2 period (~420 ms).
+static unsigned long hallExtendCapture(unsigned int capture) {
+    unsigned long ovf;
+    unsigned int now;
+    int old_ipl;
+
+    SET_AND_SAVE_CPU_IPL(old_ipl, HALL_T2_IPL);
+    ovf = getT2_ticks();
+    now = TMR2;
+    if (_T2IF) { // overflow happened, but T2 ISR hasn't counted it yet
+        ovf++;
+        now = TMR2; // re-read, guaranteed to be after the overflow
+    }
+    RESTORE_CPU_IPL(old_ipl);
+
+    if (now < capture) { // capture was taken before the latest overflow
+        ovf--;
+    }
+    return (ovf << 16) + capture;
+}
+
+// motor_count is allowed to wrap; it is only ever used through differences
+// (see hallCountDiff), so the increment is done in unsigned arithmetic
+static void hallCountEdge(unsigned int side) {
+    motor_count[side] = (long) ((unsigned long) motor_count[side] + 1);
+}
+
+// called only from the IC ISRs
+static void hallPushEdge(unsigned char chan, unsigned long time) {
+    unsigned int head = hallEdgeHead;
+    if ((head - hallEdgeTail) >= HALL_EDGE_BUF_LEN) {
+        hallEdgeOverflows++; // consumer fell behind, drop newest edge
+        return;
+    }
+    hallEdgeBuf[head & (HALL_EDGE_BUF_LEN - 1)].time = time;
+    hallEdgeBuf[head & (HALL_EDGE_BUF_LEN - 1)].chan = chan;
+    hallEdgeHead = head + 1; // publish entry only after it is written
+}
+
 /// Replaced by sys_service module
 //void __attribute__((interrupt, no_auto_psv)) _T2Interrupt(void) {
 //
@@ -186,11 +268,13 @@ void __attribute__((__interrupt__, no_auto_psv)) _IC7Interrupt(void) {
 
 //Main hall effect sensor setup, called from main()
 void hallSetup() {
-    //Init of PID controller objects
+    //Init of PID controller objects, with the saved gains
     int i;
+    nvParamStruct* params = nvParamGet();
     for (i = 0; i < NUM_HALL_PIDS; i++) {
-        hallInitPIDObjPos(&(hallPIDObjs[i]), DEFAULT_HALL_KP, DEFAULT_HALL_KI,
-                DEFAULT_HALL_KD, DEFAULT_HALL_KAW, DEFAULT_HALL_FF);
+        hallInitPIDObjPos(&(hallPIDObjs[i]), params->hallGains[i][0],
+                params->hallGains[i][1], params->hallGains[i][2],
+                params->hallGains[i][3], params->hallGains[i][4]);
         hallPIDObjs[i].minVal = 0;
         hallPIDObjs[i].satValNeg = 0;
         hallPIDObjs[i].maxVal = FULLTHROT;
@@ -265,15 +349,17 @@ void hallInitPIDVelProfile() {
 }
 
 // set values from packet - leave previous motor_count, p_input, etc.
-// called from cmd.c
+// called from cmd.c. Taken up at the next stride boundary of the side.
 
 void hallSetVelProfile(int pid_num, int *interval, int *delta, int *vel) {
     int i;
+    velPending[pid_num] = 0;
     for (i = 0; i < NUM_VELS; i++) {
-        hallPIDVel[pid_num].interval[i] = interval[i];
-        hallPIDVel[pid_num].delta[i] = delta[i];
-        hallPIDVel[pid_num].vel[i] = vel[i];
+        velShadow[pid_num].interval[i] = interval[i];
+        velShadow[pid_num].delta[i] = delta[i];
+        velShadow[pid_num].vel[i] = vel[i];
     }
+    velPending[pid_num] = 1;
 }
 
 
@@ -319,12 +405,9 @@ void hallSetInputSameRuntime(int pid_num, int input_val) {
 }
 
 
+// takes effect at the start of the next T1 tick
 void hallSetGains(int pid_num, int Kp, int Ki, int Kd, int Kaw, int Kff) {
-    hallPIDObjs[pid_num].Kp = Kp;
-    hallPIDObjs[pid_num].Ki = Ki;
-    hallPIDObjs[pid_num].Kd = Kd;
-    hallPIDObjs[pid_num].Kaw = Kaw;
-    hallPIDObjs[pid_num].Kff = Kff;
+    pidShadowSetGains(&gainsShadow[pid_num], Kp, Ki, Kd, Kaw, Kff);
 }
 
 void hallPIDOn(int pid_num) {
@@ -362,11 +445,16 @@ static void hallServiceRoutine(void)
     LED_GREEN = _RB4;
     LED_RED = _RB5;
 
+    hallTakeGains();
+
     if (getT1_ticks() > lastMoveTime) // turn off if done running
     { //	hallPIDSetInput(0, 0, 0);    don't reset state when done run, keep for recording telemetry
         hallPIDObjs[0].onoff = 0;
         //	hallPIDSetInput(1, 0, 0);
         hallPIDObjs[1].onoff = 0;
+        // no stride in progress, new profiles apply at once
+        hallTakeVelProfile(0);
+        hallTakeVelProfile(1);
     } else // update velocity setpoints if needed - only when running
     {
         hallGetSetpoint();
@@ -376,6 +464,16 @@ static void hallServiceRoutine(void)
     hallSetControl();
 }
 
+// Position setpoints and counts are free running and may wrap around together;
+// do the arithmetic modulo 2^32 so the error stays valid across the wrap.
+static long hallCountAdd(long count, int delta) {
+    return (long) ((unsigned long) count + (long) delta);
+}
+
+static long hallCountDiff(long a, long b) {
+    return (long) ((unsigned long) a - (unsigned long) b);
+}
+
 static void hallGetSetpoint() {
     int j, index;
 
@@ -387,8 +485,7 @@ static void hallGetSetpoint() {
         if (getT1_ticks() >= hallPIDVel[j].expire) // time to reach previous setpoint has passed
         {
             hallPIDVel[j].interpolate = 0;
-            hallPIDObjs[j].p_input += hallPIDVel[j].delta[index]; //update to next set point
-            hallPIDVel[j].expire += hallPIDVel[j].interval[(index + 1) % NUM_VELS]; // expire time for next interval
+            hallPIDObjs[j].p_input = hallCountAdd(hallPIDObjs[j].p_input, hallPIDVel[j].delta[index]); //update to next set point
             // got to next index point
             hallPIDVel[j].index++;
 
@@ -398,19 +495,56 @@ static void hallGetSetpoint() {
                 // need to correct for 426 counts per leg stride
                 // 5 rev @ 42 counts/rev = 210, actual set point 5 rev @ 42.6 counts, so add 3 to p_input
                 if ((hallPIDVel[j].leg_stride % 5) == 0) {
-                    hallPIDObjs[j].p_input += 3;
+                    hallPIDObjs[j].p_input = hallCountAdd(hallPIDObjs[j].p_input, 3);
                 }
+                // stride boundary, the next stride runs on a new profile
+                hallTakeVelProfile(j);
             } // loop on index
+            hallPIDVel[j].expire += hallPIDVel[j].interval[hallPIDVel[j].index]; // expire time for next interval
         }
     }
 }
 
+// T1 only, see gainsShadow
+static void hallTakeGains(void) {
+    int j;
+    int *g;
+
+    for (j = 0; j < NUM_HALL_PIDS; j++) {
+        g = pidShadowTakeGains(&gainsShadow[j]);
+        if (g != NULL) {
+            hallPIDObjs[j].Kp = g[0];
+            hallPIDObjs[j].Ki = g[1];
+            hallPIDObjs[j].Kd = g[2];
+            hallPIDObjs[j].Kaw = g[3];
+            hallPIDObjs[j].Kff = g[4];
+        }
+    }
+}
+
+// T1 only, see velShadow
+static void hallTakeVelProfile(int j) {
+    int i;
+
+    if (!velPending[j]) {
+        return;
+    }
+    for (i = 0; i < NUM_VELS; i++) {
+        hallPIDVel[j].interval[i] = velShadow[j].interval[i];
+        hallPIDVel[j].delta[i] = velShadow[j].delta[i];
+        hallPIDVel[j].vel[i] = velShadow[j].vel[i];
+    }
+    velPending[j] = 0;
+}
+
 static void hallSetControl() {
     int j;
     // 0 = right side
     for (j = 0; j < NUM_HALL_PIDS; j++) { //pidobjs[0] : right side
         // p_input has scaled velocity interpolation to make smoother
-        hallPIDObjs[j].p_error = hallPIDObjs[j].p_input + (hallPIDVel[j].interpolate >> 8) - motor_count[j];
+        hallPIDObjs[j].p_error = hallCountDiff(
+                hallCountAdd(hallPIDObjs[j].p_input, hallPIDVel[j].interpolate >> 8),
+                motor_count[j]);
         //hallPIDObjs[j].v_error = hallPIDObjs[j].v_input - measurements[j];
         hallPIDObjs[j].v_error = hallPIDObjs[j].v_input - hallbemf[j];
         //Update values
@@ -543,3 +677,31 @@ void hallInitPIDObj(pidObj *pid, int Kp, int Ki, int Kd, int Kaw, int Kff) {
 long* hallGetMotorCounts() {
     return motor_count;
 }
+
+// position error of the last control update
+long hallGetPError(int pid_num) {
+    return hallPIDObjs[pid_num].p_error;
+}
+
+// velocity measurement used by the controller (filtered back EMF)
+int hallGetVelocity(int pid_num) {
+    return hallbemf[pid_num];
+}
+
+// copy up to max queued edges into dst, oldest first; returns number copied
+// must only be called from a single consumer context
+unsigned int hallGetEdges(hallEdgeStruct *dst, unsigned int max) {
+    unsigned int tail = hallEdgeTail;
+    unsigned int n = 0;
+    while ((tail != hallEdgeHead) && (n < max)) {
+        dst[n] = hallEdgeBuf[tail & (HALL_EDGE_BUF_LEN - 1)];
+        tail++;
+        n++;
+    }
+    hallEdgeTail = tail; // release slots back to the ISRs
+    return n;
+}
+
+unsigned int hallGetEdgeOverflows() {
+    return hallEdgeOverflows;
+}
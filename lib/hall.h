@@ -19,6 +19,12 @@
 
 #define NUM_HALL_PIDS 2
 
+// CPU priority that locks out the T2 overflow counter, must match SetupTimer2
+#define HALL_T2_IPL 5
+
+// Hall edge timestamp ring, filled by the input capture ISRs
+#define HALL_EDGE_BUF_LEN   64 // must be a power of 2
+
 //Limits on output PWM
 #define HALFTHROT 2000
 #define FULLTHROT 2*HALFTHROT
@@ -71,6 +77,14 @@ typedef struct {
     int leg_stride;
 } hallVelLUT;
 
+// one entry per hall sensor edge
+// chan is the motor_count index of the side that produced the edge
+
+typedef struct {
+    unsigned long time; // T2 capture, extended by T2 overflows (6.4 us/tick)
+    unsigned char chan;
+} hallEdgeStruct;
+
 //Public Functions
 void hallSetup();
 void hallInitPIDVelProfile();
@@ -84,5 +98,9 @@ void hallGetState(int *measurements);
 void hallPIDOn(int pid_num);
 void hallZeroPos(int pid_num);
 long* hallGetMotorCounts();
+long hallGetPError(int pid_num);
+int hallGetVelocity(int pid_num);
+unsigned int hallGetEdges(hallEdgeStruct *dst, unsigned int max);
+unsigned int hallGetEdgeOverflows();
 
 #endif // __HALL_H
@@ -13,6 +13,8 @@
 #include "math.h"
 #include "steering.h"
 #include "sys_service.h"
+#include "nvparams.h"
+#include "pid_shadow.h"
 #include <dsp.h>
 #include <stdlib.h> // for malloc
 
@@ -31,7 +33,15 @@ int blinkCtr;
 //This is an option to force the PID outputs back to zero when there is no input.
 //This was an attempt to stop bugs w/ motor twitching, or controller wandering.
 //It may not be needed anymore.
-#define PID_ZEROING_ENABLE 1
+static char pidZeroing = LEG_DEFAULT_PID_ZEROING;
+//Zeroing only starts once a controller has run, and stops again when an
+//open loop command takes the outputs, see legCtrlReleaseOutputs()
+static volatile char zeroingArmed = 0;
+static unsigned int bemfIIR = LEG_DEFAULT_BEMF_IIR; //see legCtrlSetBEMFFilter()
+static char setupDone = 0;
+
+//Gains staged for the T1 routine, see pid_shadow.h
+static pidShadowStruct gainsShadow[NUM_MOTOR_PIDS];
 
 //Move queue variables, global
 //TODO: move these into a move queue interface module
@@ -60,11 +70,13 @@ static void serviceMoveQueue(void);
 static void moveSynth();
 static void serviceMotionPID();
 static void updateBEMF();
+static void legCtrlTakeGains(void);
 
 /////////        Leg Control ISR       ////////
 /////////  Installed to Timer1 @ 1Khz  ////////
 //void __attribute__((interrupt, no_auto_psv)) _T1Interrupt(void) {
 static void legCtrlServiceRoutine(void){
+    legCtrlTakeGains();  //Tick boundary, swap in new gains
     serviceMoveQueue();
     moveSynth();         //TODO: port to synth module
     serviceMotionPID();  //Update controllers
@@ -88,6 +100,10 @@ static void SetupTimer1(void) {
 
 void legCtrlSetup() {
     int i;
+    nvParamStruct* params = nvParamGet();
+
+    pidZeroing = params->pidZeroing;
+    bemfIIR = params->bemfIIR;
 
     //Setup for PID controllers
     for (i = 0; i < NUM_MOTOR_PIDS; i++) {
@@ -99,8 +115,10 @@ void legCtrlSetup() {
         motor_pidObjs[i].dspPID.controlHistory =
                 motor_controlHists[i];
 #endif
-        pidInitPIDObj(&(motor_pidObjs[i]), LEG_DEFAULT_KP, LEG_DEFAULT_KI,
-                LEG_DEFAULT_KD, LEG_DEFAULT_KAW, LEG_DEFAULT_KFF);
+        //Saved gains, or LEG_DEFAULT_* if there are none; see nvparams.c
+        pidInitPIDObj(&(motor_pidObjs[i]), params->legGains[i][0],
+                params->legGains[i][1], params->legGains[i][2],
+                params->legGains[i][3], params->legGains[i][4]);
         //Set up max's and saturation values
         motor_pidObjs[i].satValPos = SATTHROT;
         motor_pidObjs[i].satValNeg = 0;
@@ -149,6 +167,7 @@ void legCtrlSetup() {
         bemfHist[i][1] = 0;
         bemfHist[i][2] = 0;
     }
+    setupDone = 1;
 }
 
 // Runs the PID controllers for the legs
@@ -177,6 +196,7 @@ void serviceMotionPID() {
         if (motor_pidObjs[j].onoff) {
             //TODO: Do we want to add provisions to track error, even when
             //the output is switched off?
+            zeroingArmed = 1;
 
 #ifdef PID_SOFTWARE
             //Update values
@@ -193,7 +213,7 @@ void serviceMotionPID() {
             //Set PWM duty cycle
             SetDCMCPWM(legCtrlOutputChannels[j], motor_pidObjs[j].output, 0);
         }//end of if (on / off)
-        else if (PID_ZEROING_ENABLE) { //if PID loop is off
+        else if (pidZeroing && zeroingArmed) { //if PID loop is off
             SetDCMCPWM(legCtrlOutputChannels[j], 0, 0);
         }
 
@@ -230,9 +250,9 @@ void updateBEMF(){
         bemf[i] = medianFilter3(bemfHist[i]); //Apply median filter
     }
 
-    // IIR filter on BEMF: y[n] = 0.2 * y[n-1] + 0.8 * x[n]
-    bemf[0] = (2 * (long) bemfLast[0] / 10) + 8 * (long) bemf[0] / 10;
-    bemf[1] = (2 * (long) bemfLast[1] / 10) + 8 * (long) bemf[1] / 10;
+    // IIR filter on BEMF: y[n] = w/10 * y[n-1] + (10-w)/10 * x[n], w = 2 by default
+    bemf[0] = (bemfIIR * (long) bemfLast[0] + (10 - bemfIIR) * (long) bemf[0]) / 10;
+    bemf[1] = (bemfIIR * (long) bemfLast[1] + (10 - bemfIIR) * (long) bemf[1]) / 10;
     bemfLast[0] = bemf[0]; //bemfLast will not be used after here, OK to set
     bemfLast[1] = bemf[1];
 
@@ -392,10 +412,52 @@ void legCtrlSetInput(unsigned int num, int val){
     pidSetInput(&(motor_pidObjs[num]), val);
 }
 
+// set the input without resetting the controller, for callers that update it
+// every tick; moveSynth() overrides it while a move is running
+void legCtrlTrackInput(unsigned int num, int val){
+    motor_pidObjs[num].input = val;
+}
+
 void legCtrlOnOff(unsigned int num, unsigned char state){
     motor_pidObjs[num].onoff = state;
 }
 
+//Gains set before legCtrlSetup() are only kept in the parameter block, which
+//the setup reads; the hardware PID coefficient arrays are not attached yet.
+//The new gains take effect at the start of the next T1 tick.
 void legCtrlSetGains(unsigned int num, int Kp, int Ki, int Kd, int Kaw, int ff){
-    pidSetGains(&(motor_pidObjs[num]), Kp, Ki, Kd, Kaw, ff);
+    if (!setupDone) {
+        return;
+    }
+    pidShadowSetGains(&gainsShadow[num], Kp, Ki, Kd, Kaw, ff);
+}
+
+//Called from T1 only
+static void legCtrlTakeGains(void) {
+    int i;
+    int *g;
+
+    for (i = 0; i < NUM_MOTOR_PIDS; i++) {
+        g = pidShadowTakeGains(&gainsShadow[i]);
+        if (g != NULL) {
+            pidSetGains(&(motor_pidObjs[i]), g[0], g[1], g[2], g[3], g[4]);
+        }
+    }
+}
+
+void legCtrlSetZeroing(char enable) {
+    pidZeroing = enable;
+}
+
+//Open loop thrust commands drive the PWM directly; stop zeroing the outputs
+//of the controllers that are off, until one is switched on again
+void legCtrlReleaseOutputs(void) {
+    zeroingArmed = 0;
+}
+
+void legCtrlSetBEMFFilter(unsigned int weight) {
+    if (weight > LEG_BEMF_IIR_MAX) {
+        weight = LEG_BEMF_IIR_MAX;
+    }
+    bemfIIR = weight;
 }
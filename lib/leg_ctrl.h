@@ -32,9 +32,21 @@
 #define MOTOR_PID_SCALER 32
 #endif
 
+//Force the PWM outputs to zero while a controller is off, once one has run;
+//open loop thrust commands suspend it, see legCtrlReleaseOutputs()
+#define LEG_DEFAULT_PID_ZEROING 1
+//BEMF IIR filter, weight of the previous output in tenths:
+//y[n] = w/10 * y[n-1] + (10-w)/10 * x[n]
+#define LEG_DEFAULT_BEMF_IIR    2
+#define LEG_BEMF_IIR_MAX        9
+
 void legCtrlSetup();
 void legCtrlSetInput(unsigned int num, int val);
+void legCtrlTrackInput(unsigned int num, int val);
 void legCtrlOnOff(unsigned int num, unsigned char state);
 void legCtrlSetGains(unsigned int num, int Kp, int Ki, int Kd, int Kaw, int ff);
+void legCtrlSetZeroing(char enable);
+void legCtrlReleaseOutputs(void);
+void legCtrlSetBEMFFilter(unsigned int weight);
 
 #endif
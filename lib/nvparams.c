@@ -0,0 +1,342 @@
+// nvparams.c
+// Non-volatile parameter store. A RAM copy of the block is kept up to date
+// by the setter commands, and written to the dfmem on request. At boot the
+// block is read back, checked, and used by the module setup functions.
+// The registry below gives every field an id, range and apply function, so
+// the long tail of tuning knobs can be read and set over the radio.
+
+#include "nvparams.h"
+#include "settings.h"
+#include "dfmem.h"
+#include "flashmem.h"
+#include "crc.h"
+#include "pid.h"
+#include "leg_ctrl.h"
+#include "hall.h"
+#include "steering.h"
+#include "telem.h"
+#include "odometry.h"
+#include "ota.h"
+#include "p33Fxxxx.h"
+
+static nvParamStruct params;
+static unsigned int paramSource = NVPARAM_SRC_DEFAULTS;
+static unsigned int paramPage;
+static unsigned char paramBuffer = 0;
+
+static unsigned int nvParamCRC(nvParamStruct *block);
+
+//Registry
+typedef void (*nvParamApplyFunc)(void);
+
+typedef struct {
+    void *addr; // into params
+    unsigned char type;
+    unsigned char flags;
+    long min;
+    long max;
+    nvParamApplyFunc apply; // hands the value to its module; none if read at setup
+} nvParamRegStruct;
+
+#define NVPARAM_INT_RANGE   -32768L, 32767L
+#define NVPARAM_UINT_RANGE  0L, 65535L
+
+static void nvParamApplyLegL(void);
+static void nvParamApplyLegR(void);
+static void nvParamApplyHallL(void);
+static void nvParamApplyHallR(void);
+static void nvParamApplySteering(void);
+static void nvParamApplySteeringMode(void);
+static void nvParamApplyTelemSkip(void);
+static void nvParamApplyStride(void);
+static void nvParamApplyZeroing(void);
+static void nvParamApplyBEMFFilter(void);
+static void nvParamApplyGyroFilter(void);
+static long nvParamRead(unsigned int id);
+
+//Indexed by NVPARAM_IDS
+static const nvParamRegStruct nvParamReg[NVPARAM_COUNT] = {
+    {&params.legGains[0][0], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegL},
+    {&params.legGains[0][1], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegL},
+    {&params.legGains[0][2], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegL},
+    {&params.legGains[0][3], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegL},
+    {&params.legGains[0][4], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegL},
+    {&params.legGains[1][0], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegR},
+    {&params.legGains[1][1], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegR},
+    {&params.legGains[1][2], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegR},
+    {&params.legGains[1][3], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegR},
+    {&params.legGains[1][4], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyLegR},
+    {&params.hallGains[0][0], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallL},
+    {&params.hallGains[0][1], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallL},
+    {&params.hallGains[0][2], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallL},
+    {&params.hallGains[0][3], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallL},
+    {&params.hallGains[0][4], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallL},
+    {&params.hallGains[1][0], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallR},
+    {&params.hallGains[1][1], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallR},
+    {&params.hallGains[1][2], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallR},
+    {&params.hallGains[1][3], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallR},
+    {&params.hallGains[1][4], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplyHallR},
+    {&params.steeringGains[0], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplySteering},
+    {&params.steeringGains[1], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplySteering},
+    {&params.steeringGains[2], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplySteering},
+    {&params.steeringGains[3], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplySteering},
+    {&params.steeringGains[4], NVPARAM_TYPE_INT, 0, NVPARAM_INT_RANGE, nvParamApplySteering},
+    {&params.steeringMode, NVPARAM_TYPE_INT, 0, STEERMODE_DECREASE, STEERMODE_SPLIT,
+            nvParamApplySteeringMode},
+    {&params.telemSkip, NVPARAM_TYPE_UINT, 0, 1L, 65535L, nvParamApplyTelemSkip},
+    {&params.strideUm, NVPARAM_TYPE_ULONG, 0, 1L, 1000000L, nvParamApplyStride},
+    {&params.radioChannel, NVPARAM_TYPE_UINT, NVPARAM_FLAG_RESET, 11L, 26L, 0},
+    {&params.radioSrcAddr, NVPARAM_TYPE_UINT, NVPARAM_FLAG_RESET, NVPARAM_UINT_RANGE, 0},
+    {&params.radioPanId, NVPARAM_TYPE_UINT, NVPARAM_FLAG_RESET, NVPARAM_UINT_RANGE, 0},
+    {&params.radioDstAddr, NVPARAM_TYPE_UINT, NVPARAM_FLAG_RESET, NVPARAM_UINT_RANGE, 0},
+    {&params.pidZeroing, NVPARAM_TYPE_UINT, 0, 0L, 1L, nvParamApplyZeroing},
+    {&params.bemfIIR, NVPARAM_TYPE_UINT, 0, 0L, LEG_BEMF_IIR_MAX, nvParamApplyBEMFFilter},
+    {&params.gyroAvgSamples, NVPARAM_TYPE_UINT, NVPARAM_FLAG_RESET,
+            1L, GYRO_AVG_SAMPLES_MAX, 0},
+    {&params.gyroFilter, NVPARAM_TYPE_UINT, 0, STEER_GYROFILT_AVG, STEER_GYROFILT_KALMAN,
+            nvParamApplyGyroFilter}
+};
+
+////   Public functions
+////////////////////////
+
+void nvParamSetup(void) {
+    DfmemGeometryStruct geo;
+
+    dfmemGetGeometryParams(&geo);
+    paramPage = geo.max_pages - FLASH_RESERVED_BLOCKS * geo.pages_per_block;
+    nvParamDefaults();
+    nvParamLoad();
+}
+
+// The values in use; setters write here so that a save keeps them
+nvParamStruct* nvParamGet(void) {
+    return &params;
+}
+
+unsigned int nvParamSource(void) {
+    return paramSource;
+}
+
+// Replaces the values in use with the block in flash. Returns 0, leaving
+// them unchanged, if there is no valid block of this version.
+char nvParamLoad(void) {
+    nvParamStruct block;
+
+    dfmemRead(paramPage, 0, sizeof(block), (unsigned char*) &block);
+    if ((block.magic != NVPARAM_MAGIC) || (block.version != NVPARAM_VERSION) ||
+            (block.length != sizeof(block)) || (block.crc != nvParamCRC(&block))) {
+        return 0;
+    }
+    params = block;
+    paramSource = NVPARAM_SRC_FLASH;
+    return 1;
+}
+
+// Writes the values in use to flash and reads them back. Returns 0 if the
+// telemetry log or a firmware upload holds the dfmem buffers, or the check
+// fails.
+char nvParamSave(void) {
+    nvParamStruct block;
+
+    if (telemLogIsActive() || otaIsBusy()) {
+        return 0;
+    }
+    params.magic = NVPARAM_MAGIC;
+    params.version = NVPARAM_VERSION;
+    params.length = sizeof(params);
+    params.crc = nvParamCRC(&params);
+
+    dfmemWriteBuffer((unsigned char*) &params, sizeof(params), 0, paramBuffer);
+    dfmemWriteBuffer2Memory(paramPage, paramBuffer);
+
+    dfmemRead(paramPage, 0, sizeof(block), (unsigned char*) &block);
+    if (block.crc != nvParamCRC(&block) || block.crc != params.crc) {
+        return 0;
+    }
+    paramSource = NVPARAM_SRC_FLASH;
+    return 1;
+}
+
+// Compile time defaults; flash is left alone until the next save
+void nvParamDefaults(void) {
+    int i;
+
+    params.magic = NVPARAM_MAGIC;
+    params.version = NVPARAM_VERSION;
+    params.length = sizeof(params);
+    for (i = 0; i < 2; i++) {
+        params.legGains[i][0] = LEG_DEFAULT_KP;
+        params.legGains[i][1] = LEG_DEFAULT_KI;
+        params.legGains[i][2] = LEG_DEFAULT_KD;
+        params.legGains[i][3] = LEG_DEFAULT_KAW;
+        params.legGains[i][4] = LEG_DEFAULT_KFF;
+        params.hallGains[i][0] = DEFAULT_HALL_KP;
+        params.hallGains[i][1] = DEFAULT_HALL_KI;
+        params.hallGains[i][2] = DEFAULT_HALL_KD;
+        params.hallGains[i][3] = DEFAULT_HALL_KAW;
+        params.hallGains[i][4] = DEFAULT_HALL_FF;
+    }
+    params.steeringGains[0] = STEERING_KP;
+    params.steeringGains[1] = STEERING_KI;
+    params.steeringGains[2] = STEERING_KD;
+    params.steeringGains[3] = STEERING_KAW;
+    params.steeringGains[4] = 0;
+    params.steeringMode = STEERMODE_DECREASE;
+    params.telemSkip = DEFAULT_SKIP_NUM;
+    params.strideUm = ODO_DEFAULT_STRIDE_UM;
+    params.radioChannel = RADIO_CHANNEL;
+    params.radioSrcAddr = RADIO_SRC_ADDR;
+    params.radioPanId = RADIO_SRC_PAN_ID;
+    params.radioDstAddr = RADIO_DST_ADDR;
+    params.pidZeroing = LEG_DEFAULT_PID_ZEROING;
+    params.bemfIIR = LEG_DEFAULT_BEMF_IIR;
+    params.gyroAvgSamples = GYRO_AVG_SAMPLES;
+    params.gyroFilter = STEERING_GYRO_FILTER_DEFAULT;
+    params.crc = nvParamCRC(&params);
+    paramSource = NVPARAM_SRC_DEFAULTS;
+}
+
+// Registry entry and current value of parameter id; 0 if there is none
+char nvParamInfo(unsigned int id, nvParamInfoStruct *info) {
+    info->id = id;
+    if (id >= NVPARAM_COUNT) {
+        info->type = NVPARAM_TYPE_NONE;
+        info->flags = 0;
+        info->min = 0;
+        info->max = 0;
+        info->value = 0;
+        return 0;
+    }
+    info->type = nvParamReg[id].type;
+    info->flags = nvParamReg[id].flags;
+    info->min = nvParamReg[id].min;
+    info->max = nvParamReg[id].max;
+    info->value = nvParamRead(id);
+    return 1;
+}
+
+// Sets count parameters. All are checked first; if one has an unknown id or
+// is out of range nothing is changed, its index goes in failed and the
+// NVPARAM_* reason is returned. Otherwise the values are written and handed
+// to their modules with both control timers masked, so a T1 or T5 tick sees
+// either none or all of them, e.g. a consistent set of gains.
+unsigned int nvParamSetValues(unsigned int count, nvParamValueStruct *values,
+        unsigned int *failed) {
+    unsigned int i;
+    const nvParamRegStruct *reg;
+    nvParamApplyFunc applied = 0;
+    char lockT1IE, lockT5IE;
+
+    for (i = 0; i < count; i++) {
+        *failed = i;
+        if (values[i].id >= NVPARAM_COUNT) {
+            return NVPARAM_BAD_ID;
+        }
+        reg = &nvParamReg[values[i].id];
+        if ((values[i].value < reg->min) || (values[i].value > reg->max)) {
+            return NVPARAM_OUT_OF_RANGE;
+        }
+    }
+    *failed = count;
+
+    lockT1IE = _T1IE;
+    lockT5IE = _T5IE;
+    _T1IE = 0;
+    _T5IE = 0;
+    for (i = 0; i < count; i++) {
+        reg = &nvParamReg[values[i].id];
+        switch (reg->type) {
+            case NVPARAM_TYPE_INT:
+                *((int*) reg->addr) = (int) values[i].value;
+                break;
+            case NVPARAM_TYPE_UINT:
+                *((unsigned int*) reg->addr) = (unsigned int) values[i].value;
+                break;
+            case NVPARAM_TYPE_ULONG:
+                *((unsigned long*) reg->addr) = (unsigned long) values[i].value;
+                break;
+        }
+    }
+    //Gains of one controller share an apply function; run it once for a run
+    //of them
+    for (i = 0; i < count; i++) {
+        reg = &nvParamReg[values[i].id];
+        if (reg->apply && (reg->apply != applied)) {
+            reg->apply();
+            applied = reg->apply;
+        }
+    }
+    _T5IE = lockT5IE;
+    _T1IE = lockT1IE;
+    return NVPARAM_OK;
+}
+
+////   Private functions
+////////////////////////
+
+static long nvParamRead(unsigned int id) {
+    switch (nvParamReg[id].type) {
+        case NVPARAM_TYPE_INT:
+            return *((int*) nvParamReg[id].addr);
+        case NVPARAM_TYPE_UINT:
+            return *((unsigned int*) nvParamReg[id].addr);
+        case NVPARAM_TYPE_ULONG:
+            return (long) *((unsigned long*) nvParamReg[id].addr);
+    }
+    return 0;
+}
+
+static void nvParamApplyLegL(void) {
+    int *g = params.legGains[LEG_CTRL_LEFT];
+    legCtrlSetGains(LEG_CTRL_LEFT, g[0], g[1], g[2], g[3], g[4]);
+}
+
+static void nvParamApplyLegR(void) {
+    int *g = params.legGains[LEG_CTRL_RIGHT];
+    legCtrlSetGains(LEG_CTRL_RIGHT, g[0], g[1], g[2], g[3], g[4]);
+}
+
+static void nvParamApplyHallL(void) {
+    int *g = params.hallGains[0];
+    hallSetGains(0, g[0], g[1], g[2], g[3], g[4]);
+}
+
+static void nvParamApplyHallR(void) {
+    int *g = params.hallGains[1];
+    hallSetGains(1, g[0], g[1], g[2], g[3], g[4]);
+}
+
+static void nvParamApplySteering(void) {
+    int *g = params.steeringGains;
+    steeringSetGains(g[0], g[1], g[2], g[3], g[4]);
+}
+
+static void nvParamApplySteeringMode(void) {
+    steeringSetMode(params.steeringMode);
+}
+
+static void nvParamApplyTelemSkip(void) {
+    telemSetSkip(params.telemSkip);
+}
+
+static void nvParamApplyStride(void) {
+    odoSetStrideLength(params.strideUm);
+}
+
+static void nvParamApplyZeroing(void) {
+    legCtrlSetZeroing((char) params.pidZeroing);
+}
+
+static void nvParamApplyBEMFFilter(void) {
+    legCtrlSetBEMFFilter(params.bemfIIR);
+}
+
+static void nvParamApplyGyroFilter(void) {
+    steeringSetGyroFilter(params.gyroFilter);
+}
+
+static unsigned int nvParamCRC(nvParamStruct *block) {
+    return crc16(CRC16_INIT, (unsigned char*) block,
+            sizeof(nvParamStruct) - sizeof(block->crc));
+}
@@ -0,0 +1,117 @@
+#ifndef __NVPARAMS_H
+#define __NVPARAMS_H
+
+// Parameter block, kept in the first reserved page of the dfmem (see
+// flashmem.h) and loaded at boot, so a robot runs with its tuned settings
+// straight after power-up. Bump NVPARAM_VERSION when the layout changes;
+// blocks of another version are ignored and the defaults used instead.
+#define NVPARAM_MAGIC       0x564E // "NV"
+#define NVPARAM_VERSION     3
+
+// Where the values in use came from
+#define NVPARAM_SRC_DEFAULTS    0 // compile time defaults
+#define NVPARAM_SRC_FLASH       1 // a valid block in flash
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int length; // bytes, including the CRC
+    int legGains[2][5]; // Kp, Ki, Kd, Kaw, Kff per side, leg_ctrl
+    int hallGains[2][5]; // hall
+    int steeringGains[5]; // Kp, Ki, Kd, Kaw, Kff
+    int steeringMode;
+    unsigned int telemSkip;
+    unsigned long strideUm; // odometry
+    unsigned int radioChannel;
+    unsigned int radioSrcAddr;
+    unsigned int radioPanId;
+    unsigned int radioDstAddr;
+    unsigned int pidZeroing; // leg_ctrl, zero PWM while a controller is off
+    unsigned int bemfIIR; // leg_ctrl, tenths; see legCtrlSetBEMFFilter()
+    unsigned int gyroAvgSamples; // steering
+    unsigned int gyroFilter; // steering, STEERING_GYRO_FILTERS
+    unsigned int crc; // CRC-16 of everything above
+} nvParamStruct;
+
+// Registry: every field above is a parameter with an id, readable and
+// settable one at a time by id. Values are carried as longs.
+enum NVPARAM_IDS {
+    NVPARAM_LEG_KP_L = 0,
+    NVPARAM_LEG_KI_L,
+    NVPARAM_LEG_KD_L,
+    NVPARAM_LEG_KAW_L,
+    NVPARAM_LEG_KFF_L,
+    NVPARAM_LEG_KP_R,
+    NVPARAM_LEG_KI_R,
+    NVPARAM_LEG_KD_R,
+    NVPARAM_LEG_KAW_R,
+    NVPARAM_LEG_KFF_R,
+    NVPARAM_HALL_KP_L,
+    NVPARAM_HALL_KI_L,
+    NVPARAM_HALL_KD_L,
+    NVPARAM_HALL_KAW_L,
+    NVPARAM_HALL_KFF_L,
+    NVPARAM_HALL_KP_R,
+    NVPARAM_HALL_KI_R,
+    NVPARAM_HALL_KD_R,
+    NVPARAM_HALL_KAW_R,
+    NVPARAM_HALL_KFF_R,
+    NVPARAM_STEER_KP,
+    NVPARAM_STEER_KI,
+    NVPARAM_STEER_KD,
+    NVPARAM_STEER_KAW,
+    NVPARAM_STEER_KFF,
+    NVPARAM_STEER_MODE,
+    NVPARAM_TELEM_SKIP,
+    NVPARAM_STRIDE_UM,
+    NVPARAM_RADIO_CHANNEL,
+    NVPARAM_RADIO_SRC_ADDR,
+    NVPARAM_RADIO_PAN_ID,
+    NVPARAM_RADIO_DST_ADDR,
+    NVPARAM_PID_ZEROING,
+    NVPARAM_BEMF_IIR,
+    NVPARAM_GYRO_AVG_SAMPLES,
+    NVPARAM_GYRO_FILTER,
+    NVPARAM_COUNT
+};
+
+enum NVPARAM_TYPES {
+    NVPARAM_TYPE_NONE = 0, // no such id
+    NVPARAM_TYPE_INT,
+    NVPARAM_TYPE_UINT,
+    NVPARAM_TYPE_ULONG
+};
+
+// Parameter flags
+#define NVPARAM_FLAG_RESET  0x01 // only read at setup, takes effect after a reset
+
+// Set results
+#define NVPARAM_OK              0
+#define NVPARAM_BAD_ID          1
+#define NVPARAM_OUT_OF_RANGE    2
+
+typedef struct {
+    unsigned int id;
+    unsigned char type; // NVPARAM_TYPE_*
+    unsigned char flags; // NVPARAM_FLAG_*
+    long min;
+    long max;
+    long value;
+} nvParamInfoStruct;
+
+typedef struct {
+    unsigned int id;
+    long value;
+} nvParamValueStruct;
+
+void nvParamSetup(void); // after dfmemSetup(), before the modules using it
+nvParamStruct* nvParamGet(void);
+unsigned int nvParamSource(void);
+char nvParamLoad(void);
+char nvParamSave(void);
+void nvParamDefaults(void);
+char nvParamInfo(unsigned int id, nvParamInfoStruct *info);
+unsigned int nvParamSetValues(unsigned int count, nvParamValueStruct *values,
+        unsigned int *failed);
+
+#endif // __NVPARAMS_H
@@ -0,0 +1,106 @@
+// odometry.c
+// Dead-reckoning pose estimate: distance from hall sensor stride counts,
+// heading from gyro_bias.c. Runs as a T5 service at 300Hz.
+
+#include "odometry.h"
+#include "pid.h"
+#include "hall.h"
+#include "gyro_bias.h"
+#include "sys_service.h"
+#include "nvparams.h"
+#include "p33Fxxxx.h"
+#include <math.h>
+
+#define BAMS16_TO_RAD   (2.0 * 3.14159265 / 65536.0)
+
+static unsigned long strideUm = ODO_DEFAULT_STRIDE_UM;
+
+static float posX, posY, posDist; // mm
+static long lastCounts[2];
+static unsigned int posDivCounter;
+
+//Function to be installed into T5
+static void odoServiceRoutine(void);
+static void odoUpdatePosition(void);
+
+////   Public functions
+////////////////////////
+
+void odoSetup(void) {
+    int retval;
+    strideUm = nvParamGet()->strideUm;
+    odoReset();
+    retval = sysServiceInstallT5(odoServiceRoutine);
+}
+
+void odoReset(void) {
+    long* counts = hallGetMotorCounts();
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    gyroBiasSetHeading(0);
+    posX = 0;
+    posY = 0;
+    posDist = 0;
+    lastCounts[0] = counts[0];
+    lastCounts[1] = counts[1];
+    posDivCounter = ODO_POS_DIVIDER;
+    _T5IE = lockT5IE;
+}
+
+void odoSetStrideLength(unsigned long stride_um) {
+    strideUm = stride_um;
+}
+
+// Also called from the T5 telemetry service, so the enable bit is restored
+void odoGetPose(odoPoseStruct *pose) {
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    pose->x = (long) posX;
+    pose->y = (long) posY;
+    pose->dist = (long) posDist;
+    pose->theta = gyroBiasGetHeading();
+    _T5IE = lockT5IE;
+}
+
+////   Private functions
+////////////////////////
+
+/////////        Odometry ISR          ////////
+////////  Installed to Timer5 @ 300hz  ////////
+static void odoServiceRoutine(void) {
+    posDivCounter--;
+    if (posDivCounter == 0) {
+        odoUpdatePosition();
+        posDivCounter = ODO_POS_DIVIDER;
+    }
+}
+
+// Hall ISRs are lower priority than T5, so the counts read here are consistent
+static void odoUpdatePosition(void) {
+    long* counts = hallGetMotorCounts();
+    long dL, dR;
+    float d, theta;
+
+    // wrap-safe count differences
+    dL = (long) ((unsigned long) counts[0] - (unsigned long) lastCounts[0]);
+    dR = (long) ((unsigned long) counts[1] - (unsigned long) lastCounts[1]);
+    lastCounts[0] = counts[0];
+    lastCounts[1] = counts[1];
+
+    if ((dL == 0) && (dR == 0)) {
+        return;
+    }
+
+    // mean leg travel of both sides, um -> mm
+    d = (float) (dL + dR) * 0.5 * (float) strideUm * 10.0
+            / (float) ODO_COUNTS_PER_REV_X10 * 0.001;
+    theta = (float) gyroBiasGetHeading() * BAMS16_TO_RAD;
+
+    posX += d * cos(theta);
+    posY += d * sin(theta);
+    posDist += d;
+}
@@ -0,0 +1,24 @@
+#ifndef __ODOMETRY_H
+#define __ODOMETRY_H
+
+// Distance travelled per leg revolution, calibrate per robot
+#define ODO_DEFAULT_STRIDE_UM   40000
+// hall counts per leg revolution, x10 (gear ratio 21.3:1, 2 counts/rev)
+#define ODO_COUNTS_PER_REV_X10  426
+
+// position is integrated at 300Hz / ODO_POS_DIVIDER
+#define ODO_POS_DIVIDER         10
+
+typedef struct {
+    long x; // mm
+    long y; // mm
+    long dist; // total path length, mm
+    int theta; // heading, BAMS16
+} odoPoseStruct;
+
+void odoSetup(void);
+void odoReset(void);
+void odoSetStrideLength(unsigned long stride_um);
+void odoGetPose(odoPoseStruct *pose);
+
+#endif // __ODOMETRY_H
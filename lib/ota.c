@@ -0,0 +1,411 @@
+// ota.c
+// Staging of firmware images sent over the radio, see ota.h. Chunks must
+// arrive in order; each one is copied into a dfmem buffer, and full pages
+// are written out alternating buffers, as for the telemetry log.
+
+#include "ota.h"
+#include "dfmem.h"
+#include "flashmem.h"
+#include "crc.h"
+#include "telem.h"
+#include "p33Fxxxx.h"
+
+#define OTA_READ_SIZE   64 // bytes read back at a time by otaVerify()
+
+// one byte each way on the dfmem SPI, for otaCopy()
+#define OTA_COPY_SPI(out, in) do { \
+        OTA_DFMEM_SPIBUF = (out); \
+        while (!OTA_DFMEM_SPIRBF); \
+        (in) = OTA_DFMEM_SPIBUF; \
+    } while (0)
+
+static unsigned int headerPage;
+static unsigned int bytesPerPage;
+static unsigned long maxLength;
+static otaHeaderStruct header;
+static unsigned long nextOffset;
+static unsigned int pageByte; // bytes in the buffer being filled
+static unsigned char buffer;
+static unsigned int verifyCrc, verifyRawCrc;
+static unsigned long verifyRawLength;
+static unsigned long rawWord; // instruction word of the next decoded byte
+static unsigned char rawByte;
+static char copyPageDiffers;
+
+static void otaWriteHeader(void);
+static void otaVerifyRaw(unsigned char c);
+static void otaCopy(unsigned long start, unsigned long length);
+
+////   Public functions
+////////////////////////
+
+void otaSetup(void) {
+    DfmemGeometryStruct geo;
+
+    dfmemGetGeometryParams(&geo);
+    bytesPerPage = geo.bytes_per_page;
+    headerPage = geo.max_pages - FLASH_RESERVED_PAGES(geo);
+    maxLength = (FLASH_OTA_BLOCKS(geo) * geo.pages_per_block - 1)
+            * (unsigned long) bytesPerPage;
+    if (maxLength > FLASH_OTA_IMAGE_MAX) {
+        maxLength = FLASH_OTA_IMAGE_MAX;
+    }
+
+    //Pick up an image staged before the reset; an upload cut short by the
+    //reset can't be resumed, the buffer contents are gone
+    dfmemRead(headerPage, 0, sizeof(header), (unsigned char*) &header);
+    if ((header.magic != OTA_MAGIC) || (header.version != OTA_VERSION)
+            || (header.state > OTA_STATE_DONE)
+            || (header.state == OTA_STATE_RECEIVING)) {
+        header.state = OTA_STATE_IDLE;
+        header.length = 0;
+    }
+    //otaCopy() only resets once the whole image is written
+    if (header.state == OTA_STATE_COPYING) {
+        header.state = OTA_STATE_DONE;
+        otaWriteHeader();
+    }
+    nextOffset = (header.state >= OTA_STATE_RECEIVED) ? header.length : 0;
+}
+
+// Starts an upload; any staged image is invalidated first, so a reset
+// during the upload can't leave a verified image half overwritten.
+unsigned int otaBegin(unsigned long length, unsigned long rawLength,
+        unsigned int crc, unsigned int rawCrc) {
+    if (telemLogIsActive()) {
+        return OTA_BUSY;
+    }
+    if (length > maxLength) {
+        return OTA_TOO_LARGE;
+    }
+    header.magic = OTA_MAGIC;
+    header.version = OTA_VERSION;
+    header.state = OTA_STATE_RECEIVING;
+    header.crc = crc;
+    header.rawCrc = rawCrc;
+    header.length = length;
+    header.rawLength = rawLength;
+    buffer = 1;
+    otaWriteHeader();
+
+    nextOffset = 0;
+    pageByte = 0;
+    buffer = 0;
+    verifyCrc = 0;
+    verifyRawCrc = 0;
+    verifyRawLength = 0;
+    return OTA_OK;
+}
+
+// Stores length bytes at image offset. Only the chunk at the next offset is
+// taken; anything else is refused with OTA_OUT_OF_ORDER, and the host goes
+// back to the offset in the reply.
+unsigned int otaData(unsigned long offset, unsigned char *data, unsigned int length) {
+    unsigned int n;
+
+    if (header.state != OTA_STATE_RECEIVING) {
+        return OTA_BAD_STATE;
+    }
+    if (telemLogIsActive()) {
+        return OTA_BUSY;
+    }
+    if (offset != nextOffset) {
+        return OTA_OUT_OF_ORDER;
+    }
+    if (nextOffset + length > header.length) {
+        return OTA_TOO_LARGE;
+    }
+
+    while (length > 0) {
+        n = bytesPerPage - pageByte;
+        if (n > length) {
+            n = length;
+        }
+        dfmemWriteBuffer(data, n, pageByte, buffer);
+        data += n;
+        length -= n;
+        pageByte += n;
+        nextOffset += n;
+        if ((pageByte == bytesPerPage) || (nextOffset == header.length)) {
+            dfmemWriteBuffer2Memory(headerPage + 1
+                    + (unsigned int) ((nextOffset - 1) / bytesPerPage), buffer);
+            buffer ^= 1;
+            pageByte = 0;
+        }
+    }
+
+    if (nextOffset == header.length) {
+        header.state = OTA_STATE_RECEIVED;
+        otaWriteHeader();
+    }
+    return OTA_OK;
+}
+
+// Reads the stored image back, checks its CRC, and decodes it to check the
+// decoded length and CRC against the header, and that it fits otaCopy().
+unsigned int otaVerify(void) {
+    unsigned char data[OTA_READ_SIZE];
+    unsigned long offset;
+    unsigned int i, n, page, byte;
+    unsigned char c;
+    unsigned char literal = 0; // literal bytes still to come
+    unsigned char repeat = 0; // count of the run whose byte comes next
+
+    if ((header.state != OTA_STATE_RECEIVED) && (header.state != OTA_STATE_VERIFIED)) {
+        return OTA_BAD_STATE;
+    }
+
+    verifyCrc = CRC16_INIT;
+    verifyRawCrc = CRC16_INIT;
+    verifyRawLength = 0;
+    rawWord = 0;
+    rawByte = 0;
+    copyPageDiffers = 0;
+    for (offset = 0; offset < header.length; offset += n) {
+        page = headerPage + 1 + (unsigned int) (offset / bytesPerPage);
+        byte = (unsigned int) (offset % bytesPerPage);
+        n = bytesPerPage - byte;
+        if (n > OTA_READ_SIZE) {
+            n = OTA_READ_SIZE;
+        }
+        if (n > header.length - offset) {
+            n = (unsigned int) (header.length - offset);
+        }
+        dfmemRead(page, byte, n, data);
+        verifyCrc = crc16(verifyCrc, data, n);
+
+        for (i = 0; i < n; i++) {
+            c = data[i];
+            if (literal > 0) {
+                otaVerifyRaw(c);
+                literal--;
+            } else if (repeat > 0) {
+                for (; repeat > 0; repeat--) {
+                    otaVerifyRaw(c);
+                }
+            } else if (c < 128) {
+                literal = c + 1;
+            } else {
+                repeat = c - 126;
+            }
+        }
+    }
+
+    if (verifyCrc != header.crc) {
+        return OTA_BAD_CRC;
+    }
+    if ((literal > 0) || (repeat > 0) || (verifyRawLength != header.rawLength)) {
+        return OTA_BAD_IMAGE;
+    }
+    if (verifyRawCrc != header.rawCrc) {
+        return OTA_BAD_CRC;
+    }
+    if (copyPageDiffers) {
+        return OTA_BAD_COPY_PAGE;
+    }
+    if (header.state != OTA_STATE_VERIFIED) {
+        header.state = OTA_STATE_VERIFIED;
+        otaWriteHeader();
+    }
+    return OTA_OK;
+}
+
+// Copies a verified image into program flash and resets into it. Returns
+// only if the copy could not start.
+unsigned int otaApply(void) {
+    DfmemGeometryStruct geo;
+    unsigned long start;
+
+    if (header.state != OTA_STATE_VERIFIED) {
+        return OTA_BAD_STATE;
+    }
+    if (telemLogIsActive()) {
+        return OTA_BUSY;
+    }
+    header.state = OTA_STATE_COPYING;
+    otaWriteHeader();
+
+    //dfmem address of the image, as sent with a read command
+    dfmemGetGeometryParams(&geo);
+    start = (unsigned long) (headerPage + 1) << geo.byte_address_bits;
+
+    //Nothing may run from the pages being rewritten, and no DMA may take
+    //the bytes read from the dfmem
+    SET_CPU_IPL(7);
+    DMA0CONbits.CHEN = 0;
+    DMA1CONbits.CHEN = 0;
+    DMA2CONbits.CHEN = 0;
+    DMA3CONbits.CHEN = 0;
+    DMA4CONbits.CHEN = 0;
+    DMA5CONbits.CHEN = 0;
+    DMA6CONbits.CHEN = 0;
+    DMA7CONbits.CHEN = 0;
+    otaCopy(start, header.length);
+    return OTA_OK;
+}
+
+// Drops an upload in progress and releases the dfmem buffers. The staging
+// area was invalidated by otaBegin(), so there is nothing to write.
+unsigned int otaAbort(void) {
+    if (header.state != OTA_STATE_RECEIVING) {
+        return OTA_BAD_STATE;
+    }
+    header.state = OTA_STATE_IDLE;
+    header.length = 0;
+    nextOffset = 0;
+    return OTA_OK;
+}
+
+// An upload is in progress; it holds both dfmem buffers between chunks
+char otaIsBusy(void) {
+    return header.state == OTA_STATE_RECEIVING;
+}
+
+void otaGetStatus(otaStatusStruct *status) {
+    status->result = OTA_OK;
+    status->state = header.state;
+    status->offset = nextOffset;
+    status->crc = verifyCrc;
+    status->rawCrc = verifyRawCrc;
+    status->rawLength = verifyRawLength;
+}
+
+////   Private functions
+////////////////////////
+
+//Through the buffer to be filled next, which holds no image data whenever
+//the header is written, and was not the last one written out
+static void otaWriteHeader(void) {
+    dfmemWriteBuffer((unsigned char*) &header, sizeof(header), 0, buffer);
+    dfmemWriteBuffer2Memory(headerPage, buffer);
+}
+
+//One decoded byte. Words past program memory, or in the otaCopy() page
+//and not as in the running firmware, make the image unusable.
+static void otaVerifyRaw(unsigned char c) {
+    unsigned int tblpag, offset, flash;
+
+    verifyRawCrc = crc16(verifyRawCrc, &c, 1);
+    verifyRawLength++;
+    if (rawWord >= OTA_PM_WORDS) {
+        copyPageDiffers = 1;
+    } else if (rawWord >= OTA_COPY_WORD) {
+        tblpag = TBLPAG;
+        TBLPAG = (unsigned int) (rawWord >> 15);
+        offset = (unsigned int) rawWord << 1;
+        if (rawByte == 2) {
+            flash = __builtin_tblrdh(offset) & 0xFF;
+        } else {
+            flash = (__builtin_tblrdl(offset) >> (rawByte * 8)) & 0xFF;
+        }
+        TBLPAG = tblpag;
+        if (flash != c) {
+            copyPageDiffers = 1;
+        }
+    }
+    if (++rawByte == 3) {
+        rawByte = 0;
+        rawWord++;
+    }
+}
+
+//Writes the image at dfmem address start into program flash, then resets.
+//Runs with interrupts off from its own page, see ota.h, so it calls
+//nothing and reads no constants from flash. The image is decoded twice:
+//the first pass writes every page from 1 up to the copy page, padding
+//past the end of the image with 0xFF, the second writes page 0.
+static void __attribute__((address(OTA_COPY_ADDR), noreturn))
+        otaCopy(unsigned long start, unsigned long length) {
+    unsigned long offset;
+    unsigned int w, first, last, lo, hi, tbl;
+    unsigned char pass, c, run, byte, literal, repeat;
+
+    OTA_DFMEM_SPIROV = 0;
+    c = OTA_DFMEM_SPIBUF;
+    run = 0;
+    lo = 0;
+    for (pass = 0; pass < 2; pass++) {
+        first = pass ? 0 : OTA_PAGE_WORDS;
+        last = pass ? OTA_PAGE_WORDS : OTA_COPY_WORD;
+
+        //Wait out the header write, then read the image from its start
+        OTA_DFMEM_CS = 0;
+        OTA_COPY_SPI(OTA_DFMEM_STATUS, c);
+        do {
+            OTA_COPY_SPI(0, c);
+        } while (!(c & 0x80));
+        OTA_DFMEM_CS = 1;
+        OTA_DFMEM_CS = 0;
+        OTA_COPY_SPI(OTA_DFMEM_READ, c);
+        OTA_COPY_SPI((unsigned char) (start >> 16), c);
+        OTA_COPY_SPI((unsigned char) (start >> 8), c);
+        OTA_COPY_SPI((unsigned char) start, c);
+
+        offset = 0;
+        w = 0;
+        byte = 0;
+        literal = 0;
+        repeat = 0;
+        while (w < last) {
+            //Next decoded byte, as in otaVerify()
+            if (repeat > 0) {
+                c = run;
+                repeat--;
+            } else if (offset >= length) {
+                c = 0xFF;
+            } else {
+                OTA_COPY_SPI(0, c);
+                offset++;
+                if (literal > 0) {
+                    literal--;
+                } else if (c < 128) {
+                    literal = c + 1;
+                    continue;
+                } else {
+                    repeat = c - 126;
+                    OTA_COPY_SPI(0, run);
+                    offset++;
+                    continue;
+                }
+            }
+
+            //low, middle, upper byte of instruction word w
+            if (byte == 0) {
+                lo = c;
+                byte = 1;
+                continue;
+            }
+            if (byte == 1) {
+                lo |= (unsigned int) c << 8;
+                byte = 2;
+                continue;
+            }
+            hi = c;
+            byte = 0;
+
+            if (w >= first) {
+                TBLPAG = w >> 15;
+                tbl = w << 1;
+                if ((w & (OTA_PAGE_WORDS - 1)) == 0) {
+                    NVMCON = 0x4042; //erase the page
+                    __builtin_tblwtl(tbl, 0xFFFF);
+                    __builtin_write_NVM();
+                    while (NVMCONbits.WR);
+                }
+                __builtin_tblwtl(tbl, lo);
+                __builtin_tblwth(tbl, hi);
+                if ((w & (OTA_ROW_WORDS - 1)) == OTA_ROW_WORDS - 1) {
+                    NVMCON = 0x4001; //program the row from the latches
+                    __builtin_write_NVM();
+                    while (NVMCONbits.WR);
+                    ClrWdt();
+                }
+            }
+            w++;
+        }
+        OTA_DFMEM_CS = 1;
+    }
+
+    __asm__ volatile ("reset");
+    while (1);
+}
@@ -0,0 +1,98 @@
+#ifndef __OTA_H
+#define __OTA_H
+
+// Firmware update over the radio. The host sends a compressed program
+// memory image in chunks, which is staged in the dfmem (see flashmem.h)
+// and checked. otaApply() then copies it into program flash and resets
+// into it. While an upload is in progress it holds both dfmem buffers, so
+// logging and parameter saves are refused, see otaIsBusy().
+//
+// The copy runs from otaCopy(), which sits alone at OTA_COPY_ADDR in the
+// last erase page of program memory and reads the dfmem itself, as the
+// dfmem driver is overwritten while it runs. That page is never written:
+// otaVerify() refuses an image whose copy page differs from the running
+// firmware, so changes to otaCopy() still need a programmer. Page 0, with
+// the reset vector, is written last; a power loss during the copy (a few
+// seconds) leaves the robot to be reflashed with a programmer.
+//
+// Staging area, from its first page:
+//   page 0      otaHeaderStruct
+//   page 1..    compressed image, packed across pages
+//
+// Image: program memory from address 0, 3 bytes per instruction word (low,
+// middle, upper), unused locations 0xFF, configuration words excluded.
+// Compression is byte oriented run length: a control byte c < 128 is
+// followed by c+1 literal bytes; c >= 128 is followed by one byte repeated
+// c-126 times (2 to 129).
+
+#define OTA_MAGIC           0x4F54 // "OT"
+#define OTA_VERSION         1
+
+#define OTA_CHUNK_MAX       80 // image bytes per CMD_OTA_DATA packet
+
+// Program memory of the dsPIC33FJ128MC706A, in instruction words. Flash is
+// erased a page and programmed a row at a time.
+#define OTA_PM_WORDS        0xAC00
+#define OTA_PAGE_WORDS      512
+#define OTA_ROW_WORDS       64
+#define OTA_COPY_ADDR       0x15400 // last page, program counter address
+#define OTA_COPY_WORD       (OTA_COPY_ADDR / 2)
+
+// dfmem access from otaCopy(); must match the dfmem driver in imageproc-lib
+#define OTA_DFMEM_SPIBUF    SPI2BUF
+#define OTA_DFMEM_SPIRBF    SPI2STATbits.SPIRBF
+#define OTA_DFMEM_SPIROV    SPI2STATbits.SPIROV
+#define OTA_DFMEM_CS        _LATG9
+#define OTA_DFMEM_READ      0x03 // continuous array read, runs across pages
+#define OTA_DFMEM_STATUS    0xD7 // status register, bit 7 set when ready
+
+enum OTA_STATES {
+    OTA_STATE_IDLE = 0, // no image
+    OTA_STATE_RECEIVING, // upload in progress; dropped by a reset
+    OTA_STATE_RECEIVED, // all bytes stored, not checked
+    OTA_STATE_VERIFIED, // CRCs and decoded length match the header
+    OTA_STATE_COPYING, // written before otaCopy() starts
+    OTA_STATE_DONE // the image was copied; set by otaSetup() after the reset
+};
+
+// Results
+#define OTA_OK              0
+#define OTA_BUSY            1 // a telemetry run holds the dfmem buffers
+#define OTA_TOO_LARGE       2
+#define OTA_BAD_STATE       3
+#define OTA_OUT_OF_ORDER    4 // chunk not at the next offset, resend from there
+#define OTA_BAD_CRC         5
+#define OTA_BAD_IMAGE       6 // decoded length wrong, or a run cut short
+#define OTA_BAD_COPY_PAGE   7 // image changes the otaCopy() page, or too large
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int state; // OTA_STATE_*
+    unsigned int crc; // CRC-16 of the compressed image
+    unsigned int rawCrc; // CRC-16 of the decoded image
+    unsigned long length; // compressed bytes
+    unsigned long rawLength; // decoded bytes, a multiple of 3
+} otaHeaderStruct;
+
+// Progress, sent in reply to every OTA command
+typedef struct {
+    unsigned int result; // OTA_OK, ...
+    unsigned int state;
+    unsigned long offset; // next image byte expected
+    unsigned int crc; // as computed by otaVerify()
+    unsigned int rawCrc;
+    unsigned long rawLength;
+} otaStatusStruct;
+
+void otaSetup(void); // after dfmemSetup()
+unsigned int otaBegin(unsigned long length, unsigned long rawLength,
+        unsigned int crc, unsigned int rawCrc);
+unsigned int otaData(unsigned long offset, unsigned char *data, unsigned int length);
+unsigned int otaVerify(void);
+unsigned int otaApply(void); // only returns on failure
+unsigned int otaAbort(void);
+char otaIsBusy(void);
+void otaGetStatus(otaStatusStruct *status);
+
+#endif // __OTA_H
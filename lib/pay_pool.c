@@ -0,0 +1,123 @@
+// pay_pool.c
+// Pre-allocation cache of payloads for outgoing packets, see pay_pool.h.
+// Senders take a payload from the stock without touching the heap;
+// payPoolRefill() replaces them from the main loop. The stock is only touched with T5 masked.
+
+#include "pay_pool.h"
+#include "radio.h"
+#include "p33Fxxxx.h"
+#include <string.h>
+
+static Payload stock[PAY_POOL_SIZE];
+static unsigned int stockCount;
+static payPoolStatsStruct stats;
+
+static Payload payPoolAlloc(void);
+
+////   Public functions
+////////////////////////
+
+void payPoolSetup(void) {
+    stockCount = 0;
+    payPoolRefill();
+    payPoolResetStats();
+}
+
+void payPoolRefill(void) {
+    Payload pld;
+    char lockT5IE;
+
+    while (stockCount < PAY_POOL_SIZE) {
+        lockT5IE = _T5IE;
+        _T5IE = 0;
+        pld = payPoolAlloc();
+        if (pld != NULL) {
+            stock[stockCount++] = pld;
+        }
+        _T5IE = lockT5IE;
+        if (pld == NULL) {
+            return;
+        }
+    }
+}
+
+Payload payPoolGet(unsigned int length, unsigned char status, unsigned char type) {
+    Payload pld = NULL;
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    if (length > PAY_POOL_DATA_SIZE) {
+        //Would not fit in a frame
+        stats.failures++;
+    } else if (stockCount > 0) {
+        pld = stock[--stockCount];
+        stats.taken++;
+        if (stockCount < stats.lowWater) {
+            stats.lowWater = stockCount;
+        }
+    } else {
+        stats.misses++;
+        pld = payPoolAlloc();
+        if (pld == NULL) {
+            stats.failures++;
+        }
+    }
+    _T5IE = lockT5IE;
+
+    if (pld != NULL) {
+        pld->data_length = length;
+        paySetStatus(pld, status);
+        paySetType(pld, type);
+    }
+    return pld;
+}
+
+unsigned int payPoolSend(unsigned int length, unsigned char* data,
+        unsigned char status, unsigned char type) {
+    Payload pld;
+
+    pld = payPoolGet(length, status, type);
+    if (pld == NULL) {
+        return 0;
+    }
+    memcpy(payGetData(pld), data, length);
+    //The radio deletes the payload once it is sent
+    radioSendPayload(macGetDestAddr(), pld);
+    return 1;
+}
+
+void payPoolGetStats(payPoolStatsStruct* dst) {
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    *dst = stats;
+    _T5IE = lockT5IE;
+}
+
+void payPoolResetStats(void) {
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    memset(&stats, 0, sizeof(stats));
+    stats.lowWater = stockCount;
+    stats.size = PAY_POOL_SIZE;
+    _T5IE = lockT5IE;
+}
+
+////   Private functions
+////////////////////////
+
+//Every payload is allocated at the full size, whatever it ends up carrying
+static Payload payPoolAlloc(void) {
+    Payload pld;
+
+    pld = payCreateEmpty(PAY_POOL_DATA_SIZE);
+    if ((pld != NULL) && (pld->pld_data == NULL)) {
+        payDelete(pld);
+        pld = NULL;
+    }
+    return pld;
+}
@@ -0,0 +1,43 @@
+#ifndef __PAY_POOL_H
+#define __PAY_POOL_H
+
+// Pre-allocation cache of radio payloads for outgoing packets. The radio
+// library deletes each payload once it has been sent, so buffers cannot be
+// returned to a fixed pool; instead the stock is topped up from the main
+// loop, away from the senders. Senders avoid malloc, but every packet still
+// goes through the heap.
+
+#include "payload.h"
+
+#define PAY_POOL_SIZE           6
+// A 127 byte 802.15.4 frame leaves 114 bytes after the MAC header, FCS and
+// the payload status/type bytes
+#define PAY_POOL_DATA_SIZE      114
+
+typedef struct {
+    unsigned long taken; // payloads handed out from the stock
+    unsigned long misses; // stock empty, allocated on the spot
+    unsigned int failures; // out of memory or too long, packet dropped
+    unsigned int lowWater; // fewest payloads left in the stock
+    unsigned int size; // PAY_POOL_SIZE
+} payPoolStatsStruct;
+
+void payPoolSetup(void);
+
+// Tops up the stock; called from the main loop
+void payPoolRefill(void);
+
+// Payload with room for length bytes, status and type set. Returns NULL if
+// length is over PAY_POOL_DATA_SIZE or no memory is left; the packet is
+// then dropped.
+Payload payPoolGet(unsigned int length, unsigned char status, unsigned char type);
+
+// Copies data into a pooled payload and queues it for the radio. Returns 0
+// if the packet was dropped.
+unsigned int payPoolSend(unsigned int length, unsigned char* data,
+        unsigned char status, unsigned char type);
+
+void payPoolGetStats(payPoolStatsStruct* stats);
+void payPoolResetStats(void);
+
+#endif // __PAY_POOL_H
@@ -0,0 +1,29 @@
+// pid_shadow.c
+// Gain handshake between the main loop and the control ISRs, see
+// pid_shadow.h. Used by leg_ctrl.c, hall.c and steering.c.
+
+#include "pid_shadow.h"
+
+////   Public functions
+////////////////////////
+
+void pidShadowSetGains(pidShadowStruct* shadow, int Kp, int Ki, int Kd,
+        int Kaw, int Kff) {
+    shadow->pending = 0;
+    shadow->gains[0] = Kp;
+    shadow->gains[1] = Ki;
+    shadow->gains[2] = Kd;
+    shadow->gains[3] = Kaw;
+    shadow->gains[4] = Kff;
+    shadow->pending = 1;
+}
+
+//The main loop cannot run before the ISR returns, so the flag can be
+//cleared before the caller has copied the gains
+int* pidShadowTakeGains(pidShadowStruct* shadow) {
+    if (!shadow->pending) {
+        return NULL;
+    }
+    shadow->pending = 0;
+    return shadow->gains;
+}
@@ -0,0 +1,26 @@
+#ifndef __PID_SHADOW_H
+#define __PID_SHADOW_H
+
+#include <stddef.h> // NULL
+
+// Controller gains set from the main loop are staged in a shadow and taken
+// by the control ISR at the start of a tick, so an update never sees a half
+// written set. The writer clears the flag before filling the shadow; the
+// ISR only reads a shadow whose flag is set.
+
+#define PID_SHADOW_GAINS    5 // Kp, Ki, Kd, Kaw, Kff
+
+typedef struct {
+    int gains[PID_SHADOW_GAINS];
+    volatile char pending;
+} pidShadowStruct;
+
+// Main loop side; a zeroed shadow has nothing pending
+void pidShadowSetGains(pidShadowStruct* shadow, int Kp, int Ki, int Kd,
+        int Kaw, int Kff);
+
+// ISR side: the staged gains, or NULL if there are no new ones. They stay
+// valid until the ISR returns.
+int* pidShadowTakeGains(pidShadowStruct* shadow);
+
+#endif // __PID_SHADOW_H
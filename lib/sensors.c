@@ -50,9 +50,11 @@
 #include "dfmem.h"
 #include "led.h"
 #include <math.h>
+#include <stdlib.h> // for NULL
 #include "payload.h"
 #include "cmd_const.h"
 #include "radio.h"
+#include "pay_pool.h"
 
 #define TIMER_FREQUENCY     800                 // 800 Hz
 #define TIMER_PERIOD        1/TIMER_FREQUENCY
@@ -177,11 +179,11 @@ void senGetIMUData(unsigned char status, unsigned char type){
     //}
     //else
     //{
-        pld = payCreateEmpty(12);
+        pld = payPoolGet(12, status, type);
     //}
-    
-	paySetStatus(pld,status);
-	paySetType(pld,type);
+    if (pld == NULL) {
+        return;
+    }
     
     xl_data = xlReadXYZ();
 	payAppendData(pld, 0, 6, xl_data);
@@ -13,6 +13,9 @@
 #include "pid_hw.h"
 #include "leg_ctrl.h"
 #include "sys_service.h"
+#include "gyro_bias.h"
+#include "nvparams.h"
+#include "pid_shadow.h"
 
 //Inline functions
 #define ABS(a)	   (((a) < 0) ? -(a) : (a))
@@ -26,11 +29,27 @@ fractional steering_controlHists[3] __attribute__((section(".ybss, bss, ymemory"
 //Averaging filter structures for gyroscope data
 //Initialzied in setup.
 filterAvgInt_t gyroZavg; //This is exported for use in the telemetry module
-#define GYRO_AVG_SAMPLES 	32
 
 #define GYRO_DRIFT_THRESH 5
 
+//Yaw rate Kalman filter, random walk rate model.
+//Steady state gain K = 0.3 (Q8), which corresponds to q/r = K^2/(1-K) ~= 0.13
+//Estimate is kept in Q4 so the update can't overflow a long.
+#define STEERING_KF_GAIN_Q8     77
+#define STEERING_KF_STATE_SHIFT 4
+
+static unsigned int steeringGyroFilter = STEERING_GYRO_FILTER_DEFAULT;
+static long yawRateEst; // Q4
+
+//Heading hold, on the heading integrated by gyro_bias.c
+static unsigned int steeringFeedback = STEER_FEEDBACK_RATE;
+static int headingSetpoint; // BAMS16
+
 static unsigned int steeringMode;
+static char setupDone = 0;
+
+//Gains staged for the T5 routine, see pid_shadow.h
+static pidShadowStruct gainsShadow;
 
 extern moveCmdT currentMove, idleMove;
 
@@ -39,6 +58,7 @@ static void SetupTimer5();
 static void steeringServiceRoutine(void);  //To be installed with sysService
 //The following local functions are called by the service routine:
 static void steeringHandleISR();
+static int steeringFilterYawRate(long wzQ8);
 
 
 ////   Private functions
@@ -48,10 +68,18 @@ static void steeringHandleISR();
 ////////  Installed to Timer5 @ 300hz  ////////
 //void __attribute__((interrupt, no_auto_psv)) _T5Interrupt(void) {
 static void steeringServiceRoutine(void){
+    int *g;
+
     //This intermediate function is used in case we want to tie other
     //sub-taks to the steering service routine.
     //TODO: Is this neccesary?
 
+    //Tick boundary, swap in new gains
+    g = pidShadowTakeGains(&gainsShadow);
+    if (g != NULL) {
+        pidSetGains(&steeringPID, g[0], g[1], g[2], g[3], g[4]);
+    }
+
     // Steering update ISR handler
     steeringHandleISR();
 }
@@ -75,13 +103,15 @@ static void SetupTimer5(){
 ////////////////////////
 
 void steeringSetup(void) {
+    nvParamStruct* params = nvParamGet();
 
 #ifdef PID_HARDWARE
     //Create PID controller object
     steeringPID.dspPID.abcCoefficients = steering_abcCoeffs;
     steeringPID.dspPID.controlHistory = steering_controlHists;
 #endif
-    pidInitPIDObj(&steeringPID, STEERING_KP, STEERING_KI, STEERING_KD, STEERING_KAW, 0);
+    pidInitPIDObj(&steeringPID, params->steeringGains[0], params->steeringGains[1],
+            params->steeringGains[2], params->steeringGains[3], params->steeringGains[4]);
     steeringPID.satValPos = STEERING_SAT;
     steeringPID.satValNeg = -STEERING_SAT;
     steeringPID.maxVal = STEERING_SAT;
@@ -94,39 +124,98 @@ void steeringSetup(void) {
     retval = sysServiceInstallT5(steeringServiceRoutine);
 
     //Averaging filter setup:
-    filterAvgCreate(&gyroZavg, GYRO_AVG_SAMPLES);
+    filterAvgCreate(&gyroZavg, params->gyroAvgSamples);
 
     steeringPID.onoff = PID_OFF; //OFF by default
 
-    steeringMode = STEERMODE_DECREASE;
+    steeringMode = params->steeringMode;
+    setupDone = 1;
+    steeringSetGyroFilter(params->gyroFilter);
 }
 
 void steeringSetAngRate(int angRate) {
+    steeringFeedback = STEER_FEEDBACK_RATE;
     steeringPID.input = angRate;
     steeringPID.onoff = PID_ON;
 }
 
+//Kept in the parameter block only until steeringSetup(), as for the legs
 void steeringSetGains(int Kp, int Ki, int Kd, int Kaw, int ff) {
-    pidSetGains(&steeringPID, Kp, Ki, Kd, Kaw, ff);
+    if (!setupDone) {
+        return;
+    }
+    pidShadowSetGains(&gainsShadow, Kp, Ki, Kd, Kaw, ff);
 }
 
 void steeringSetMode(unsigned int sm) {
     steeringMode = sm;
 }
 
+//Also a registry parameter, see nvparams.c; the average filter is only
+//created by steeringSetup(), which applies the saved choice
+void steeringSetGyroFilter(unsigned int filt) {
+    char lockT5IE;
+
+    if (!setupDone) {
+        return;
+    }
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    steeringGyroFilter = filt;
+    //Restart the estimate from the current average
+    yawRateEst = (long) filterAvgCalc(&gyroZavg) << STEERING_KF_STATE_SHIFT;
+    _T5IE = lockT5IE;
+}
+
+// Hold an absolute heading, or one relative to the current heading
+void steeringSetHeading(int heading, unsigned char relative) {
+    char lockT5IE;
+
+    lockT5IE = _T5IE;
+    _T5IE = 0;
+    if (relative) {
+        heading += gyroBiasGetHeading();
+    }
+    headingSetpoint = heading;
+    steeringPID.input = 0;
+    steeringFeedback = STEER_FEEDBACK_HEADING;
+    steeringPID.onoff = PID_ON;
+    _T5IE = lockT5IE;
+}
+
+//Steady state Kalman filter on bias corrected yaw rate
+static int steeringFilterYawRate(long wzQ8) {
+    long z;
+
+    z = wzQ8 >> (8 - STEERING_KF_STATE_SHIFT);
+    yawRateEst += ((z - yawRateEst) * STEERING_KF_GAIN_Q8) >> 8;
+
+    return (int) ((yawRateEst + (1 << (STEERING_KF_STATE_SHIFT - 1)))
+            >> STEERING_KF_STATE_SHIFT);
+}
+
 static void steeringHandleISR() {
 
     //int gyroAvg[3];
     int wz;
     int gyroData[3];
     int gyroOffsets[3];
+    long offsetsQ8[3];
+    long wzQ8;
 
     gyroGetXYZ((unsigned char*) gyroData);
-    gyroGetOffsets(gyroOffsets);
+    gyroBiasGetOffsets(gyroOffsets);
+    gyroBiasGetOffsetsQ8(offsetsQ8);
+    wzQ8 = ((long) gyroData[2] << 8) - offsetsQ8[2];
 
+    //Average is always updated, it is also used by telemetry
     filterAvgUpdate(&gyroZavg, gyroData[2] - gyroOffsets[2]);
 
-    wz = filterAvgCalc(&gyroZavg);
+    if (steeringGyroFilter == STEER_GYROFILT_KALMAN) {
+        wz = steeringFilterYawRate(wzQ8);
+    } else {
+        wz = filterAvgCalc(&gyroZavg);
+    }
 
     //Threshold filter on gyro to account for minor drift
     //if (ABS(wz) < GYRO_DRIFT_THRESH) {
@@ -142,9 +231,18 @@ static void steeringHandleISR() {
 #elif defined PID_HARDWARE
         int temp = 0;
         temp = steeringPID.input; //Save unscaled input val
-        steeringPID.input *= STEERING_PID_ERR_SCALER; //Scale input
-        pidUpdate(&steeringPID,
-                 STEERING_PID_ERR_SCALER * wz); //Update with scaled feedback
+        if (steeringFeedback == STEER_FEEDBACK_HEADING) {
+            //The int16 error is always the shortest way round, +/- half a
+            //revolution; same sign as a rate error
+            steeringPID.input = (int) (headingSetpoint - gyroBiasGetHeading())
+                    >> STEERING_HEADING_ERR_SHIFT;
+            steeringPID.input *= STEERING_PID_ERR_SCALER;
+            pidUpdate(&steeringPID, 0);
+        } else {
+            steeringPID.input *= STEERING_PID_ERR_SCALER; //Scale input
+            pidUpdate(&steeringPID,
+                     STEERING_PID_ERR_SCALER * wz); //Update with scaled feedback
+        }
        steeringPID.input = temp;  //Reset unscaled input
 #endif   //PID_SOFTWWARE vs PID_HARDWARE
     }
@@ -10,6 +10,8 @@ void steeringSetMode(unsigned int mode);
 void steeringApplyCorrection(int* inputs, int* outputs);
 void steeringOff();
 void steeringOn();
+void steeringSetGyroFilter(unsigned int filt);
+void steeringSetHeading(int heading, unsigned char relative);
 
 #define STEERING_SAT       1024
 
@@ -30,6 +32,31 @@ void steeringOn();
 
 #endif
 
+// Gyro Z moving average length; read at setup from the parameter block
+#define GYRO_AVG_SAMPLES        32
+#define GYRO_AVG_SAMPLES_MAX    64
+
+// Yaw rate feedback filter, selected with steeringSetGyroFilter() or the
+// NVPARAM_GYRO_FILTER parameter
+// The moving average adds ~GYRO_AVG_SAMPLES/2 samples (~50ms) of group delay;
+// the Kalman filter is a steady-state fixed point estimator, ~8ms of delay.
+enum STEERING_GYRO_FILTERS {
+	STEER_GYROFILT_AVG    = 0,
+	STEER_GYROFILT_KALMAN = 1
+};
+#define STEERING_GYRO_FILTER_DEFAULT	STEER_GYROFILT_AVG
+
+// Steering feedback: yaw rate (steeringSetAngRate) or integrated yaw angle
+// (steeringSetHeading), see gyroBiasGetHeading(). Headings are BAMS16,
+// 65536 = 1 revolution.
+enum STEERING_FEEDBACK {
+	STEER_FEEDBACK_RATE    = 0,
+	STEER_FEEDBACK_HEADING = 1
+};
+// Heading error is scaled down to ~45 counts/deg before the PID, so gains
+// are of the same order as in rate mode (14.375 counts per deg/s)
+#define STEERING_HEADING_ERR_SHIFT	2
+
 enum STEERING_MODES { 
 	STEERMODE_INCREASE = 1,
 	STEERMODE_DECREASE = 0,
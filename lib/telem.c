@@ -15,16 +15,54 @@
 #include "adc_pid.h"
 #include "leg_ctrl.h"
 #include "sys_service.h"
+#include "hall.h"
+#include "cmd.h"
+#include "odometry.h"
+#include "gyro_bias.h"
+#include "flashmem.h"
+#include "nvparams.h"
+#include "pay_pool.h"
+#include "ota.h"
+#include <string.h>
 
 #define TIMER_FREQUENCY     300                 // 400 Hz
 #define TIMER_PERIOD        1/TIMER_FREQUENCY
-#define DEFAULT_SKIP_NUM    2 //Default to 150 Hz save rate
 
-#if defined(__RADIO_HIGH_DATA_RATE)
-	#define READBACK_DELAY_TIME_MS 3
-#else
-	#define READBACK_DELAY_TIME_MS 10
-#endif
+//Encoded page header: [uint records][uint bytes used]
+#define TELEM_PAGE_HEADER_SIZE  4
+
+//Windowed readback, sent from telemService()
+#define TELEM_READBACK_CHUNK        96  //bytes of a page per packet
+#define TELEM_READBACK_WINDOW       8   //unacknowledged chunks in flight
+#define TELEM_READBACK_TIMEOUT      60  //T5 ticks without an ACK, 200ms
+#define TELEM_READBACK_RETRIES      25
+
+//Log staging ring. The T5 ISR only samples and packs records into RAM;
+//telemService() drains them to dataflash, so SPI transfers and page
+//commits never run at interrupt priority. 32 records is ~210ms at 150Hz.
+//Power of two, so the free running 16 bit indices wrap onto the same slots.
+#define TELEM_LOG_RING_RECORDS      32
+#define TELEM_LOG_RING_MASK         (TELEM_LOG_RING_RECORDS - 1)
+
+//Live record streaming. Records are queued in the T5 ISR and packed into
+//packets by telemService(): [uint seq][uint records dropped][records].
+//A 127 byte 802.15.4 frame leaves 114 bytes after the MAC header, FCS and
+//the payload status/type bytes.
+#define TELEM_STREAM_MAX_DATA       114
+//Power of two, so the free running 16 bit indices wrap onto the same slots
+#define TELEM_STREAM_RING_RECORDS   16
+#define TELEM_STREAM_RING_MASK      (TELEM_STREAM_RING_RECORDS - 1)
+#define TELEM_STREAM_FLUSH_TICKS    30 //partial packets are sent after ~100ms
+
+//Background erase: progress is reported every 200ms, and erase-ahead keeps
+//this far ahead of the page being logged
+#define TELEM_ERASE_REPORT_TICKS    60
+#define TELEM_ERASE_AHEAD_PAGES     64
+
+//Hall edge streaming; edges are batched, a partial packet is flushed
+//after HALL_EDGE_FLUSH_TICKS of T5 (~50ms)
+#define HALL_EDGES_PER_PKT      16
+#define HALL_EDGE_FLUSH_TICKS   15
 
 
 //TODO: Remove externs by adding getters to other modules
@@ -32,24 +70,227 @@ extern pidObj motor_pidObjs[NUM_MOTOR_PIDS];
 extern int bemf[NUM_MOTOR_PIDS];
 extern pidObj steeringPID;
 
-//global flag from radio module to know if last packet was ACK'd
-//TODO: fix this, add a getter for the flag to radio code
-extern volatile char g_last_ackd;
-
 //Filter stuctures for gyro variables
 extern filterAvgInt_t gyroZavg;
 
 ////////   Private variables   ////////////////
-static unsigned long samplesToSave = 0;
+static volatile unsigned long samplesToSave = 0;
 //Skip counter for dividing the 300hz timer into lower telemetry rates
 static unsigned int telemSkipNum = DEFAULT_SKIP_NUM;
 static unsigned int skipcounter = DEFAULT_SKIP_NUM;
 
+//Record layout
+static unsigned long telemFieldMask = TELEM_FIELDS_DEFAULT;
+static unsigned int telemRecordSize = 0; //set in telemSetup()
+
+//Flash log writer; records are packed into the dfmem SRAM buffers and
+//written out a page at a time, alternating buffers
+static DfmemGeometryStruct dfmemGeo;
+static unsigned long logNumSamples;
+static unsigned int logPage;
+static unsigned int logByte;
+static unsigned char logBuffer;
+static unsigned int logLastPage; //logging stops after this page
+static unsigned int logEndPage; //first page past the log area, see flashmem.h
+static unsigned int logHeaderPage = TELEM_LOG_FIRST_RUN_PAGE; //of the current run
+static unsigned int logFirstPage = TELEM_LOG_FIRST_RUN_PAGE + 1;
+static unsigned long logStartTime; //T5 ticks
+
+//Log directory, see TELEM_LOG_DIR_PAGE. Runs are placed back to back from
+//TELEM_LOG_FIRST_RUN_PAGE and indexed when they end.
+static unsigned int dirMax;
+static unsigned int dirCount = 0;
+static unsigned int dirNextPage = TELEM_LOG_FIRST_RUN_PAGE;
+static unsigned int dirNextId = 0;
+static unsigned int dirSelected = TELEM_LOG_FIRST_RUN_PAGE; //header page read back
+static unsigned int logEncoding = TELEM_ENC_RAW;
+static unsigned int logPageRecords;
+static long logPrevValues[TELEM_NUM_FIELDS];
+static volatile char logActive = 0; //run started, ring not yet drained
+static unsigned char logRing[TELEM_LOG_RING_RECORDS][TELEM_MAX_RECORD_SIZE];
+static volatile unsigned int logHead = 0; //written only by the T5 ISR
+static volatile unsigned int logTail = 0; //written only by telemService
+static telemLogStatsStruct logStats;
+
+//Circular mode, see TELEM_LOG_CIRCULAR in telem.h
+static char logCircular = 0;
+static char circWrapped;
+static unsigned int circTriggerMask;
+static int circAccelThreshold;
+static volatile unsigned int circTriggerSource; //0 until triggered
+static unsigned long circPostSamples;
+static unsigned long circPostLogged; //written only by the T5 ISR
+static unsigned int circPerPage; //raw records per page
+
+//Sampling timer of the current run, see TELEM_LOG_SOURCES
+static volatile char logSource = TELEM_SRC_T5;
+static volatile char hallLogPending = 0; //waiting for hallLogStart
+static unsigned long hallSavedMask = 0; //mask to put back after a hall run
+static unsigned long hallLogStart;
+static unsigned int hallSkipNum = 1;
+static unsigned int hallSkipCounter;
+static unsigned char lockT1IE;
+static unsigned char lockT5IE;
+
+//Background erase, one block per telemService() call while the flash is
+//idle. Pages in [eraseFrom, eraseTo) are erased and not yet written; any
+//other page is erased as it is written.
+static char eraseActive = 0;
+static char eraseAhead;
+static unsigned int eraseNext; //next block to erase, first page
+static unsigned int eraseEnd;
+static unsigned int eraseBase; //header page of the run being erased for
+static unsigned int eraseFrom = 0;
+static unsigned int eraseTo = 0;
+static unsigned long eraseNumSamples;
+static unsigned int eraseStart; //first block erased, first page
+static unsigned long eraseLastReport;
+
+//Sensor values shared by several fields, read once per sample
+static int snapGyro[3];
+static int snapGyroOffsets[3];
+static int snapXl[3];
+static odoPoseStruct snapPose;
+
+static char streamOn = 0;
+static unsigned int streamSkipNum = DEFAULT_SKIP_NUM;
+static unsigned int streamSkipCounter = 0;
+static unsigned char streamRing[TELEM_STREAM_RING_RECORDS][TELEM_MAX_RECORD_SIZE];
+static volatile unsigned int streamHead = 0; //written only by the T5 ISR
+static volatile unsigned int streamTail = 0; //written only by telemService
+static volatile unsigned int streamDropped = 0;
+static unsigned int streamSeq = 0;
+static unsigned long streamLastSend = 0;
+
+//Readback state
+static telemLogHeaderStruct rbHdr;
+static char rbActive = 0;
+static unsigned int rbChunksPerPage;
+static unsigned long rbBase; //oldest unacknowledged chunk
+static unsigned long rbNext; //next chunk not yet sent
+static unsigned long rbEnd;
+static unsigned long rbResend[TELEM_READBACK_MAX_NACKS];
+static unsigned int rbResendCount;
+static unsigned int rbRetries;
+static unsigned long rbLastAck;
+
+static char hallEdgeStreamOn = 0;
+static hallEdgeStruct hallEdgePkt[HALL_EDGES_PER_PKT];
+static unsigned int hallEdgePktCount = 0;
+static unsigned long hallEdgeLastSend = 0;
+
 //Function to be installed into T5, and setup function
 static void SetupTimer5(); // Might collide with setup in steering module!
 static void telemServiceRoutine(void);  //To be installed with sysService
+static void telemT1ServiceRoutine(void); //Installed on T1 for hall runs
 //The following local functions are called by the service routine:
 static void telemISRHandler(void);
+static void telemServiceHallEdges(void);
+static void telemServiceStream(void);
+static void telemStreamPush(long* vals);
+static void telemSampleFields(long* vals);
+static unsigned int telemPackRecord(long* vals, unsigned char* buf);
+static unsigned int telemPackDelta(long* vals, unsigned char* buf);
+static char telemLogPush(long* vals);
+static void telemServiceLog(void);
+static void telemUnpackRecord(unsigned char* buf, long* vals);
+static void telemLogRecord(long* vals);
+static void telemLogWrite(unsigned char* data, unsigned int length);
+static void telemServiceReadback(void);
+static char telemReadbackSendChunk(unsigned long seq);
+static void telemReadbackSendEnd(void);
+static unsigned int telemPutVarint(unsigned char* buf, unsigned long z);
+static void telemLogFlushPage(void);
+static void telemLogWriteHeader(unsigned char buffer);
+static void telemLogFinish(void);
+static void telemLogBegin(unsigned int pages);
+static unsigned int telemLogPlaceRun(unsigned int pages);
+static void telemLogDirLoad(void);
+static void telemLogDirAppend(void);
+static void telemLogLock(void);
+static void telemServiceErase(void);
+static void telemEraseReport(void);
+static void telemLogUnlock(void);
+static void telemCheckAccelTrigger(void);
+static unsigned int telemRunPages(unsigned long numSamples);
+static void telemRestoreFieldMask(void);
+
+//Field getters
+typedef long (*telemFieldGetter)(void);
+typedef struct {
+    unsigned char size;
+    telemFieldGetter get;
+} telemFieldStruct;
+
+static long telemGetTimeStamp(void) { return (long)swatchTic(); }
+static long telemGetInputL(void) { return motor_pidObjs[0].input; }
+static long telemGetInputR(void) { return motor_pidObjs[1].input; }
+static long telemGetDCL(void) { return PDC1; }
+static long telemGetDCR(void) { return PDC2; }
+static long telemGetGyroX(void) { return snapGyro[0] - snapGyroOffsets[0]; }
+static long telemGetGyroY(void) { return snapGyro[1] - snapGyroOffsets[1]; }
+static long telemGetGyroZ(void) { return snapGyro[2] - snapGyroOffsets[2]; }
+static long telemGetGyroAvg(void) { return filterAvgCalc(&gyroZavg); }
+static long telemGetAccelX(void) { return snapXl[0]; }
+static long telemGetAccelY(void) { return snapXl[1]; }
+static long telemGetAccelZ(void) { return snapXl[2]; }
+static long telemGetBemfL(void) { return bemf[0]; }
+static long telemGetBemfR(void) { return bemf[1]; }
+static long telemGetSOut(void) { return steeringPID.output; }
+static long telemGetVbatt(void) { return adcGetVBatt(); }
+static long telemGetSteerAngle(void) { return steeringPID.input; }
+static long telemGetPosX(void) { return snapPose.x; }
+static long telemGetPosY(void) { return snapPose.y; }
+static long telemGetHeading(void) { return snapPose.theta; }
+static long telemGetHallCountL(void) { return hallGetMotorCounts()[0]; }
+static long telemGetHallCountR(void) { return hallGetMotorCounts()[1]; }
+static long telemGetHallPErrL(void) { return hallGetPError(0); }
+static long telemGetHallPErrR(void) { return hallGetPError(1); }
+static long telemGetHallVelL(void) { return hallGetVelocity(0); }
+static long telemGetHallVelR(void) { return hallGetVelocity(1); }
+
+//Indexed by field id, see enum TELEM_FIELDS in telem.h
+static const telemFieldStruct telemFields[TELEM_NUM_FIELDS] = {
+    {4, telemGetTimeStamp},
+    {2, telemGetInputL},
+    {2, telemGetInputR},
+    {2, telemGetDCL},
+    {2, telemGetDCR},
+    {2, telemGetGyroX},
+    {2, telemGetGyroY},
+    {2, telemGetGyroZ},
+    {2, telemGetGyroAvg},
+    {2, telemGetAccelX},
+    {2, telemGetAccelY},
+    {2, telemGetAccelZ},
+    {2, telemGetBemfL},
+    {2, telemGetBemfR},
+    {2, telemGetSOut},
+    {2, telemGetVbatt},
+    {2, telemGetSteerAngle},
+    {2, telemGetPosX},
+    {2, telemGetPosY},
+    {2, telemGetHeading},
+    {4, telemGetHallCountL},
+    {4, telemGetHallCountR},
+    {4, telemGetHallPErrL},
+    {4, telemGetHallPErrR},
+    {2, telemGetHallVelL},
+    {2, telemGetHallVelR}
+};
+
+#define TELEM_GYRO_FIELDS   ((1UL << TELEM_FIELD_GYROX) | (1UL << TELEM_FIELD_GYROY) \
+                            | (1UL << TELEM_FIELD_GYROZ))
+#define TELEM_XL_FIELDS     ((1UL << TELEM_FIELD_ACCELX) | (1UL << TELEM_FIELD_ACCELY) \
+                            | (1UL << TELEM_FIELD_ACCELZ))
+#define TELEM_POSE_FIELDS   ((1UL << TELEM_FIELD_POSX) | (1UL << TELEM_FIELD_POSY) \
+                            | (1UL << TELEM_FIELD_HEADING))
+//Fields that can be sampled from T1. Gyro and accelerometer reads would
+//preempt T5 transfers on the same bus, and the pose getter masks T5.
+#define TELEM_T1_FIELDS     (TELEM_FIELDS_ALL & ~(TELEM_GYRO_FIELDS \
+                            | TELEM_XL_FIELDS | TELEM_POSE_FIELDS))
+//Hall controller state, always logged by hall runs
+#define TELEM_HALL_FIELDS   (TELEM_FIELDS_ALL & ~TELEM_FIELDS_DEFAULT)
 
 /////////        Telemtry ISR          ////////
 ////////  Installed to Timer5 @ 300hz  ////////
@@ -83,139 +324,1050 @@ static void SetupTimer5(){
 ////////////////////////
 void telemSetup(){
     int retval;
+    dfmemGetGeometryParams(&dfmemGeo);
+    logEndPage = dfmemGeo.max_pages - FLASH_RESERVED_PAGES(dfmemGeo);
+    logLastPage = logEndPage - 1;
+    telemSetSkip(nvParamGet()->telemSkip);
+    telemLogDirLoad();
+    telemSetFieldMask(TELEM_FIELDS_DEFAULT);
     retval = sysServiceInstallT5(telemServiceRoutine);
+    //T1 only runs when the hall controller is set up
+    retval = sysServiceInstallT1(telemT1ServiceRoutine);
     SetupTimer5();
 }
 
+//Background work that must not run in an ISR; called from the main loop
+void telemService(void){
+    if(logActive){
+        telemServiceLog();
+    }
+    if(eraseActive){
+        telemServiceErase();
+    }
+    if(hallEdgeStreamOn){
+        telemServiceHallEdges();
+    }
+    if(streamOn){
+        telemServiceStream();
+    }
+    if(rbActive){
+        telemServiceReadback();
+    }
+}
+
+//Streams records of the current field mask at 300Hz / skipnum
+void telemStreamOnOff(char onoff, unsigned int skipnum){
+    unsigned char ie = _T5IE;
+
+    _T5IE = 0;
+    streamOn = 0;
+    if(skipnum == 0){
+        skipnum = 1;
+    }
+    streamSkipNum = skipnum;
+    streamSkipCounter = 0;
+    streamTail = streamHead;
+    streamDropped = 0;
+    streamSeq = 0;
+    streamLastSend = getT5_ticks();
+    streamOn = onoff;
+    _T5IE = ie;
+    if(!onoff && !logActive){
+        telemRestoreFieldMask();
+    }
+}
+
+void telemHallEdgeStreamOnOff(char onoff){
+    hallEdgeStreamOn = onoff;
+    hallEdgePktCount = 0;
+    hallEdgeLastSend = getT5_ticks();
+}
+
+//Starts a run: writes the log header page after the last run in the log
+//directory, then records are saved from the T5 ISR. Erasing with
+//telemErase() beforehand is optional; it makes page writes faster. Runs
+//are refused while a firmware upload holds the dfmem buffers, see ota.h.
 void telemSetSamplesToSave(unsigned long n){
+	if(otaIsBusy()){
+		return;
+	}
+	telemLogFinish();
+	if(n == 0){
+		return;
+	}
+
+	logNumSamples = n;
+	logSource = TELEM_SRC_T5;
+	logCircular = 0;
+	telemLogBegin(telemRunPages(n));
+
+	telemLogLock();
+	logTail = logHead;
+	logActive = (n > 0);
 	samplesToSave = n;
+	telemLogUnlock();
 }
 
-void telemReadbackSamples(unsigned long numSamples)
-{
-	//unsigned int page, bufferByte;// maxpage;
-	unsigned char dataPacket[PACKETSIZE + PKT_INDEX_SIZE];
-	//unsigned long bytesleft = PACKETSIZE * num;
-	//unsigned long telem_index = 0;
-	int delaytime_ms = READBACK_DELAY_TIME_MS;
+//Selects the fields to log. Ignored while a run is being saved.
+//Returns the mask in effect.
+unsigned long telemSetFieldMask(unsigned long mask){
+	unsigned int i;
+	unsigned int size = 0;
 
-	unsigned long i;
-	
-	LED_GREEN = 1;
-	//Disable motion interrupts for readback
-	//_T1IE = 0; _T5IE=0; //TODO: what is a cleaner way to do this?
-	//while(!dfmemIsReady());
-
-	telemStruct_t sampleData;
-
-	for(i = 0; i < numSamples; i++){
-		//Retireve data from flash
-		//dfmemReadSample(i, sizeof(sampleData), (unsigned char*)(&sampleData));
-		dfmemReadSample(i, sizeof(sampleData), dataPacket + PKT_INDEX_SIZE);
-		//Write sample number to start of packet. TODO: fix this
-		*(unsigned long*)(dataPacket) = (long)i;
-		//Reliable send, with linear backoff
-		g_last_ackd = 0;
-		do{
-			telemSendDataDelay(PACKETSIZE + PKT_INDEX_SIZE, dataPacket, delaytime_ms);
-			//trx_status = phyReadBit(SR_TRAC_STATUS);
-			delaytime_ms += 2;
-		} while(g_last_ackd == 0);
-		delaytime_ms = READBACK_DELAY_TIME_MS;
-		//telem_index++;
-	}
-
-	//_T1IE = 1; _T5IE=1;
-	_LATB13 = 0;
-}
-
-
-void telemSendDataDelay(unsigned char data_length, unsigned char* data, int delaytime_ms)
-{
-	// Create Payload, set status and type (don't cares)
-	Payload pld = payCreateEmpty(data_length);
-	//////    FIX THIS //////////
-    paySetType(pld, 0x89);			// Don't Care
-    paySetStatus(pld, 0);		// Don't Care
-    
-	// Set Payload data
-	paySetData(pld, data_length, data);
-    
-	// Send Payload WITH 15ms DELAY
-	// Handles pld delete: Assigns pointer to payload in packet
-	//    and radio command deletes payload, then packet.
-	radioSendPayload(macGetDestAddr(), pld);
-	delay_ms(delaytime_ms); 	// allow radio transmission time
+	mask &= TELEM_FIELDS_ALL;
+	if(logActive || streamOn || (mask == 0)){
+		return telemFieldMask;
+	}
+
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(mask & (1UL << i)){
+			size += telemFields[i].size;
+		}
+	}
+	telemLogLock();
+	telemFieldMask = mask;
+	telemRecordSize = size;
+	telemLogUnlock();
+	hallSavedMask = 0;
+	return mask;
 }
 
+unsigned int telemGetRecordSize(void){
+	return telemRecordSize;
+}
 
-//Saves telemetry data structure into flash memory, in order
-void telemSaveData(telemU *data){
-	
-	dfmemSave((unsigned char*)data, sizeof(telemU));
-	samplesToSave--;
+//Selects the record encoding. Ignored while a run is being saved.
+//Returns the encoding in effect.
+unsigned int telemSetEncoding(unsigned int encoding){
+	if(!logActive &&
+			((encoding == TELEM_ENC_RAW) || (encoding == TELEM_ENC_DELTA))){
+		logEncoding = encoding;
+	}
+	return logEncoding;
+}
+
+//Header describing the current layout
+void telemGetLogHeader(telemLogHeaderStruct *hdr){
+	unsigned int i;
 
-	//This is done here instead of the ISR because telemSaveData() will only be
-	//executed if samplesToSave > 0 upon entry.
-	if(samplesToSave == 0){
-		//Done sampling, commit last buffer
-		dfmemSync();
+	memset(hdr, 0, sizeof(telemLogHeaderStruct));
+	hdr->magic = TELEM_LOG_MAGIC;
+	hdr->version = TELEM_LOG_VERSION;
+	hdr->recordSize = telemRecordSize;
+	hdr->fieldMask = telemFieldMask;
+	hdr->skip = telemSkipNum;
+	hdr->sampleRate = TELEM_T5_RATE;
+	if(logSource == TELEM_SRC_T1){
+		hdr->skip = hallSkipNum;
+		hdr->sampleRate = TELEM_T1_RATE;
+	}
+	hdr->firstPage = logFirstPage;
+	hdr->bytesPerPage = dfmemGeo.bytes_per_page;
+	hdr->numSamples = logNumSamples;
+	hdr->encoding = logEncoding;
+	hdr->oldestPage = logFirstPage;
+	//Only the pages written, the rest may hold an older run
+	hdr->numPages = logPage - logFirstPage;
+	if(logCircular){
+		hdr->mode = TELEM_LOG_CIRCULAR;
+		if(circWrapped){
+			hdr->numPages = logLastPage - logFirstPage + 1;
+			hdr->oldestPage = logPage;
+		}
+		hdr->triggerSource = circTriggerSource;
+		hdr->postTrigger = circPostLogged;
 	}
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(telemFieldMask & (1UL << i)){
+			hdr->fields[hdr->numFields][0] = i;
+			hdr->fields[hdr->numFields][1] = telemFields[i].size;
+			hdr->numFields++;
+		}
+	}
+}
+
+//Counters of the current or last run
+void telemGetLogStats(telemLogStatsStruct *stats){
+	telemLogLock();
+	*stats = logStats;
+	telemLogUnlock();
 }
 
+//Starts circular logging over enough pages for preSamples of history before
+//a trigger and postSamples after it, at the current skip and field mask.
+//Logging runs until a source in triggerMask fires (or telemLogTrigger()
+//is called), continues for postSamples, then stops and rewrites the header.
+//No erase is needed beforehand. Refused during a firmware upload.
+void telemCircularStart(unsigned int preSamples, unsigned int postSamples,
+		unsigned int triggerMask, int accelThreshold){
+	unsigned int perPage;
+	unsigned long pages;
+
+	if(otaIsBusy()){
+		return;
+	}
+	//Ending a hall run puts back the field mask, and the record size
+	telemLogFinish();
+
+	//Region is sized by raw records, delta logs keep more history
+	perPage = dfmemGeo.bytes_per_page / telemRecordSize;
+	pages = (preSamples + perPage - 1) / perPage
+			+ (postSamples + perPage - 1) / perPage
+			+ 1; //the oldest page is partly overwritten when the log stops
+	if(pages > logEndPage - TELEM_LOG_FIRST_RUN_PAGE - 1){
+		pages = logEndPage - TELEM_LOG_FIRST_RUN_PAGE - 1;
+	}
 
-void telemErase(unsigned long numSamples){
-	dfmemEraseSectorsForSamples(numSamples, sizeof(telemU));
+	//The ring is erased as it is written
+	eraseActive = 0;
+	eraseFrom = 0;
+	eraseTo = 0;
+	logSource = TELEM_SRC_T5;
+	logCircular = 1;
+	circWrapped = 0;
+	circTriggerMask = triggerMask;
+	circAccelThreshold = accelThreshold;
+	circPostSamples = postSamples;
+	circPostLogged = 0;
+	circTriggerSource = 0;
+	logNumSamples = (unsigned long)preSamples + postSamples;
+	telemLogBegin((unsigned int)pages);
+	logLastPage = logFirstPage + (unsigned int)pages - 1;
+
+	telemLogLock();
+	logTail = logHead;
+	logActive = 1;
+	samplesToSave = (unsigned long)postSamples + 1; //held until the trigger
+	circPerPage = perPage;
+	telemLogUnlock();
+}
+
+//Starts a run of count samples on the 1kHz hall control tick, one every skip
+//ticks, beginning startDelay ticks from now. The run logs the hall fields
+//and the selected fields that T1 can sample, see TELEM_T1_FIELDS; the
+//selected mask is put back when the run ends. Fails while streaming, as
+//the mask can't change then, and during a firmware upload. Returns the
+//field mask of the run, 0 if it was not started.
+unsigned long telemHallLogStart(unsigned long startDelay, unsigned long count,
+		unsigned int skip){
+	unsigned long mask, saved;
+
+	if(otaIsBusy()){
+		return 0;
+	}
+	telemLogFinish();
+	if(count == 0){
+		return 0;
+	}
+	saved = hallSavedMask ? hallSavedMask : telemFieldMask;
+	mask = (saved & TELEM_T1_FIELDS) | TELEM_HALL_FIELDS;
+	if(telemSetFieldMask(mask) != mask){
+		return 0;
+	}
+	hallSavedMask = saved;
+
+	if(skip == 0){
+		skip = 1;
+	}
+	logNumSamples = count;
+	logSource = TELEM_SRC_T1;
+	hallSkipNum = skip;
+	logCircular = 0;
+	telemLogBegin(telemRunPages(count));
+
+	telemLogLock();
+	logTail = logHead;
+	hallLogStart = getT1_ticks() + startDelay;
+	hallSkipCounter = 0;
+	hallLogPending = 1;
+	logActive = 1;
+	samplesToSave = count;
+	telemLogUnlock();
+	return mask;
+}
+
+//Ends circular logging without waiting for a trigger
+void telemCircularStop(void){
+	if(logCircular){
+		telemLogLock();
+		samplesToSave = 0;
+		telemLogUnlock();
+	}
+}
+
+//Freezes a circular log after its post-trigger samples. Only the first
+//trigger counts, and only sources enabled in the trigger mask; the
+//command source is always accepted. Safe to call from any priority.
+void telemLogTrigger(unsigned int source){
+	unsigned char ie = _T5IE;
+
+	if(!logCircular || ((source & (circTriggerMask | TELEM_TRIG_COMMAND)) == 0)){
+		return;
+	}
+	_T5IE = 0;
+	if((circTriggerSource == 0) && (samplesToSave > 0)){
+		circTriggerSource = source;
+		samplesToSave = circPostSamples;
+	}
+	_T5IE = ie;
+}
+
+//Forgets all runs; the next one starts at TELEM_LOG_FIRST_RUN_PAGE
+void telemLogDirClear(void){
+	dfmemErasePage(TELEM_LOG_DIR_PAGE);
+	dirCount = 0;
+	dirNextPage = TELEM_LOG_FIRST_RUN_PAGE;
+	dirNextId = 0;
+	dirSelected = TELEM_LOG_FIRST_RUN_PAGE;
+}
+
+//A run is being written; it holds both dfmem buffers
+char telemLogIsActive(void){
+	return logActive;
+}
+
+unsigned int telemLogDirCount(void){
+	return dirCount;
+}
+
+//Reads directory entry index, oldest run first. Returns 0 if there is none.
+char telemLogDirGet(unsigned int index, telemLogDirEntryStruct *entry){
+	if(index >= dirCount){
+		return 0;
+	}
+	dfmemRead(TELEM_LOG_DIR_PAGE, index*sizeof(telemLogDirEntryStruct),
+			sizeof(telemLogDirEntryStruct), (unsigned char*)entry);
+	return 1;
+}
+
+//Selects the run read by telemReadLogHeader() and readback. The last run
+//recorded is selected after reset and when a run starts.
+char telemLogSelect(unsigned int index){
+	telemLogDirEntryStruct entry;
+
+	if(!telemLogDirGet(index, &entry)){
+		return 0;
+	}
+	dirSelected = entry.headerPage;
+	return 1;
+}
+
+//Header of the selected run, as stored in flash
+void telemReadLogHeader(telemLogHeaderStruct *hdr){
+	dfmemRead(dirSelected, 0, sizeof(telemLogHeaderStruct), (unsigned char*)hdr);
+}
+
+//Starts a windowed readback of chunks [startSeq, endSeq) of the stored log.
+//Chunk seq covers bytes (seq % chunksPerPage) * TELEM_READBACK_CHUNK of page
+//firstPage + seq / chunksPerPage. Sending is done from telemService().
+void telemReadbackStart(unsigned long startSeq, unsigned long endSeq){
+	//Layout of the stored run comes from its header, so a log can be read
+	//back after a reset or a field mask change
+	telemReadLogHeader(&rbHdr);
+	if((rbHdr.magic != TELEM_LOG_MAGIC) || (rbHdr.version != TELEM_LOG_VERSION) ||
+			(rbHdr.recordSize == 0) || (rbHdr.recordSize > TELEM_MAX_RECORD_SIZE)){
+		telemGetLogHeader(&rbHdr);
+	}
+	rbChunksPerPage = (rbHdr.bytesPerPage + TELEM_READBACK_CHUNK - 1)
+			/ TELEM_READBACK_CHUNK;
+
+	rbBase = startSeq;
+	rbNext = startSeq;
+	rbEnd = endSeq;
+	rbResendCount = 0;
+	rbRetries = 0;
+	rbLastAck = getT5_ticks();
+	rbActive = 1;
+	LED_GREEN = 1;
+}
+
+//Host acknowledgement: every chunk below ackSeq was received, and the chunks
+//in nacks[] are missing and should be sent again
+void telemReadbackAck(unsigned long ackSeq, unsigned int numNacks, unsigned long* nacks){
+	unsigned int i;
+
+	if(!rbActive){
+		return;
+	}
+	if(ackSeq > rbBase){
+		rbBase = ackSeq;
+		if(rbNext < rbBase){
+			rbNext = rbBase;
+		}
+	}
+	if(rbBase >= rbEnd){
+		rbActive = 0;
+		LED_GREEN = 0;
+		return;
+	}
+	for(i = 0; (i < numNacks) && (rbResendCount < TELEM_READBACK_MAX_NACKS); i++){
+		if((nacks[i] >= rbBase) && (nacks[i] < rbNext)){
+			rbResend[rbResendCount++] = nacks[i];
+		}
+	}
+	rbRetries = 0;
+	rbLastAck = getT5_ticks();
+}
+
+//Starts erasing the blocks holding the header page and numSamples records
+//of the current layout, and ends any run in progress. The erase continues
+//from telemService(), with CMD_ERASE_SECTORS progress reports, and a run
+//can be started at any time: pages not erased yet are erased as they are
+//written. With ahead set, blocks are only erased up to
+//TELEM_ERASE_AHEAD_PAGES beyond the page being logged, so the flash is not
+//kept busy long before it is needed.
+void telemErase(unsigned long numSamples, char ahead){
+	unsigned int ppb = dfmemGeo.pages_per_block;
+	unsigned int pages, lastPage;
+
+	telemLogFinish();
+	logCircular = 0;
+
+	//Erase where the next run will go; blocks shared with the last run
+	//are left to the page writes
+	pages = telemRunPages(numSamples);
+	eraseBase = telemLogPlaceRun(pages);
+	lastPage = eraseBase + pages;
+	if(lastPage > logEndPage - 1){
+		lastPage = logEndPage - 1;
+	}
+	eraseEnd = (lastPage / ppb + 1) * ppb;
+	if(eraseEnd > logEndPage){
+		eraseEnd = logEndPage;
+	}
+	eraseNumSamples = numSamples;
+	eraseAhead = ahead;
+	eraseNext = ((eraseBase + ppb - 1) / ppb) * ppb;
+	eraseFrom = eraseNext;
+	eraseTo = eraseNext;
+	eraseStart = eraseNext;
+	if(eraseNext == eraseBase){
+		//Holds the header page, erased before a run can write it
+		dfmemEraseBlock(eraseNext);
+		eraseNext += ppb;
+		eraseTo = eraseNext;
+	}
+	eraseActive = 1;
+	telemEraseReport();
 }
 
 
 ////   Private functions
 ////////////////////////
 
+//Record pages for numSamples of the current layout. Delta records are
+//usually much smaller, so the raw size is used for both encodings.
+static unsigned int telemRunPages(unsigned long numSamples){
+	unsigned int perPage = dfmemGeo.bytes_per_page / telemRecordSize;
+	unsigned long pages = (numSamples + perPage - 1) / perPage;
+
+	if(pages > logEndPage){
+		pages = logEndPage;
+	}
+	return (unsigned int)pages;
+}
+
+//Header page for a run of the given record pages: after the last run in
+//the directory. When the directory or the flash is full, the directory is
+//cleared and runs start again from TELEM_LOG_FIRST_RUN_PAGE.
+static unsigned int telemLogPlaceRun(unsigned int pages){
+	if((dirCount >= dirMax) ||
+			((unsigned long)dirNextPage + 1 + pages > logEndPage)){
+		telemLogDirClear();
+	}
+	return dirNextPage;
+}
+
+//Places a new run and writes its header page. The run takes up record
+//pages up to the end of the flash, or its ring for circular logs.
+static void telemLogBegin(unsigned int pages){
+	logHeaderPage = telemLogPlaceRun(pages);
+	logFirstPage = logHeaderPage + 1;
+	logLastPage = logEndPage - 1;
+	logPage = logFirstPage;
+	logStartTime = getT5_ticks();
+	dirSelected = logHeaderPage;
+	telemLogWriteHeader(1);
+
+	logByte = 0;
+	logBuffer = 0;
+	logPageRecords = 0;
+	memset(&logStats, 0, sizeof(logStats));
+}
+
+//Finds the runs recorded in the directory page, and where the next one goes
+static void telemLogDirLoad(void){
+	telemLogDirEntryStruct entry;
+
+	dirMax = dfmemGeo.bytes_per_page / sizeof(telemLogDirEntryStruct);
+	if(dirMax > TELEM_LOG_DIR_MAX){
+		dirMax = TELEM_LOG_DIR_MAX;
+	}
+	dirCount = 0;
+	dirNextPage = TELEM_LOG_FIRST_RUN_PAGE;
+	dirNextId = 0;
+	while(dirCount < dirMax){
+		dfmemRead(TELEM_LOG_DIR_PAGE, dirCount*sizeof(entry), sizeof(entry),
+				(unsigned char*)&entry);
+		if(entry.runId == TELEM_LOG_DIR_FREE){
+			break;
+		}
+		dirNextPage = entry.headerPage + entry.numPages;
+		dirNextId = entry.runId + 1;
+		dirSelected = entry.headerPage;
+		dirCount++;
+	}
+}
+
+//Adds the run that just ended to the directory. The page is read into the
+//idle dfmem buffer, the entry added, and the page rewritten.
+static void telemLogDirAppend(void){
+	telemLogDirEntryStruct entry;
+
+	entry.runId = dirNextId;
+	entry.headerPage = logHeaderPage;
+	//Pages used, including the header; circular runs keep their whole ring
+	entry.numPages = (logCircular ? logLastPage : logPage - 1) - logHeaderPage + 1;
+	entry.mode = logCircular ? TELEM_LOG_CIRCULAR : TELEM_LOG_LINEAR;
+	entry.numSamples = logCircular ? logNumSamples : logStats.logged;
+	entry.fieldMask = telemFieldMask;
+	entry.startTime = logStartTime * 10 / 3; //T5 ticks to ms
+
+	dfmemReadPage2Buffer(TELEM_LOG_DIR_PAGE, logBuffer);
+	dfmemWriteBuffer((unsigned char*)&entry, sizeof(entry),
+			dirCount*sizeof(entry), logBuffer);
+	dfmemWriteBuffer2Memory(TELEM_LOG_DIR_PAGE, logBuffer);
+
+	dirCount++;
+	dirNextId++;
+	dirNextPage = entry.headerPage + entry.numPages;
+}
+
+//Masks both sampling timers, for state shared with the log producer
+static void telemLogLock(void){
+	lockT1IE = _T1IE;
+	lockT5IE = _T5IE;
+	_T1IE = 0;
+	_T5IE = 0;
+}
+
+static void telemLogUnlock(void){
+	_T5IE = lockT5IE;
+	_T1IE = lockT1IE;
+}
+
+//Stops the current run and writes out what is left in the ring
+static void telemLogFinish(void){
+	telemLogLock();
+	samplesToSave = 0;
+	telemLogUnlock();
+	while(logActive){
+		telemServiceLog();
+	}
+}
+
+//Writes the header of the current run to its header page through a
+//dfmem buffer not holding records. The page is erased as it is written, as
+//circular runs write it again when they stop.
+static void telemLogWriteHeader(unsigned char buffer){
+	telemLogHeaderStruct hdr;
+	telemGetLogHeader(&hdr);
+	dfmemWriteBuffer((unsigned char*)&hdr, sizeof(hdr), 0, buffer);
+	dfmemWriteBuffer2Memory(logHeaderPage, buffer);
+}
+
+//Accelerometer trigger: any axis beyond the threshold, in raw counts
+static void telemCheckAccelTrigger(void){
+	unsigned int i;
+
+	if(!(telemFieldMask & TELEM_XL_FIELDS)){
+		xlGetXYZ((unsigned char*)snapXl);
+	}
+	for(i = 0; i < 3; i++){
+		if((snapXl[i] > circAccelThreshold) || (snapXl[i] < -circAccelThreshold)){
+			telemLogTrigger(TELEM_TRIG_ACCEL);
+			return;
+		}
+	}
+}
+
+//Queues a record for the log; counts it as dropped if the ring is full.
+//Returns 1 if the record was queued.
+static char telemLogPush(long* vals){
+	unsigned int fill = logHead - logTail;
+
+	if(fill >= TELEM_LOG_RING_RECORDS){
+		logStats.dropped++;
+		telemLogTrigger(TELEM_TRIG_OVERRUN);
+		return 0;
+	}
+	telemPackRecord(vals, logRing[logHead & TELEM_LOG_RING_MASK]);
+	logHead++;
+	if(fill + 1 > logStats.ringMax){
+		logStats.ringMax = fill + 1;
+	}
+	return 1;
+}
+
+//Writes queued records to flash, and commits the last page once the run
+//has ended and the ring is empty
+static void telemServiceLog(void){
+	long vals[TELEM_NUM_FIELDS];
+	char done;
+
+	//Checked before draining, so the last record is not left in the ring
+	telemLogLock();
+	done = (samplesToSave == 0);
+	telemLogUnlock();
+
+	while(logTail != logHead){
+		telemUnpackRecord(logRing[logTail & TELEM_LOG_RING_MASK], vals);
+		logTail++;
+		telemLogRecord(vals);
+	}
+	if(done){
+		if(logCircular){
+			//Records available, oldest page first. Only exact for raw
+			//records; delta pages carry their own record counts.
+			logNumSamples = logStats.logged;
+			if(circWrapped){
+				logNumSamples = (unsigned long)(logLastPage - logFirstPage)
+						* circPerPage + logPageRecords;
+			}
+		}
+		telemLogFlushPage();
+		logActive = 0;
+		//Final header, with the pages written and the trigger
+		telemLogWriteHeader(logBuffer);
+		telemLogDirAppend();
+		telemRestoreFieldMask();
+	}
+}
+
+//Puts back the mask selected before a hall run. While streaming the mask
+//can't change, so it is retried when the stream stops.
+static void telemRestoreFieldMask(void){
+	if(hallSavedMask){
+		telemSetFieldMask(hallSavedMask);
+	}
+}
+
+//Inverse of telemPackRecord(). int fields are not sign extended; only their
+//low 16 bits are ever stored.
+static void telemUnpackRecord(unsigned char* buf, long* vals){
+	unsigned int i;
+	unsigned int idx = 0;
+
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(telemFieldMask & (1UL << i)){
+			vals[i] = 0;
+			memcpy(&vals[i], buf + idx, telemFields[i].size);
+			idx += telemFields[i].size;
+		}
+	}
+}
+
+//Appends one record to the log. In DELTA encoding the first record of each
+//page is a raw keyframe. Stops the run once the erased area is full.
+static void telemLogRecord(long* vals){
+	unsigned char record[TELEM_MAX_DELTA_SIZE];
+	unsigned int length;
+
+	if((logEncoding == TELEM_ENC_DELTA) && (logByte != 0)){
+		length = telemPackDelta(vals, record);
+	} else {
+		length = telemPackRecord(vals, record);
+	}
+
+	if(logByte + length > dfmemGeo.bytes_per_page){
+		telemLogFlushPage();
+		if(logEncoding == TELEM_ENC_DELTA){
+			length = telemPackRecord(vals, record);
+		}
+	}
+	if(logCircular && (logPage > logLastPage)){
+		logPage = logFirstPage;
+		circWrapped = 1;
+	}
+	if(logPage > logLastPage){
+		telemLogLock();
+		logStats.dropped += samplesToSave;
+		samplesToSave = 0;
+		telemLogUnlock();
+		return;
+	}
+	if((logEncoding == TELEM_ENC_DELTA) && (logByte == 0)){
+		logByte = TELEM_PAGE_HEADER_SIZE; //filled in at flush
+	}
+
+	telemLogWrite(record, length);
+	logPageRecords++;
+	logStats.logged++;
+	memcpy(logPrevValues, vals, sizeof(logPrevValues));
+}
+
+static void telemLogWrite(unsigned char* data, unsigned int length){
+	dfmemWriteBuffer(data, length, logByte, logBuffer);
+	logByte += length;
+}
+
+static void telemLogFlushPage(void){
+	unsigned int pageHeader[2];
+
+	if(logByte == 0){
+		return;
+	}
+	if(logEncoding == TELEM_ENC_DELTA){
+		pageHeader[0] = logPageRecords;
+		pageHeader[1] = logByte;
+		dfmemWriteBuffer((unsigned char*)pageHeader, TELEM_PAGE_HEADER_SIZE, 0, logBuffer);
+	}
+	if(!logCircular && (logPage >= eraseFrom) && (logPage < eraseTo)){
+		dfmemWriteBuffer2MemoryNoErase(logPage, logBuffer);
+		eraseFrom = logPage + 1;
+	} else {
+		//Not erased in advance, or holds a previous lap of a circular log
+		dfmemWriteBuffer2Memory(logPage, logBuffer);
+	}
+	logStats.pages++;
+	logBuffer ^= 1;
+	logPage++;
+	logByte = 0;
+	logPageRecords = 0;
+}
+
+//Erases one block if the flash is idle. Blocks the log has already reached
+//are skipped, as its pages there are erased as they are written.
+static void telemServiceErase(void){
+	unsigned int ppb = dfmemGeo.pages_per_block;
+
+	if(!dfmemIsReady()){
+		return;
+	}
+	if(logActive && !logCircular && (eraseNext <= logPage)){
+		eraseNext = (logPage / ppb + 1) * ppb;
+		eraseFrom = eraseNext;
+		eraseTo = eraseNext;
+	}
+	if(eraseNext >= eraseEnd){
+		eraseActive = 0;
+		telemEraseReport();
+		return;
+	}
+	if(eraseAhead && (eraseNext >= (logActive ? logPage : eraseBase)
+			+ TELEM_ERASE_AHEAD_PAGES)){
+		return;
+	}
+
+	dfmemEraseBlock(eraseNext);
+	if(eraseTo != eraseNext){
+		eraseFrom = eraseNext;
+	}
+	eraseNext += ppb;
+	eraseTo = eraseNext;
+
+	if(getT5_ticks() - eraseLastReport >= TELEM_ERASE_REPORT_TICKS){
+		telemEraseReport();
+	}
+}
+
+//Erase progress: [ulong numSamples][uint blocks done][uint blocks total].
+//The erase is complete when done == total.
+static void telemEraseReport(void){
+	unsigned int report[4];
+	unsigned int ppb = dfmemGeo.pages_per_block;
+
+	*(unsigned long*)report = eraseNumSamples;
+	report[3] = 0;
+	if(eraseEnd > eraseStart){
+		report[3] = (eraseEnd - eraseStart) / ppb;
+	}
+	report[2] = report[3];
+	if(eraseActive && (eraseNext < eraseEnd)){
+		report[2] = (eraseNext - eraseStart) / ppb;
+	}
+	payPoolSend(sizeof(report), (unsigned char*)report, 0, CMD_ERASE_SECTORS);
+	eraseLastReport = getT5_ticks();
+}
+
+//Reads the enabled fields into vals, indexed by field id
+static void telemSampleFields(long* vals){
+	unsigned int i;
+
+	if(telemFieldMask & TELEM_GYRO_FIELDS){
+		gyroGetXYZ((unsigned char*)snapGyro);
+		gyroBiasGetOffsets(snapGyroOffsets);
+	}
+	if(telemFieldMask & TELEM_XL_FIELDS){
+		xlGetXYZ((unsigned char*)snapXl);
+	}
+	if(telemFieldMask & TELEM_POSE_FIELDS){
+		odoGetPose(&snapPose);
+	}
+
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(telemFieldMask & (1UL << i)){
+			vals[i] = telemFields[i].get();
+		}
+	}
+}
+
+//Packs the enabled fields into buf, returns the record length
+static unsigned int telemPackRecord(long* vals, unsigned char* buf){
+	unsigned int i;
+	unsigned int idx = 0;
+
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(telemFieldMask & (1UL << i)){
+			//little endian, so the low bytes come first
+			memcpy(buf + idx, &vals[i], telemFields[i].size);
+			idx += telemFields[i].size;
+		}
+	}
+	return idx;
+}
+
+//Varint: 7 bits per byte, low group first, high bit set on all but the last
+static unsigned int telemPutVarint(unsigned char* buf, unsigned long z){
+	unsigned int n = 0;
+	while(z >= 0x80){
+		buf[n++] = (unsigned char)(z & 0x7F) | 0x80;
+		z >>= 7;
+	}
+	buf[n++] = (unsigned char)z;
+	return n;
+}
+
+//Packs the difference of each enabled field from the previous record.
+//Differences wrap at the field width, and are zig-zag encoded so small
+//magnitudes of either sign take one byte.
+static unsigned int telemPackDelta(long* vals, unsigned char* buf){
+	unsigned int i;
+	unsigned int idx = 0;
+	long d;
+	int d16;
+
+	for(i = 0; i < TELEM_NUM_FIELDS; i++){
+		if(telemFieldMask & (1UL << i)){
+			if(telemFields[i].size == 4){
+				d = vals[i] - logPrevValues[i];
+				idx += telemPutVarint(buf + idx,
+						((unsigned long)d << 1) ^ (unsigned long)(d >> 31));
+			} else {
+				d16 = (int)(vals[i] - logPrevValues[i]);
+				idx += telemPutVarint(buf + idx,
+						((unsigned int)d16 << 1) ^ (unsigned int)(d16 >> 15));
+			}
+		}
+	}
+	return idx;
+}
+
+//Sends one readback chunk: [ulong seq][data]. Returns 0 at the end of an
+//encoded log, which is detected from an erased page header. A chunk that
+//finds no payload is dropped, and resent like one lost on the air.
+static char telemReadbackSendChunk(unsigned long seq){
+	unsigned int pageHeader[2];
+	unsigned int page, offset, len;
+	Payload pld;
+
+	page = (unsigned int)(seq / rbChunksPerPage);
+	if(rbHdr.numPages != 0){
+		//Circular log, pages are sent oldest first
+		if(page >= rbHdr.numPages){
+			return 0;
+		}
+		page = rbHdr.firstPage + (rbHdr.oldestPage - rbHdr.firstPage + page)
+				% rbHdr.numPages;
+	} else {
+		page += rbHdr.firstPage;
+	}
+	offset = (unsigned int)(seq % rbChunksPerPage) * TELEM_READBACK_CHUNK;
+	if(page >= logEndPage){
+		return 0;
+	}
+	if(rbHdr.encoding == TELEM_ENC_DELTA){
+		dfmemRead(page, 0, TELEM_PAGE_HEADER_SIZE, (unsigned char*)pageHeader);
+		if((pageHeader[0] == 0) || (pageHeader[0] == 0xFFFF)){
+			return 0;
+		}
+	}
+	len = rbHdr.bytesPerPage - offset;
+	if(len > TELEM_READBACK_CHUNK){
+		len = TELEM_READBACK_CHUNK;
+	}
+
+	pld = payPoolGet(sizeof(unsigned long) + len, 0, CMD_FLASH_READBACK);
+	if(pld == NULL){
+		return 1;
+	}
+	memcpy(payGetData(pld), &seq, sizeof(seq));
+	dfmemRead(page, offset, len, payGetData(pld) + sizeof(unsigned long));
+	radioSendPayload(macGetDestAddr(), pld);
+	return 1;
+}
+
+//End of log notice: [ulong TELEM_READBACK_END][ulong end seq]
+static void telemReadbackSendEnd(void){
+	unsigned long endPacket[2];
+	endPacket[0] = TELEM_READBACK_END;
+	endPacket[1] = rbEnd;
+	payPoolSend(sizeof(endPacket), (unsigned char*)endPacket, 0, CMD_FLASH_READBACK);
+}
+
+//Readback sender, one packet per call. NACKed chunks go first, then new
+//chunks while fewer than TELEM_READBACK_WINDOW are unacknowledged. Without
+//an ACK for TELEM_READBACK_TIMEOUT ticks it goes back to the oldest
+//unacknowledged chunk, and gives up after TELEM_READBACK_RETRIES timeouts.
+static void telemServiceReadback(void){
+	if(rbResendCount > 0){
+		telemReadbackSendChunk(rbResend[--rbResendCount]);
+		return;
+	}
+	if((rbNext < rbEnd) && (rbNext < rbBase + TELEM_READBACK_WINDOW)){
+		if(telemReadbackSendChunk(rbNext)){
+			rbNext++;
+		} else {
+			rbEnd = rbNext;
+		}
+		if(rbNext == rbEnd){
+			telemReadbackSendEnd();
+		}
+		return;
+	}
+	if(getT5_ticks() - rbLastAck >= TELEM_READBACK_TIMEOUT){
+		rbRetries++;
+		if(rbRetries > TELEM_READBACK_RETRIES){
+			rbActive = 0;
+			LED_GREEN = 0;
+			return;
+		}
+		if(rbBase >= rbNext){
+			telemReadbackSendEnd();
+		}
+		rbNext = rbBase;
+		rbLastAck = getT5_ticks();
+	}
+}
+
+//Queues a record for streaming; counts it as dropped if the ring is full
+static void telemStreamPush(long* vals){
+	if(streamHead - streamTail >= TELEM_STREAM_RING_RECORDS){
+		streamDropped++;
+		return;
+	}
+	telemPackRecord(vals, streamRing[streamHead & TELEM_STREAM_RING_MASK]);
+	streamHead++;
+}
+
+//Sends as many queued records as fit in a frame. radioSendPayload() only
+//queues the packet, so this never waits on the radio.
+static void telemServiceStream(void){
+	unsigned int perPkt = (TELEM_STREAM_MAX_DATA - 2*sizeof(unsigned int))
+			/ telemRecordSize;
+	unsigned int avail = streamHead - streamTail;
+	unsigned int n, i, idx, dropped;
+	Payload pld;
+
+	if((avail < perPkt) &&
+		((avail == 0) || (getT5_ticks() - streamLastSend < TELEM_STREAM_FLUSH_TICKS))){
+		return;
+	}
+	n = (avail < perPkt) ? avail : perPkt;
+	dropped = streamDropped;
+
+	//Without a payload the records wait for the next call
+	pld = payPoolGet(2*sizeof(unsigned int) + n*telemRecordSize, 0, CMD_TELEM_STREAM);
+	if(pld == NULL){
+		return;
+	}
+	payAppendData(pld, 0, sizeof(streamSeq), (unsigned char*)(&streamSeq));
+	payAppendData(pld, sizeof(streamSeq), sizeof(dropped), (unsigned char*)(&dropped));
+	idx = 2*sizeof(unsigned int);
+	for(i = 0; i < n; i++){
+		payAppendData(pld, idx, telemRecordSize,
+				streamRing[streamTail & TELEM_STREAM_RING_MASK]);
+		idx += telemRecordSize;
+		streamTail++;
+	}
+	radioSendPayload(macGetDestAddr(), pld);
+	streamSeq++;
+	streamLastSend = getT5_ticks();
+}
+
+//Drains the hall edge ring into radio packets of up to HALL_EDGES_PER_PKT
+//edges. Packet format: [uint overflow count][hallEdgeStruct * n]
+static void telemServiceHallEdges(void){
+    hallEdgePktCount += hallGetEdges(hallEdgePkt + hallEdgePktCount,
+                                     HALL_EDGES_PER_PKT - hallEdgePktCount);
+
+    if( (hallEdgePktCount == HALL_EDGES_PER_PKT) ||
+        ((hallEdgePktCount > 0) &&
+         (getT5_ticks() - hallEdgeLastSend >= HALL_EDGE_FLUSH_TICKS)) )
+    {
+        unsigned int overflows = hallGetEdgeOverflows();
+        unsigned int len = hallEdgePktCount * sizeof(hallEdgeStruct);
+        Payload pld = payPoolGet(sizeof(overflows) + len, 0, CMD_HALL_EDGE_STREAM);
+        if (pld == NULL) {
+            return; //kept for the next call
+        }
+        payAppendData(pld, 0, sizeof(overflows), (unsigned char*)(&overflows));
+        payAppendData(pld, sizeof(overflows), len, (unsigned char*)hallEdgePkt);
+        radioSendPayload(macGetDestAddr(), pld);
+        hallEdgePktCount = 0;
+        hallEdgeLastSend = getT5_ticks();
+    }
+}
+
 static void telemISRHandler(){
-	int samplesaved = 0;
-	telemU data;
-	int gyroAvg[3]; int gyroData[3]; int gyroOffsets[3];
-	int xldata[3];
+	long vals[TELEM_NUM_FIELDS];
+	char sampled = 0;
+	char armed, queued;
 
-	//float orZ[3];
-	//orientGetOrZ(orZ);
+	//Live stream, sampled at its own rate
+	if(streamOn){
+		if(streamSkipCounter == 0){
+			telemSampleFields(vals);
+			sampled = 1;
+			telemStreamPush(vals);
+			streamSkipCounter = streamSkipNum;
+		}
+		streamSkipCounter--;
+	}
 
         //skipcounter decrements to 0, triggering a telemetry save, and resets
         // value of skicounter
 	if( skipcounter == 0){
-		if( samplesToSave > 0)
+		if( (samplesToSave > 0) && (logSource == TELEM_SRC_T5))
 		{
-			/////// Get Gyro data and calc average via filter
-			gyroGetXYZ((unsigned char*)gyroData);
-			gyroGetOffsets(gyroOffsets);
-			//filterAvgUpdate(&gyroZavg,gyroData[2] - gyroOffsets[2]);
-			//Only average for Z
-			gyroAvg[2] = filterAvgCalc(&gyroZavg);
-	
-			/////// Get XL data
-			xlGetXYZ((unsigned char*)xldata);
-
 			//Stopwatch was already started in the cmdSpecialTelemetry function
-			data.telemStruct.timeStamp = (long)swatchTic(); 
-			data.telemStruct.inputL = motor_pidObjs[0].input;
-			data.telemStruct.inputR = motor_pidObjs[1].input;
-			data.telemStruct.dcL = PDC1;
-			data.telemStruct.dcR = PDC2;
-			data.telemStruct.gyroX = gyroData[0] - gyroOffsets[0];
-			data.telemStruct.gyroY = gyroData[1] - gyroOffsets[1];
-			data.telemStruct.gyroZ = gyroData[2] - gyroOffsets[2];
-			data.telemStruct.gyroAvg = gyroAvg[2];
-			data.telemStruct.accelX = xldata[0];
-			data.telemStruct.accelY = xldata[1];
-			data.telemStruct.accelZ = xldata[2];
-			data.telemStruct.bemfL = bemf[0];
-			data.telemStruct.bemfR = bemf[1];
-			data.telemStruct.sOut = steeringPID.output;
-			data.telemStruct.Vbatt = adcGetVBatt();
-			data.telemStruct.steerAngle = steeringPID.input;
-			telemSaveData(&data); 
-			samplesaved = 1;
+			if(!sampled){
+				telemSampleFields(vals);
+			}
+			//Written to flash by telemService()
+			armed = logCircular && (circTriggerSource == 0);
+			queued = telemLogPush(vals);
+			if(armed){
+				//Circular log runs until a trigger; an accelerometer
+				//trigger makes this sample the trigger sample, the
+				//first of the post-trigger samples
+				if(circTriggerMask & TELEM_TRIG_ACCEL){
+					telemCheckAccelTrigger();
+				}
+				if(circTriggerSource != 0){
+					if(queued){
+						circPostLogged = 1;
+					}
+					if(samplesToSave > 0){
+						samplesToSave--;
+					}
+				}
+			} else {
+				if(logCircular && queued){
+					circPostLogged++;
+				}
+				samplesToSave--;
+			}
 		}
                 //Reset value of skip counter
                 skipcounter = telemSkipNum;
@@ -225,6 +1377,29 @@ static void telemISRHandler(){
         skipcounter--;
 }
 
+//Hall runs: samples on the T1 control tick once the start time is reached
+static void telemT1ServiceRoutine(void){
+	long vals[TELEM_NUM_FIELDS];
+
+	if((logSource != TELEM_SRC_T1) || (samplesToSave == 0)){
+		return;
+	}
+	if(hallLogPending){
+		if(getT1_ticks() < hallLogStart){
+			return;
+		}
+		hallLogPending = 0;
+		swatchReset();
+	}
+	if(hallSkipCounter == 0){
+		telemSampleFields(vals);
+		telemLogPush(vals);
+		samplesToSave--;
+		hallSkipCounter = hallSkipNum;
+	}
+	hallSkipCounter--;
+}
+
 void telemSetSkip(unsigned int skipnum){
     telemSkipNum = skipnum;
 }
@@ -1,46 +1,163 @@
 #ifndef __TELEM_H
 #define __TELEM_H
 
-//Telemetry packet structure
-//This is specific to apullin's OctoROACH code
+//Telemetry record fields. A record holds only the fields enabled in the
+//field mask (bit n enables field id n), packed in id order with no padding.
+//The host decodes records using the field list in the log header.
+enum TELEM_FIELDS {
+	TELEM_FIELD_TIMESTAMP = 0, //ulong, us
+	TELEM_FIELD_INPUTL,
+	TELEM_FIELD_INPUTR,
+	TELEM_FIELD_DCL,
+	TELEM_FIELD_DCR,
+	TELEM_FIELD_GYROX,
+	TELEM_FIELD_GYROY,
+	TELEM_FIELD_GYROZ,
+	TELEM_FIELD_GYROAVG,
+	TELEM_FIELD_ACCELX,
+	TELEM_FIELD_ACCELY,
+	TELEM_FIELD_ACCELZ,
+	TELEM_FIELD_BEMFL,
+	TELEM_FIELD_BEMFR,
+	TELEM_FIELD_SOUT,
+	TELEM_FIELD_VBATT,
+	TELEM_FIELD_STEERANGLE,
+	TELEM_FIELD_POSX, //mm, odometry
+	TELEM_FIELD_POSY, //mm
+	TELEM_FIELD_HEADING, //BAMS16
+	TELEM_FIELD_HALL_COUNTL, //long, hall counts
+	TELEM_FIELD_HALL_COUNTR, //long
+	TELEM_FIELD_HALL_PERRL, //long, hall PID position error
+	TELEM_FIELD_HALL_PERRR, //long
+	TELEM_FIELD_HALL_VELL, //hall PID velocity measurement
+	TELEM_FIELD_HALL_VELR,
+	TELEM_NUM_FIELDS
+};
+#define TELEM_NUM_LONG_FIELDS	5
+
+#define TELEM_FIELDS_ALL	((1UL << TELEM_NUM_FIELDS) - 1)
+//Fields logged after reset: all but the hall controller state
+#define TELEM_FIELDS_DEFAULT	((1UL << TELEM_FIELD_HALL_COUNTL) - 1)
+
+#define DEFAULT_SKIP_NUM    2 //Default to 150 Hz save rate
+#define TELEM_MAX_RECORD_SIZE	(4*TELEM_NUM_LONG_FIELDS \
+				+ 2*(TELEM_NUM_FIELDS - TELEM_NUM_LONG_FIELDS))
+
+//Log header, written to the first page of each run when it starts, and
+//again when it ends
+#define TELEM_LOG_MAGIC		0x4D4C4554 //"TELM"
+#define TELEM_LOG_VERSION	4
+
+//Record encodings
+//DELTA: each page starts with a uint record count and a raw keyframe record,
+//followed by records of zig-zag varint deltas of each field from the previous
+//record. Any page can be decoded on its own.
+enum TELEM_ENCODINGS {
+	TELEM_ENC_RAW   = 0,
+	TELEM_ENC_DELTA = 1
+};
+//Worst case delta record: 5 bytes per long field, 3 per int field
+#define TELEM_MAX_DELTA_SIZE	(5*TELEM_NUM_LONG_FIELDS \
+				+ 3*(TELEM_NUM_FIELDS - TELEM_NUM_LONG_FIELDS))
+
+typedef struct {
+	unsigned long magic;
+	unsigned int version;
+	unsigned int recordSize;
+	unsigned long fieldMask;
+	unsigned int skip;
+	unsigned int firstPage;
+	unsigned int bytesPerPage; //records never span pages
+	unsigned long numSamples; //requested
+	unsigned int numFields;
+	unsigned char fields[TELEM_NUM_FIELDS][2]; //{id, size} of each logged field
+	unsigned int encoding;
+	unsigned int mode; //TELEM_LOG_LINEAR or TELEM_LOG_CIRCULAR
+	unsigned int oldestPage; //circular: page holding the oldest records
+	unsigned int numPages; //pages of records, oldest first; 0 while logging
+	unsigned int triggerSource; //TELEM_TRIG_*, 0 if not triggered
+	unsigned long postTrigger; //records logged from the trigger on
+	unsigned int sampleRate; //Hz of the sampling timer, divided by skip
+} telemLogHeaderStruct;
+
+//Sampling timer of a logged run. Hall runs sample on the 1kHz T1 control
+//tick; see telemHallLogStart().
+enum TELEM_LOG_SOURCES {
+	TELEM_SRC_T5 = 0,
+	TELEM_SRC_T1 = 1
+};
+#define TELEM_T5_RATE	300
+#define TELEM_T1_RATE	1000
+
+//Circular logging: records are written continuously over a ring of pages
+//sized for the requested history, and the log is frozen a set number of
+//samples after a trigger. Pages are erased as they are rewritten.
+enum TELEM_LOG_MODES {
+	TELEM_LOG_LINEAR   = 0,
+	TELEM_LOG_CIRCULAR = 1
+};
+
+//Trigger sources, also used as the trigger mask bits
+#define TELEM_TRIG_COMMAND	0x01
+#define TELEM_TRIG_ESTOP	0x02
+#define TELEM_TRIG_ACCEL	0x04 //any accelerometer axis beyond a threshold
+#define TELEM_TRIG_OVERRUN	0x08 //log staging ring overflowed
+
+//Log counters, see telemGetLogStats()
 typedef struct {
-		unsigned long timeStamp; 
-		int inputL;  
-		int inputR;
-		int dcL;
-		int dcR;
-		int gyroX;
-		int gyroY;
-		int gyroZ;
-		int gyroAvg;
-		int accelX;
-		int accelY;
-		int accelZ;
-		int bemfL;
-		int bemfR;
-		int sOut;
-		int Vbatt;
-		int steerAngle;	
-		//float orient[3];
-	} telemStruct_t;
-
-//TODO: A union is not neccesary here. Remove for clarity, and chage related
-//  code
-typedef union packedTelemUnion {
-	telemStruct_t telemStruct;
-	unsigned char dataArray[sizeof(telemStruct_t)];
-} telemU;
-
-#define PACKETSIZE sizeof(telemStruct_t)
-#define PKT_INDEX_SIZE 4 //for sending a 4-byte (ulong) telemetry packet index
+	unsigned long logged; //records written to flash
+	unsigned int dropped; //samples lost to a full RAM ring or flash area
+	unsigned int ringMax; //peak RAM ring fill, records
+	unsigned int pages; //pages committed
+} telemLogStatsStruct;
+
+//Log directory, TELEM_LOG_DIR_PAGE. Runs are stored back to back, each a
+//header page followed by its records, and one entry is appended per run
+//when it ends. Free entries read as erased flash.
+#define TELEM_LOG_DIR_MAX	16
+#define TELEM_LOG_DIR_FREE	0xFFFF
+
+typedef struct {
+	unsigned int runId; //TELEM_LOG_DIR_FREE for a free entry
+	unsigned int headerPage;
+	unsigned int numPages; //including the header page
+	unsigned int mode; //TELEM_LOG_MODES
+	unsigned long numSamples;
+	unsigned long fieldMask; //record layout
+	unsigned long startTime; //ms since reset
+} telemLogDirEntryStruct;
+
+//Readback: chunks of log pages are sent as CMD_FLASH_READBACK packets,
+//[ulong seq][data]; seq == TELEM_READBACK_END marks the end, [ulong end seq]
+#define TELEM_READBACK_END		0xFFFFFFFF
+#define TELEM_READBACK_MAX_NACKS	8
 
 // Prototypes
 void telemSetup(); //To be called in main
-void telemReadbackSamples(unsigned long);
-void telemSendDataDelay(unsigned char, unsigned char*, int delaytime_ms);
-void telemSaveData(telemU *data);
+void telemReadbackStart(unsigned long startSeq, unsigned long endSeq);
+void telemReadbackAck(unsigned long ackSeq, unsigned int numNacks, unsigned long* nacks);
 void telemSetSamplesToSave(unsigned long n);
-void telemErase(unsigned long);
+void telemErase(unsigned long numSamples, char ahead);
 void telemSetSkip(unsigned int skipnum);
+void telemService(void); //To be called from the main loop
+void telemHallEdgeStreamOnOff(char onoff);
+void telemStreamOnOff(char onoff, unsigned int skipnum);
+unsigned long telemSetFieldMask(unsigned long mask);
+unsigned int telemGetRecordSize(void);
+unsigned int telemSetEncoding(unsigned int encoding);
+void telemGetLogHeader(telemLogHeaderStruct *hdr);
+void telemReadLogHeader(telemLogHeaderStruct *hdr);
+void telemLogDirClear(void);
+unsigned int telemLogDirCount(void);
+char telemLogDirGet(unsigned int index, telemLogDirEntryStruct *entry);
+char telemLogSelect(unsigned int index);
+void telemGetLogStats(telemLogStatsStruct *stats);
+char telemLogIsActive(void);
+void telemCircularStart(unsigned int preSamples, unsigned int postSamples,
+		unsigned int triggerMask, int accelThreshold);
+void telemCircularStop(void);
+void telemLogTrigger(unsigned int source);
+unsigned long telemHallLogStart(unsigned long startDelay, unsigned long count,
+		unsigned int skip);
 
 #endif  // __TELEM_H
@@ -0,0 +1,123 @@
+// teleop.c
+// Streamed teleoperation: speed and turn targets sent at 20-50Hz are slew
+// limited at the 1kHz control tick and fed to the leg controllers. If the
+// stream goes stale the setpoints are ramped down and the controllers are
+// switched off.
+
+#include "teleop.h"
+#include "leg_ctrl.h"
+#include "pid.h"
+#include "sys_service.h"
+#include "p33Fxxxx.h"
+
+static volatile int targetSpeed, targetTurn; //set by command, read in T1
+static volatile unsigned long lastCmdTime; //T1 ticks
+static unsigned char lastSeq;
+static volatile char active = 0;
+static char installed = 0;
+static int speed, turn; //slew limited setpoints, T1 only
+
+extern volatile char inMotion; //a move queue is running, see leg_ctrl.c
+
+//Function to be installed into T1
+static void teleopServiceRoutine(void);
+static int teleopSlew(int value, int target, int step);
+static int teleopClip(int value);
+
+//Only installs the routine; Timer 1 is configured by legCtrlSetup()
+void teleopSetup(void) {
+    int retval;
+    speed = 0;
+    turn = 0;
+    retval = sysServiceInstallT1(teleopServiceRoutine);
+    installed = (retval >= 0);
+}
+
+// Set new targets. seq is the 8 bit stream counter; packets older than the
+// last one accepted are dropped, unless the stream has gone stale.
+void teleopSetTarget(int newSpeed, int newTurn, unsigned char seq) {
+    char lockT1IE;
+
+    if (!installed) {
+        return;
+    }
+    if (active && (getT1_ticks() - lastCmdTime <= TELEOP_TIMEOUT) &&
+            ((signed char) (seq - lastSeq) <= 0)) {
+        return;
+    }
+    if (newTurn > TELEOP_MAX_SPEED) {
+        newTurn = TELEOP_MAX_SPEED;
+    } else if (newTurn < -TELEOP_MAX_SPEED) {
+        newTurn = -TELEOP_MAX_SPEED;
+    }
+
+    lockT1IE = _T1IE;
+    _T1IE = 0;
+    lastSeq = seq;
+    targetSpeed = teleopClip(newSpeed);
+    targetTurn = newTurn;
+    lastCmdTime = getT1_ticks();
+    if (!active) {
+        active = 1;
+        legCtrlOnOff(LEG_CTRL_LEFT, PID_ON);
+        legCtrlOnOff(LEG_CTRL_RIGHT, PID_ON);
+    }
+    _T1IE = lockT1IE;
+}
+
+char teleopIsActive(void) {
+    return active;
+}
+
+static void teleopServiceRoutine(void) {
+    if (!active) {
+        return;
+    }
+
+    if (getT1_ticks() - lastCmdTime > TELEOP_TIMEOUT) {
+        targetSpeed = 0;
+        targetTurn = 0;
+        if ((speed == 0) && (turn == 0)) {
+            //Stopped; also zeroes the controller state. A running move
+            //queue keeps the controllers.
+            if (!inMotion) {
+                legCtrlSetInput(LEG_CTRL_LEFT, 0);
+                legCtrlSetInput(LEG_CTRL_RIGHT, 0);
+                legCtrlOnOff(LEG_CTRL_LEFT, PID_OFF);
+                legCtrlOnOff(LEG_CTRL_RIGHT, PID_OFF);
+            }
+            active = 0;
+            return;
+        }
+    }
+
+    speed = teleopSlew(speed, targetSpeed, TELEOP_SPEED_SLEW);
+    turn = teleopSlew(turn, targetTurn, TELEOP_TURN_SLEW);
+
+    //A running move queue owns the setpoints
+    if (!inMotion) {
+        legCtrlTrackInput(LEG_CTRL_LEFT, teleopClip(speed - turn));
+        legCtrlTrackInput(LEG_CTRL_RIGHT, teleopClip(speed + turn));
+    }
+}
+
+static int teleopSlew(int value, int target, int step) {
+    if (target > value + step) {
+        return value + step;
+    }
+    if (target < value - step) {
+        return value - step;
+    }
+    return target;
+}
+
+//Legs only run forward
+static int teleopClip(int value) {
+    if (value < 0) {
+        return 0;
+    }
+    if (value > TELEOP_MAX_SPEED) {
+        return TELEOP_MAX_SPEED;
+    }
+    return value;
+}
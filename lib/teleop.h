@@ -0,0 +1,17 @@
+#ifndef __TELEOP_H
+#define __TELEOP_H
+
+// Setpoints are leg controller inputs; speed is the mean of the two sides
+// and turn is half their difference, right side faster for turn > 0
+#define TELEOP_MAX_SPEED        4000 // FULLTHROT
+// largest setpoint change per T1 tick, so a full step takes ~0.5s
+#define TELEOP_SPEED_SLEW       8
+#define TELEOP_TURN_SLEW        8
+// T1 ticks (ms) without a command before the robot ramps down to a stop
+#define TELEOP_TIMEOUT          250
+
+void teleopSetup(void);
+void teleopSetTarget(int speed, int turn, unsigned char seq);
+char teleopIsActive(void);
+
+#endif // __TELEOP_H
@@ -1,5 +1,5 @@
 from lib import command
-from struct import pack,unpack
+from struct import pack,unpack,calcsize
 import time
 
 import shared
@@ -18,17 +18,49 @@ pktFormat = { \
     command.SET_MOVE_QUEUE:         '', \
     command.SET_STEERING_GAINS:     '6h', \
     command.SOFTWARE_RESET:         '', \
-    command.SPECIAL_TELEMETRY:      '=LL'+16*'h', \
-    command.ERASE_SECTORS:          'L', \
+    command.SPECIAL_TELEMETRY:      '', \
+    command.ERASE_SECTORS:          '=LHH', \
     command.FLASH_READBACK:         '', \
     command.SLEEP:                  'b', \
     command.ECHO:                   'c' ,\
     command.SET_VEL_PROFILE:        '24h' ,\
     command.WHO_AM_I:               '', \
     command.ZERO_POS:               '=2l', \
-    command.SET_HALL_GAINS:         '10h' \
+    command.SET_HALL_GAINS:         '10h', \
+    command.HALL_EDGE_STREAM:       'LBx', \
+    command.GET_ODOMETRY:           '=3lh', \
+    command.SET_ODOMETRY:           '=Lbx', \
+    command.SET_HEADING:            '=hbx', \
+    command.SET_TELEM_FIELDS:       '=LHH', \
+    command.GET_TELEM_HEADER:       '=LHHLHHHLH', \
+    command.TELEM_STREAM:           '=HH', \
+    command.GET_TELEM_STATS:        '=LHHH', \
+    command.GET_LOG_DIR:            '=HH', \
+    command.MULTI:                  '', \
+    command.CMD_ACK:                '=BBBB', \
+    command.CMD_NACK:               '=BBBB', \
+    command.GET_CMD_STATS:          '=5L3H12H', \
+    command.GET_POOL_STATS:         '=2L3H', \
+    command.SAVE_PARAMS:            shared.NV_PARAM_FORMAT, \
+    command.LOAD_PARAMS:            shared.NV_PARAM_FORMAT, \
+    command.DEFAULT_PARAMS:         shared.NV_PARAM_FORMAT, \
+    command.GET_PARAM:              shared.PARAM_INFO_FORMAT, \
+    command.SET_PARAM:              '=HH', \
+    command.LIST_PARAMS:            '=HHH', \
+    command.OTA_BEGIN:              shared.OTA_STATUS_FORMAT, \
+    command.OTA_DATA:               shared.OTA_STATUS_FORMAT, \
+    command.OTA_VERIFY:             shared.OTA_STATUS_FORMAT, \
+    command.OTA_ABORT:              shared.OTA_STATUS_FORMAT, \
+    command.OTA_STATUS:             shared.OTA_STATUS_FORMAT, \
+    command.CMD_WRITE_PM:           shared.OTA_STATUS_FORMAT, \
+    command.START_TELEM:            '=L' \
     }
                
+#Record layout from a list of field ids, see shared.TELEM_FIELDS
+def setTelemLayout(fields):
+    shared.telemFields = list(fields)
+    shared.telemFormat = ''.join([shared.TELEM_FIELDS[i][1] for i in fields])
+
 #XBee callback function, called every time a packet is recieved
 def xbee_received(packet):
     rf_data = packet.get('rf_data')
@@ -69,9 +101,61 @@ def xbee_received(packet):
             datum = unpack(pattern, data)
             if (datum[0] != -1):
                 dutycycles.append(datum)
+        # CMD_ACK, CMD_NACK
+        # [seq, type, result, duplicate] of a sequenced command
+        elif (type == command.CMD_ACK) or (type == command.CMD_NACK):
+            (seq, cmdType, result, dup) = unpack(pattern, data)
+            shared.cmdAcks[seq] = (cmdType, result, dup)
+            if result != 0:
+                print "Command 0x%02X refused, result %d" % (cmdType, result)
+        # GET_CMD_STATS
+        # [count, queueSum, queueMax, execSum, execMax, priority, depthMax, dropped]
+        # then the queueing delay histogram, see cmdStatsStruct in cmd.h
+        elif (type == command.GET_CMD_STATS):
+            shared.cmdStats = unpack(pattern, data)
+        # GET_POOL_STATS
+        # [taken, misses, failures, low water, size], see payPoolStatsStruct
+        elif (type == command.GET_POOL_STATS):
+            shared.poolStats = unpack(pattern, data)
+        # SAVE_PARAMS, LOAD_PARAMS, DEFAULT_PARAMS
+        # [result][source] then the parameter block, see cmdParamReplyStruct
+        elif (type == command.SAVE_PARAMS) or (type == command.LOAD_PARAMS) \
+                or (type == command.DEFAULT_PARAMS):
+            shared.nvParams = unpack(pattern, data)
+        # GET_PARAM
+        # [id, type, flags, min, max, value]; type 0 for an unknown id
+        elif (type == command.GET_PARAM):
+            info = unpack(pattern, data)
+            if info[1] != 0:
+                shared.paramInfo[info[0]] = info[1:]
+        # SET_PARAM
+        # [result, rejected index] then [id, value] in effect for each sent
+        elif (type == command.SET_PARAM):
+            shared.paramSetResult = unpack(pattern, data[0:4])
+            for i in range((len(data) - 4) / calcsize('=Hl')):
+                (id, value) = unpack('=Hl', data[4 + i*6:10 + i*6])
+                if id in shared.paramInfo:
+                    shared.paramInfo[id] = shared.paramInfo[id][0:4] + (value,)
+        # OTA_BEGIN, OTA_DATA, OTA_VERIFY, OTA_ABORT, OTA_STATUS, CMD_WRITE_PM
+        # [result, state, next offset, crc, raw crc, raw length]
+        elif type in (command.OTA_BEGIN, command.OTA_DATA, command.OTA_VERIFY, \
+                      command.OTA_ABORT, command.OTA_STATUS, command.CMD_WRITE_PM):
+            shared.otaStatus = (type,) + unpack(pattern, data)
+        # LIST_PARAMS
+        # [total, start, count] then count GET_PARAM entries
+        elif (type == command.LIST_PARAMS):
+            (total, start, count) = unpack(pattern, data[0:6])
+            entryLen = calcsize(shared.PARAM_INFO_FORMAT)
+            for i in range(count):
+                info = unpack(shared.PARAM_INFO_FORMAT, \
+                    data[6 + i*entryLen:6 + (i+1)*entryLen])
+                shared.paramInfo[info[0]] = info[1:]
+            shared.paramCount = total
         # ECHO
         elif type == command.ECHO:
-            print "echo: status = ",status," type=",type," data = ",data
+            shared.echoTimes[data] = time.time()
+            if not shared.echoQuiet:
+                print "echo: status = ",status," type=",type," data = ",data
         # SET_PID_GAINS
         elif type == command.SET_PID_GAINS:
             print "Set PID gains"
@@ -99,23 +183,13 @@ def xbee_received(packet):
             if (datum[0] != -1):
                 for i in range(pp):
                     shared.imudata.append(datum[4*i:4*(i+1)] )
-        # SPECIAL_TELEMETRY
-        elif type == command.SPECIAL_TELEMETRY:
-            shared.pkts = shared.pkts + 1
-            #print "Special Telemetry Data Packet, ",shared.pkts
-            datum = unpack(pattern, data)
-            datum = list(datum)
-            telem_index = datum.pop(0)
-            #print "Special Telemetry Data Packet #",telem_index
-            if (datum[0] != -1) and (telem_index) >= 0:
-                shared.imudata[telem_index] = datum
-                shared.bytesIn = shared.bytesIn + (2*4 + 15*2)
         # ERASE_SECTORS
+        # progress: [numSamples, blocks done, blocks total]
         elif type == command.ERASE_SECTORS:
             datum = unpack(pattern, data)
-            #if datum[0] == 0:
-            #    shared.flash_erased = True
-            shared.flash_erased = datum[0]
+            shared.eraseProgress = datum[1:3]
+            shared.last_packet_time = time.time()
+            shared.flash_erased = (datum[1] >= datum[2])
         # SLEEP
         elif type == command.SLEEP:
             datum = unpack(pattern, data)
@@ -138,6 +212,123 @@ def xbee_received(packet):
             print "Set Velocity Profile readback:"
             temp = unpack(pattern, data)
             print temp
+        # HALL_EDGE_STREAM
+        # [overflow count] followed by a variable number of (time, chan) edges
+        elif (type == command.HALL_EDGE_STREAM):
+            shared.hallEdgeOverflows = unpack('H', data[0:2])[0]
+            numEdges = (len(data) - 2) / calcsize('=' + pattern)
+            edges = unpack('=' + numEdges*pattern, data[2:])
+            for i in range(numEdges):
+                shared.halledges.append(edges[2*i:2*(i+1)])
+        # GET_ODOMETRY
+        elif (type == command.GET_ODOMETRY):
+            shared.odometry = unpack(pattern, data)
+            print "Odometry x,y,dist (mm), heading (deg):", \
+                shared.odometry[0:3], shared.odometry[3]*360.0/65536
+        # SET_ODOMETRY
+        elif (type == command.SET_ODOMETRY):
+            print "Set odometry readback:", unpack(pattern, data)
+        # SET_HEADING
+        elif (type == command.SET_HEADING):
+            datum = unpack(pattern, data)
+            print "Set heading (deg):", datum[0]*360.0/65536, \
+                "relative" if datum[1] else "absolute"
+            shared.steering_heading_set = True
+        # SET_TELEM_FIELDS
+        elif (type == command.SET_TELEM_FIELDS):
+            [mask, recordSize, shared.telemEncoding] = unpack(pattern, data)
+            setTelemLayout([i for i in range(len(shared.TELEM_FIELDS)) \
+                                if mask & (1 << i)])
+            print "Telemetry fields:", \
+                [shared.TELEM_FIELDS[i][0] for i in shared.telemFields], \
+                ",", recordSize, "bytes/sample, encoding", shared.telemEncoding
+            shared.telem_fields_set = True
+        # GET_TELEM_HEADER
+        # [magic, version, recordSize, fieldMask, skip, firstPage,
+        #  bytesPerPage, numSamples, numFields] then (id, size) pairs for
+        #  every possible field, then [encoding, mode, oldestPage, numPages,
+        #  triggerSource, postTrigger]
+        elif (type == command.GET_TELEM_HEADER):
+            hdrLen = calcsize(pattern)
+            hdr = unpack(pattern, data[0:hdrLen])
+            if hdr[0] != 0x4D4C4554:
+                print "No telemetry log header found"
+            else:
+                numFields = hdr[8]
+                fields = unpack('=' + numFields*'BB', \
+                                data[hdrLen:hdrLen + 2*numFields])
+                setTelemLayout(fields[0::2])
+                shared.telemHeader = hdr
+                encOffset = hdrLen + 2*len(shared.TELEM_FIELDS)
+                shared.telemEncoding = unpack('=H', data[encOffset:encOffset+2])[0]
+                shared.telemLogInfo = unpack('=HHHHL', data[encOffset+2:encOffset+14])
+                print "Log header:", hdr[7], "samples,", hdr[2], "bytes/sample"
+                if shared.telemLogInfo[0] == 1:
+                    print "Circular log:", shared.telemLogInfo[2], "pages, trigger", \
+                        shared.telemLogInfo[3], ",", shared.telemLogInfo[4], \
+                        "samples after trigger"
+            shared.telem_header_received = True
+        # FLASH_READBACK
+        # Log chunks: [seq][data], or [0xFFFFFFFF][end seq] at the end
+        elif (type == command.FLASH_READBACK):
+            seq = unpack('=L', data[0:4])[0]
+            if seq == 0xFFFFFFFF:
+                shared.rbEnd = unpack('=L', data[4:8])[0]
+            else:
+                shared.rbChunks[seq] = data[4:]
+                shared.bytesIn = shared.bytesIn + len(data)
+        # TELEM_STREAM
+        # [seq][records dropped on robot] then records of the current layout
+        elif (type == command.TELEM_STREAM):
+            (seq, dropped) = unpack(pattern, data[0:4])
+            if shared.streamLastSeq >= 0:
+                shared.streamPktsLost = shared.streamPktsLost + \
+                    ((seq - shared.streamLastSeq - 1) & 0xFFFF)
+            shared.streamLastSeq = seq
+            shared.streamRecordsLost = dropped
+            recFormat = '=' + shared.telemFormat
+            recSize = calcsize(recFormat)
+            for i in range((len(data) - 4) / recSize):
+                shared.streamdata.append( \
+                    unpack(recFormat, data[4 + i*recSize:4 + (i+1)*recSize]))
+        # GET_TELEM_STATS
+        # [records logged, samples dropped, peak ring fill, pages written]
+        elif (type == command.GET_TELEM_STATS):
+            shared.telemStats = unpack(pattern, data)
+            print "Log: %d records, %d dropped, ring peak %d, %d pages" % \
+                shared.telemStats
+        # GET_LOG_DIR
+        # [first index, total runs] then up to 4 entries of
+        # [runId, headerPage, numPages, mode, numSamples, fieldMask, startTime]
+        elif (type == command.GET_LOG_DIR):
+            (first, total) = unpack(pattern, data[0:4])
+            entryLen = calcsize('=HHHHLLL')
+            for i in range((len(data) - 4) / entryLen):
+                shared.logDir[first + i] = unpack('=HHHHLLL', \
+                    data[4 + i*entryLen:4 + (i+1)*entryLen])
+            shared.logDirCount = total
+            if len(shared.logDir) >= total:
+                shared.log_dir_received = True
+        # MULTI
+        # types of the records dispatched, in order; their own confirmations
+        # are not sent
+        elif (type == command.MULTI):
+            shared.multi_ack = [ord(c) for c in data]
+            if command.SET_PID_GAINS in shared.multi_ack:
+                shared.motor_gains_set = True
+            if command.SET_STEERING_GAINS in shared.multi_ack:
+                shared.steering_gains_set = True
+            if command.SET_CTRLD_TURN_RATE in shared.multi_ack:
+                shared.steering_rate_set = True
+            print "Multi: %d commands" % len(shared.multi_ack)
+        # START_TELEM
+        # field mask of the hall telemetry run, 0 if it was refused
+        elif (type == command.START_TELEM):
+            mask = unpack(pattern, data)[0]
+            if mask == 0:
+                print "Hall telemetry refused, stop streaming first"
+            else:
+                print "Hall telemetry started, field mask 0x%08X" % mask
         # WHO_AM_I
         elif (type == command.WHO_AM_I):
             #print "whoami:",status, hex(type), data
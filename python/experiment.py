@@ -40,15 +40,12 @@ def main():
     #time.sleep(1)
     #sleepRobot()
     
-    setSteeringRate(0)
-
     #Motor gains format:
     #  [ Kp , Ki , Kd , Kaw , Kff     ,  Kp , Ki , Kd , Kaw , Kff ]
     #    ----------LEFT----------        ---------_RIGHT----------
     
     motorgains = [8000,100,2,0,0 , 8000,100,2,0,0] #Hardware PID
     #motorgains = [200,2,0,2,0,    200,2,0,2,0]       #Software PID
-    setMotorGains(motorgains)
 
     #Steering gains format:
     #  [ Kp , Ki , Kd , Kaw , Kff]
@@ -56,7 +53,9 @@ def main():
     steeringGains = [5000,0,0,0,0,  STEER_MODE_DECREASE] # Disables steering controller
     #steeringGains = [20,1,0,1,0,  STEER_MODE_DECREASE]
     #steeringGains = [50,10,0,0,0,  STEER_MODE_DECREASE] # Hardware PID
-    setSteeringGains(steeringGains)
+
+    # gains and a zero turn rate, sent as one frame
+    sendRunSetup(motorgains, steeringGains, 0)
 
     #### Do not send more than 5 move segments per packet!   ####
     #### Instead, send multiple packets, and don't use       ####
@@ -91,9 +90,9 @@ def main():
     numSamples = calcNumSamples(moveq)
     shared.imudata = [ [] ] * numSamples
     
-    #Flash must be erased to save new data
+    #Erase ahead of the log while recording, so the run can start right away
     if SAVE_DATA:
-        eraseFlashMem(numSamples)
+        eraseFlashMem(numSamples, ahead = True)
 
     # Pause and wait to start run, including leadin time
     raw_input("Press enter to start run ...")
@@ -182,6 +182,23 @@ def setupSerial():
     shared.xb = XBee(shared.ser, callback = xbee_received)
 
 
+# stream per-edge hall timestamps; edges collect in shared.halledges
+def setHallEdgeStream(onoff):
+    xb_send(0, command.HALL_EDGE_STREAM, pack('b', onoff))
+
+def getOdometry():
+    xb_send(0, command.GET_ODOMETRY, "")
+
+# strideUm = 0 keeps the current stride length calibration
+def setOdometry(strideUm, reset):
+    xb_send(0, command.SET_ODOMETRY, pack('=Lbx', strideUm, reset))
+
+# log count samples at 1kHz / skip, starting startDelay ms from now; the
+# hall fields are always logged, gyro, accelerometer and pose fields never.
+# The field selection is put back when the run ends.
+def startHallTelemetry(startDelay, count, skip):
+    xb_send(0, command.START_TELEM, pack('=Lhh', startDelay, count, skip))
+
 def getDstAddrString():
     return hex(256* ord(shared.DEST_ADDR[0])+ ord(shared.DEST_ADDR[1]))
     
@@ -21,7 +21,8 @@ dutycycles = []
 motordata = []
 gainsNotSet = True;
 
-MAXTHROT = 5
+MAXSPEED = 1000    # leg controller input at full stick
+TELEOP_RATE = 50.0 # Hz
 
 
 ser = serial.Serial(shared.BS_COMPORT, 230400,timeout=3, rtscts=1)
@@ -36,7 +37,6 @@ def resetRobot():
 
 
 def main():
-    global MAXTHROT
     dataFileName = 'imudata.txt'
 
     if ser.isOpen():
@@ -50,9 +50,6 @@ def main():
         j1 = pygame.joystick.Joystick(0)
         j1.init()
         print j1.get_name()
-        j2 = pygame.joystick.Joystick(1)
-        j2.init()
-        print j2.get_name()
     except:
         print 'No joystick'
         xb.halt()
@@ -65,13 +62,11 @@ def main():
     #    xb_send(0, command.SET_PID_GAINS, pack('10h',*motorgains))
     #   time.sleep(1)
     
-    throttle = [0,0]
-    tinc = 25;
+    teleopSeq = 0
 
     try:    
         while True:
 
-            value = []
             pygame.event.pump()
             left_throt = -j1.get_axis(3)
             right_throt = -j1.get_axis(1)
@@ -79,37 +74,21 @@ def main():
                 left_throt = 0
             if right_throt < 0.01:
                 right_throt = 0
-            left_throt = MAXTHROT * left_throt
-            right_throt = MAXTHROT * right_throt
-            #print "L: ",left_throt,"  |   R: ",right_throt
+            left_throt = MAXSPEED * left_throt
+            right_throt = MAXSPEED * right_throt
             sys.stdout.write(" "*60 + "\r")
             sys.stdout.flush()
             outstring = "L: {0:03.1f}  |   R: {1:03.1f} \r".format(left_throt,right_throt)
             sys.stdout.write(outstring)
             sys.stdout.flush()
-            #throttle = [0 if t<0 else t for t in throttle]
-            #throttle = [-1-left_throt*4, right_throt*4]
-            throttle = [left_throt*4, right_throt*4]
-            #thrust = [left_throt, 0, right_throt, 0, 0]
-            #xb_send(0, command.SET_THRUST_CLOSED_LOOP, pack('5h',*thrust))
-            datum = pack('2h',*throttle)
-            xb_send(0,command.SET_THRUST_OPEN_LOOP,datum)
-            
-            time.sleep(0.1)
-            
-            left_throt = -j2.get_axis(3)
-            right_throt = -j2.get_axis(1)
-            if left_throt < 0.01:
-                left_throt = 0
-            if right_throt < 0.01:
-                right_throt = 0
-            left_throt = MAXTHROT * left_throt
-            right_throt = MAXTHROT * right_throt
-            throttle = [-1-left_throt*4, right_throt*4]
-            xb_send(0,command.SET_THRUST_OPEN_LOOP,pack('2h',*throttle))
-            #print unpack('2h',datum)
-
-            time.sleep(0.1)
+            # Tank drive to speed/turn; the robot ramps the legs between
+            # setpoints and stops if the stream goes stale
+            speed = int((left_throt + right_throt) / 2)
+            turn = int((right_throt - left_throt) / 2)
+            teleopSeq = (teleopSeq + 1) % 256
+            xb_send(0, command.TELEOP, pack('=hhBx', speed, turn, teleopSeq))
+
+            time.sleep(1.0 / TELEOP_RATE)
 
     except:
         print
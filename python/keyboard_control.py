@@ -35,6 +35,18 @@ def xb_send(status, type, data):
 def resetRobot():
     xb_send(0, command.SOFTWARE_RESET, pack('h',0))
 
+# Streamed at TELEOP_RATE; the robot ramps the legs between setpoints and
+# stops if the stream goes stale
+TELEOP_RATE = 25.0
+teleopSeq = 0
+def sendTeleop(throttle):
+    global teleopSeq
+    teleopSeq = (teleopSeq + 1) % 256
+    # throttle is [right, left]
+    speed = (throttle[0] + throttle[1]) / 2
+    turn = (throttle[0] - throttle[1]) / 2
+    xb_send(0, command.TELEOP, pack('=hhBx', speed, turn, teleopSeq))
+
 def menu():
     print "-------------------------------------"
     print "Keyboard control Sep. 23, 2011"
@@ -76,6 +88,10 @@ def main():
         ch = msvcrt.getch()
     menu()
     while True:
+        sendTeleop(throttle)
+        time.sleep(1.0 / TELEOP_RATE)
+        if not msvcrt.kbhit():
+            continue
         keypress = msvcrt.getch()
         if keypress == ' ':
             throttle = [0,0]
@@ -100,11 +116,7 @@ def main():
             sys.exit(0)
 
         throttle = [0 if t<0 else t for t in throttle]
-        thrust = [throttle[0], 1000, throttle[1], 1000, 0]
-        xb_send(0, command.SET_THRUST_CLOSED_LOOP, pack('5h',*thrust))
-        #xb_send(0,command.SET_THRUST_OPEN_LOOP,pack('2h',*throttle))
         print "Throttle = ",throttle
-        time.sleep(0.1)
 
 #Provide a try-except over the whole main function
 # for clean exit. The Xbee module should have better
@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+"""
+Command latency benchmark: pings the robot with ECHO at several rates, with
+and without live telemetry streaming as background traffic, and reports the
+round trip times seen by the host along with the robot's own queueing and
+execution times (GET_CMD_STATS, see cmdStatsUpdate() in cmd.c).
+
+"""
+from lib import command
+import time,sys
+import serial
+import shared
+
+from or_helpers import *
+
+###### Benchmark settings ####
+PINGS = 200
+# (ping rate in Hz, telemetry stream skip; 0 leaves streaming off)
+LOADS = [(5, 0), (20, 0), (50, 0), (100, 0),
+         (20, 3), (50, 3), (50, 1)]
+CMD_STATS_BINS = 12   # see cmd.h
+
+def percentile(values, p):
+    if values == []:
+        return float('nan')
+    values = sorted(values)
+    return values[int(round(p / 100.0 * (len(values) - 1)))]
+
+# Upper bound of the histogram bin holding the p-th percentile, in us
+def histPercentile(hist, p):
+    total = sum(hist)
+    if total == 0:
+        return float('nan')
+    count = 0
+    for i in range(CMD_STATS_BINS):
+        count = count + hist[i]
+        if count >= p / 100.0 * total:
+            if i == CMD_STATS_BINS - 1:
+                return float('inf')
+            return 128 << i
+
+def runLoad(rate, skip):
+    if skip:
+        setTelemStream(1, skip)
+        time.sleep(0.5)
+    getCmdStats(reset = True)
+    getPoolStats(reset = True)
+    shared.echoTimes = {}
+
+    sent = {}
+    for i in range(PINGS):
+        data = pack('=L', i)
+        sent[data] = time.time()
+        sendEcho(data)
+        time.sleep(1.0 / rate)
+    time.sleep(1)
+
+    if skip:
+        setTelemStream(0, skip)
+    stats = getCmdStats()
+    pool = getPoolStats()
+
+    rtt = [(shared.echoTimes[d] - sent[d]) * 1000 for d in sent \
+                if d in shared.echoTimes]
+    print "%4d Hz, stream %s: %d/%d replies" % (rate, \
+        skip and ("300/%d Hz" % skip) or "off", len(rtt), PINGS)
+    print "    RTT ms     p50 %6.1f  p90 %6.1f  p99 %6.1f  max %6.1f" % \
+        (percentile(rtt, 50), percentile(rtt, 90), percentile(rtt, 99), \
+         max(rtt or [float('nan')]))
+    if stats is None:
+        print "    no command statistics from the robot"
+        return
+    (count, queueSum, queueMax, execSum, execMax, priority, depthMax, \
+        dropped) = stats[0:8]
+    hist = stats[8:]
+    if count > 0:
+        print "    queue us   mean %6d  p50 <%5s  p99 <%5s  max %6d  depth %d" % \
+            (queueSum / count, histPercentile(hist, 50), \
+             histPercentile(hist, 99), queueMax, depthMax)
+        print "    exec us    mean %6d  max %6d" % (execSum / count, execMax)
+    if dropped > 0:
+        print "    %d commands dropped, main loop too far behind" % dropped
+    if pool is not None:
+        print "    tx pool    %d taken  %d misses  %d dropped  low %d/%d" % pool
+
+def main():
+    setupSerial()
+    shared.echoQuiet = True
+
+    for (rate, skip) in LOADS:
+        runLoad(rate, skip)
+
+    shared.xb.halt()
+    shared.ser.close()
+    print "Done"
+
+#Provide a try-except over the whole main function
+# for clean exit. The Xbee module should have better
+# provisions for handling a clean exit, but it doesn't.
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print "\nRecieved Ctrl+C, exiting."
+        shared.xb.halt()
+        shared.ser.close()
+    except Exception as args:
+        print "\nGeneral exception:",args
+        print "Attemping to exit cleanly..."
+        shared.xb.halt()
+        shared.ser.close()
+        sys.exit()
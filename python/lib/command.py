@@ -69,5 +69,35 @@ START_TELEM =               0x8F
 ZERO_POS =                  0x90
 SET_HALL_GAINS =            0x91
 SET_TAIL_QUEUE =            0x92
+HALL_EDGE_STREAM =          0x93
+GET_ODOMETRY =              0x94
+SET_ODOMETRY =              0x95
+SET_HEADING =               0x96
+SET_TELEM_FIELDS =          0x97
+GET_TELEM_HEADER =          0x98
+TELEM_STREAM =              0x99
+READBACK_ACK =              0x9A
+GET_TELEM_STATS =           0x9B
+CIRCULAR_LOG =              0x9C
+LOG_TRIGGER =               0x9D
+GET_LOG_DIR =               0x9E
+SELECT_LOG =                0x9F
+CLEAR_LOG_DIR =             0xA0
+MULTI =                     0xA1
+EMERGENCY_STOP =            0xA2
+GET_CMD_STATS =             0xA3
+TELEOP =                    0xA4
+SAVE_PARAMS =               0xA5
+LOAD_PARAMS =               0xA6
+DEFAULT_PARAMS =            0xA7
+GET_PARAM =                 0xA8
+SET_PARAM =                 0xA9
+LIST_PARAMS =               0xAA
+OTA_BEGIN =                 0xAB
+OTA_DATA =                  0xAC
+OTA_VERIFY =                0xAD
+OTA_ABORT =                 0xAE
+OTA_STATUS =                0xAF
+GET_POOL_STATS =            0xB0
 
 # CMD values of 0xF0(240) - 0xFF(255) are reserved for future use
@@ -1,12 +1,13 @@
 import glob
 import time
+import random
 import sys
 from lib import command
 from callbackFunc import xbee_received
 import datetime
 import serial
 import shared
-from struct import pack
+from struct import pack,unpack,calcsize
 from xbee import XBee
 from math import ceil,floor
 import numpy as np
@@ -34,6 +35,30 @@ def xb_send(xb, DEST_ADDR, status, type, data):
     payload = chr(status) + chr(type) + ''.join(data)
     xb.tx(dest_addr = DEST_ADDR, data = payload)
     
+# Result codes of sequenced commands, CMD_RESULT_* in cmd.h
+CMD_RESULT_OK = 0
+CMD_RESULT_BAD_TYPE = 1
+CMD_RESULT_BAD_LENGTH = 2
+
+# Sends a command with a sequence number in the status byte, resending it
+# until the robot acknowledges it. The robot runs a resent command only once,
+# so this is safe for commands like SET_MOVE_QUEUE. Returns the result code,
+# or None if no acknowledgement came back.
+def sendReliable(type, data, retries = 8, timeout = 0.3):
+    if shared.cmdSeq == 0:
+        shared.cmdSeq = random.randint(1, 255)
+    shared.cmdSeq = shared.cmdSeq % 255 + 1
+    seq = shared.cmdSeq
+    shared.cmdAcks.pop(seq, None)
+    for i in range(retries):
+        xb_send(shared.xb, shared.DEST_ADDR, seq, type, data)
+        t = time.time() + timeout
+        while time.time() < t:
+            if seq in shared.cmdAcks:
+                return shared.cmdAcks.pop(seq)[1]
+            time.sleep(0.01)
+    return None
+
 def xb_safe_exit():
     print "Halting xb"
     shared.xb.halt()
@@ -76,7 +101,8 @@ def writeFileHeader(dataFileName):
     fileout.write('%  numSamples    = ' + repr(shared.numSamples) + '\n')
     fileout.write('%  moveq         = ' + repr(shared.moveq) + '\n')
     fileout.write('% Columns: \n')
-    fileout.write('% time | Llegs | Rlegs | DCL | DCR | GyroX | GyroY | GyroZ | GryoZAvg | AccelX | AccelY |AccelZ | LBEMF | RBEMF | SteerOut | Vbatt | SteerAngle\n')
+    fileout.write('% ' + ' | '.join([shared.TELEM_FIELDS[i][0] \
+                                    for i in shared.telemFields]) + '\n')
     fileout.close()
 
 def dlProgress(current, total):
@@ -93,13 +119,120 @@ def dlProgress(current, total):
 def sendEcho(msg):
     xb_send(shared.xb, shared.DEST_ADDR, 0, command.ECHO, msg)
     
-def downloadTelemetry(numSamples):
+# Readback, see telemReadbackStart() in telem.c: the log is read as
+# RB_CHUNK byte chunks of each page, numbered from the first log page
+RB_CHUNK = 96
+RB_MAX_NACKS = 8
+RB_ACK_INTERVAL = 0.05
+RB_MAX_RESUMES = 10
+
+def rbChunksPerPage():
+    return int(ceil(shared.telemHeader[6] / float(RB_CHUNK)))
+
+# Lowest chunk not yet received, and up to RB_MAX_NACKS gaps above it
+def rbAckState(startSeq, endSeq):
+    ackSeq = startSeq
+    while (ackSeq < endSeq) and (ackSeq in shared.rbChunks):
+        ackSeq = ackSeq + 1
+    nacks = []
+    if len(shared.rbChunks) > 0:
+        top = min(max(shared.rbChunks.keys()), endSeq)
+        seq = ackSeq + 1
+        while (seq < top) and (len(nacks) < RB_MAX_NACKS):
+            if seq not in shared.rbChunks:
+                nacks.append(seq)
+            seq = seq + 1
+    return ackSeq, nacks
+
+def sendReadbackAck(ackSeq, nacks):
+    args = nacks + [0]*(RB_MAX_NACKS - len(nacks))
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.READBACK_ACK, \
+            pack('=LH' + RB_MAX_NACKS*'L', ackSeq, len(nacks), *args))
+
+# Decodes a delta encoded page: [records][bytes used], a raw keyframe, then
+# zig-zag varint deltas of each field
+def decodeTelemPage(page):
+    fmt = shared.telemFormat
+    nrec = unpack('=H', page[0:2])[0]
+    keylen = calcsize('=' + fmt)
+    rec = list(unpack('=' + fmt, page[4:4 + keylen]))
+    records = [list(rec)]
+    idx = 4 + keylen
+    for r in range(nrec - 1):
+        for j in range(len(fmt)):
+            z = 0
+            shift = 0
+            while True:
+                b = ord(page[idx])
+                idx = idx + 1
+                z = z | ((b & 0x7F) << shift)
+                shift = shift + 7
+                if b < 0x80:
+                    break
+            d = (z >> 1) ^ -(z & 1)
+            if fmt[j] == 'L':
+                rec[j] = (rec[j] + d) & 0xFFFFFFFF
+            elif fmt[j] == 'l':
+                rec[j] = ((rec[j] + d + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+            else:
+                rec[j] = ((rec[j] + d + 0x8000) & 0xFFFF) - 0x8000
+        records.append(list(rec))
+    return records
+
+# Records of one page, raw or delta encoded
+def decodePage(page):
+    if shared.telemEncoding == 1:
+        (nrec, used) = unpack('=HH', page[0:4])
+        if nrec == 0 or nrec == 0xFFFF:
+            return []
+        return decodeTelemPage(page[0:used])
+    recFormat = '=' + shared.telemFormat
+    recSize = calcsize(recFormat)
+    return [list(unpack(recFormat, page[i*recSize:(i+1)*recSize])) \
+                for i in range(len(page) / recSize)]
+
+# Windowed readback of numSamples, starting at startSample (raw logs only;
+# encoded logs always start at the first page). The host acknowledges every
+# RB_ACK_INTERVAL with the first missing chunk and a list of gaps; if the
+# robot stops sending, readback is resumed from the first missing chunk, up
+# to RB_MAX_RESUMES times.
+def downloadTelemetry(numSamples, startSample = 0):
     #Wait for run length before starting download
     time.sleep((shared.runtime + shared.leadinTime + shared.leadoutTime)/1000.0 + 1)
     
     raw_input("Press Enter to start readback ...")
+    getTelemHeader()
+    readbackTelemetry(numSamples, startSample)
+
+# Reads back the selected run (the last one unless selectLog was used)
+# into shared.dataFileName
+def readbackTelemetry(numSamples, startSample = 0):
+    if shared.telemHeader is None:
+        print "No log to read back"
+        return
+
+    cpp = rbChunksPerPage()
+    recSize = shared.telemHeader[2]
+    perPage = shared.telemHeader[6] / recSize
+    circular = (shared.telemLogInfo[0] == 1)
+    if circular:
+        # the whole ring is read back, oldest page first
+        startSample = 0
+        numSamples = shared.telemHeader[7]
+    if shared.telemEncoding == 1:
+        startSample = 0
+    startPage = startSample / perPage
+    # an upper bound for encoded logs; the robot reports the actual end
+    endPage = int(ceil((startSample + numSamples) / float(perPage)))
+    if circular:
+        endPage = shared.telemLogInfo[2]
+    startSeq = startPage * cpp
+    shared.rbEnd = endPage * cpp
+    shared.rbChunks = {}
+
     print "started readback"
-    xb_send(shared.xb, shared.DEST_ADDR, 0, command.FLASH_READBACK, pack('=L',numSamples))
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.FLASH_READBACK, \
+            pack('=LL', startSeq, shared.rbEnd))
 
     # While downloading via callbackfunc, write parameters to start of file
     writeFileHeader(shared.dataFileName)
@@ -107,27 +240,52 @@ def downloadTelemetry(numSamples):
     dlStart = time.time()
     shared.last_packet_time = dlStart
     shared.bytesIn = 0
-    while shared.imudata.count([]) > 0:
-        time.sleep(0.1)
-        #print "Downloading ...",(n-shared.imudata.count([])),"/",n
-        dlProgress(numSamples -shared.imudata.count([]) , numSamples)
+    ackSeq = startSeq
+    resumes = 0
+    while ackSeq < shared.rbEnd:
+        time.sleep(RB_ACK_INTERVAL)
+        (ackSeq, nacks) = rbAckState(startSeq, shared.rbEnd)
+        sendReadbackAck(ackSeq, nacks)
+        dlProgress(ackSeq - startSeq, shared.rbEnd - startSeq)
         if (time.time() - shared.last_packet_time) > shared.readback_timeout:
-            print "\nReadback timeout exceeded, restarting."
-            raw_input("Press Enter to start readback ...")
-            shared.imudata = [ [] ] * numSamples
-            print "started readback"
-            dlStart = time.time()
-            shared.last_packet_time = dlStart
-            xb_send(shared.xb, shared.DEST_ADDR, \
-                    0, command.FLASH_READBACK, pack('=L',numSamples))
+            if resumes == RB_MAX_RESUMES:
+                print "\nNo reply after %d resumes, readback aborted at chunk %d" \
+                      % (resumes, ackSeq)
+                sendReadbackAck(shared.rbEnd, [])
+                return
+            resumes += 1
+            print "\nReadback timeout exceeded, resuming at chunk", ackSeq
+            shared.last_packet_time = time.time()
+            xb_send(shared.xb, shared.DEST_ADDR, 0, command.FLASH_READBACK, \
+                    pack('=LL', ackSeq, shared.rbEnd))
+    # Release the robot in case the last ACK was lost
+    sendReadbackAck(shared.rbEnd, [])
 
     dlEnd = time.time()
     #Final update to download progress bar to make it show 100%
-    dlProgress(numSamples-shared.imudata.count([]) , numSamples)
+    dlProgress(ackSeq - startSeq, shared.rbEnd - startSeq)
     print "\nTime: %.2f s ,  %.3f KBps" % ( (dlEnd - dlStart), \
                         shared.bytesIn / (1000*(dlEnd - dlStart)))
 
     print "readback done"
+    missing = [seq for seq in range(startPage * cpp, shared.rbEnd / cpp * cpp) \
+                if seq not in shared.rbChunks]
+    if missing:
+        print "%d chunks missing, from chunk %d; nothing saved" % \
+              (len(missing), missing[0])
+        return
+    data = []
+    for page in range(startPage, shared.rbEnd / cpp):
+        pageData = ''.join([shared.rbChunks[seq] \
+                    for seq in range(page * cpp, (page + 1) * cpp)])
+        data.extend(decodePage(pageData))
+    skip = startSample - startPage * perPage
+    if circular and shared.telemEncoding == 1:
+        numSamples = len(data)
+    shared.imudata = data[skip:skip + numSamples]
+    if circular and shared.telemLogInfo[3] != 0:
+        print "trigger at sample", len(shared.imudata) - shared.telemLogInfo[4]
+
     fileout = open(shared.dataFileName, 'a')
     np.savetxt(fileout , np.array(shared.imudata), '%d', delimiter = ',')
 
@@ -135,6 +293,157 @@ def downloadTelemetry(numSamples):
     #Done with flash download and save
     
     
+# Downloads every run of the log directory, the whole of each run
+def downloadAllLogs():
+    getLogDir()
+    for i in range(shared.logDirCount):
+        shared.telemHeader = None
+        selectLog(i)
+        shared.dataFileName = findFileName()
+        print "Run", i, "->", shared.dataFileName
+        readbackTelemetry(shared.logDir[i][4])
+    if shared.logDirCount > 0:
+        selectLog(shared.logDirCount - 1)
+
+# Command latency statistics of the robot, optionally cleared after reading
+def getCmdStats(reset = False):
+    shared.cmdStats = None
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_CMD_STATS, \
+            pack('=bx', reset))
+    t = time.time() + 1
+    while shared.cmdStats is None and time.time() < t:
+        time.sleep(0.01)
+    return shared.cmdStats
+
+# TX payload stock counters, (taken, misses, failures, low water, size); a
+# miss is a packet that had to allocate on the robot, a failure one dropped
+def getPoolStats(reset = False):
+    shared.poolStats = None
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_POOL_STATS, \
+            pack('=bx', reset))
+    t = time.time() + 1
+    while shared.poolStats is None and time.time() < t:
+        time.sleep(0.01)
+    return shared.poolStats
+
+# Parameter block on the robot, loaded at boot; see nvparams.h. Setting
+# gains, steering mode or stride changes the values in use, saveParams()
+# writes them to flash. Each returns (result, source, params), params a
+# dict, or None if the robot did not reply.
+def saveParams():
+    return paramCommand(command.SAVE_PARAMS)
+
+# Discards unsaved changes; applied by the robot at the next reset
+def loadParams():
+    return paramCommand(command.LOAD_PARAMS)
+
+# Compile time defaults; saveParams() to keep them
+def defaultParams():
+    return paramCommand(command.DEFAULT_PARAMS)
+
+def paramCommand(type):
+    shared.nvParams = None
+    if sendReliable(type, "") != CMD_RESULT_OK:
+        return None
+    t = time.time() + 1
+    while shared.nvParams is None and time.time() < t:
+        time.sleep(0.01)
+    if shared.nvParams is None:
+        return None
+    v = shared.nvParams
+    params = {'version': v[3],
+              'legGains': [list(v[5:10]), list(v[10:15])],
+              'hallGains': [list(v[15:20]), list(v[20:25])],
+              'steeringGains': list(v[25:30]),
+              'steeringMode': v[30],
+              'telemSkip': v[31],
+              'strideUm': v[32],
+              'radioChannel': v[33],
+              'radioSrcAddr': v[34],
+              'radioPanId': v[35],
+              'radioDstAddr': v[36],
+              'pidZeroing': v[37],
+              'bemfIIR': v[38],
+              'gyroAvgSamples': v[39],
+              'gyroFilter': v[40]}
+    print "Parameters from", ("defaults", "flash")[v[1]], \
+          v[0] and "" or "(failed)"
+    return (v[0], v[1], params)
+
+# Parameter registry: every field of the parameter block by name, see
+# shared.PARAM_NAMES. Names or ids may be used.
+def paramId(name):
+    if isinstance(name, int):
+        return name
+    return shared.PARAM_NAMES.index(name)
+
+# Value of one parameter, or None if the robot did not reply
+def getParam(name):
+    id = paramId(name)
+    shared.paramInfo.pop(id, None)
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_PARAM, pack('=H', id))
+    t = time.time() + 1
+    while id not in shared.paramInfo and time.time() < t:
+        time.sleep(0.01)
+    if id not in shared.paramInfo:
+        return None
+    return shared.paramInfo[id][4]
+
+# Sets parameters from a {name: value} dict, up to 8 at a time; the robot
+# applies all of them between two control ticks, or none if one is rejected.
+# Returns the NVPARAM_* result (0 ok, 1 bad id, 2 out of range).
+def setParams(values):
+    items = [(paramId(name), value) for (name, value) in values.items()]
+    data = pack('=H', len(items)) + \
+           ''.join([pack('=Hl', id, value) for (id, value) in items])
+    shared.paramSetResult = None
+    if sendReliable(command.SET_PARAM, data) != CMD_RESULT_OK:
+        return None
+    t = time.time() + 1
+    while shared.paramSetResult is None and time.time() < t:
+        time.sleep(0.01)
+    if shared.paramSetResult is None:
+        return None
+    (result, failed) = shared.paramSetResult
+    if result != 0:
+        print "Parameter", items[failed][0], "refused, result", result
+    return result
+
+# Reads and prints the whole registry
+def listParams():
+    shared.paramInfo = {}
+    shared.paramCount = None
+    start = 0
+    while shared.paramCount is None or start < shared.paramCount:
+        xb_send(shared.xb, shared.DEST_ADDR, 0, command.LIST_PARAMS, \
+                pack('=H', start))
+        t = time.time() + 1
+        while start not in shared.paramInfo and time.time() < t:
+            time.sleep(0.01)
+        if start not in shared.paramInfo:
+            print "No reply listing parameters from", start
+            return
+        start = max(shared.paramInfo.keys()) + 1
+    for id in sorted(shared.paramInfo.keys()):
+        (ptype, flags, pmin, pmax, value) = shared.paramInfo[id]
+        name = id < len(shared.PARAM_NAMES) and shared.PARAM_NAMES[id] or str(id)
+        print "%3d %-16s %8d  [%d, %d]%s" % (id, name, value, pmin, pmax, \
+            (flags & shared.PARAM_FLAG_RESET) and "  (after reset)" or "")
+
+# One packet of a teleop stream, to be sent at 20-50Hz; speed and turn are
+# leg controller inputs, left = speed - turn, right = speed + turn. The robot
+# smooths the setpoints and stops by itself if the stream stops.
+def sendTeleop(speed, turn):
+    shared.teleopSeq = (shared.teleopSeq + 1) % 256
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.TELEOP, \
+            pack('=hhBx', speed, turn, shared.teleopSeq))
+
+# Disables the motors until the robot is reset; applied by the robot as soon
+# as it is received, ahead of any queued commands
+def emergencyStop():
+    if sendReliable(command.EMERGENCY_STOP, "") != CMD_RESULT_OK:
+        print "No acknowledgement of the emergency stop"
+
 def wakeRobot():
     shared.awake = 0;
     while not(shared.awake):
@@ -148,68 +457,199 @@ def sleepRobot():
     xb_send(shared.xb, shared.DEST_ADDR, 0, command.SLEEP, pack('b',1))
     
 def setSteeringRate(rate):
-    count = 1
     shared.angRateDeg = rate
     shared.angRate = round( shared.angRateDeg / shared.count2deg)
-    while not(shared.steering_rate_set):
-        print "Setting steering rate...   ",count,"/8"
+    print "Setting steering rate..."
+    if sendReliable(command.SET_CTRLD_TURN_RATE, \
+                    pack('h',shared.angRate)) != CMD_RESULT_OK:
+        print "Unable to set steering rate, exiting."
+        xb_safe_exit()
+
+# Heading hold, in degrees; relative = 1 turns by 'heading' from the current
+# heading. setSteeringRate() returns to rate control.
+def setHeading(heading, relative):
+    bams = int(round(heading * 65536.0 / 360)) & 0xFFFF
+    print "Setting heading..."
+    if sendReliable(command.SET_HEADING, \
+                    pack('=Hbx', bams, relative)) != CMD_RESULT_OK:
+        print "Unable to set heading, exiting."
+        xb_safe_exit()
+
+def setMotorGains(gains):
+    shared.motorGains = gains
+    print "Setting motor gains..."
+    if sendReliable(command.SET_PID_GAINS, pack('10h',*gains)) != CMD_RESULT_OK:
+        print "Unable to set motor gains, exiting."
+        xb_safe_exit()
+    
+def setSteeringGains(gains):
+    shared.steeringGains = gains
+    print "Setting steering gains..."
+    if sendReliable(command.SET_STEERING_GAINS, \
+                    pack('6h',*gains)) != CMD_RESULT_OK:
+        print "Unable to set steering gains, exiting."
+        xb_safe_exit()
+
+# Several commands in one frame, [(type, data), ...], acknowledged together.
+MULTI_MAX_LEN = 100
+def sendMulti(cmds):
+    frame = ''
+    for (type, data) in cmds:
+        frame = frame + pack('=BB', type, len(data)) + data
+        if len(data) % 2:
+            frame = frame + '\x00'
+    if len(frame) > MULTI_MAX_LEN:
+        print "Multi frame too long,", len(frame), "bytes"
+        return False
+    shared.multi_ack = None
+    if sendReliable(command.MULTI, frame) is None or shared.multi_ack is None:
+        print "Unable to send multi frame"
+        return False
+    if len(shared.multi_ack) < len(cmds):
+        print "Only", len(shared.multi_ack), "of", len(cmds), "commands accepted"
+        return False
+    return True
+
+# Gains and turn rate for a run in one round trip
+def sendRunSetup(motorGains, steeringGains, rate):
+    shared.motorGains = motorGains
+    shared.steeringGains = steeringGains
+    shared.angRateDeg = rate
+    shared.angRate = round( shared.angRateDeg / shared.count2deg)
+    if not sendMulti([(command.SET_PID_GAINS, pack('10h', *motorGains)),
+                      (command.SET_STEERING_GAINS, pack('6h', *steeringGains)),
+                      (command.SET_CTRLD_TURN_RATE, pack('h', shared.angRate))]):
+        xb_safe_exit()
+
+# Erase is done in the background by the robot, which reports its progress.
+# With ahead, the robot only erases just ahead of the log as it records, and
+# this returns as soon as the erase has started; a run can be started right
+# away either way, pages not erased yet are erased as they are written.
+def eraseFlashMem(numSamples, ahead = False):
+    shared.flash_erased = False
+    shared.eraseProgress = (0, 0)
+    xb_send(shared.xb, shared.DEST_ADDR, \
+            0, command.ERASE_SECTORS, pack('=LB', numSamples, ahead))
+    print "started flash erase ...",
+    eraseStartTime = time.time()
+    shared.last_packet_time = eraseStartTime
+    while not (shared.flash_erased):
+        time.sleep(0.25)
+        if ahead and shared.eraseProgress[1] > 0:
+            print "\nErasing ahead of the log."
+            return
+        dlProgress(shared.eraseProgress[0], max(shared.eraseProgress[1], 1))
+        if (time.time() - shared.last_packet_time) > 8:
+            print"\nFlash erase timeout, retrying;"
+            xb_send(shared.xb, shared.DEST_ADDR, 0, command.ERASE_SECTORS, \
+                    pack('=LB', numSamples, ahead))
+            shared.last_packet_time = time.time()
+    print "\nFlash erase done."
+    
+# Select logged fields by name, from shared.TELEM_FIELDS
+# encoding: 0 raw records, 1 delta compressed (keyframe + varint deltas)
+def setTelemFields(names, encoding = 0):
+    count = 1
+    shared.telem_fields_set = False
+    allnames = [f[0] for f in shared.TELEM_FIELDS]
+    mask = 0
+    for n in names:
+        mask = mask | (1 << allnames.index(n))
+    while not(shared.telem_fields_set):
+        print "Setting telemetry fields...   ",count,"/8"
         count = count + 1
         xb_send(shared.xb, shared.DEST_ADDR, \
-                0, command.SET_CTRLD_TURN_RATE, pack('h',shared.angRate))
+                0, command.SET_TELEM_FIELDS, pack('=LBx', mask, encoding))
         time.sleep(0.3)
         if count > 8:
-            print "Unable to set steering rate, exiting."
+            print "Unable to set telemetry fields, exiting."
             xb_safe_exit()
 
-def setMotorGains(gains):
+# Read the log header, so records are decoded with the layout they were saved in
+def getTelemHeader():
     count = 1
-    shared.motorGains = gains
-    while not(shared.motor_gains_set):
-        print "Setting motor gains...   ",count,"/8"
-        xb_send(shared.xb, shared.DEST_ADDR, \
-                0, command.SET_PID_GAINS, pack('10h',*gains))
+    shared.telem_header_received = False
+    while not(shared.telem_header_received):
+        xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_TELEM_HEADER, "")
         time.sleep(0.3)
+        count = count + 1
         if count > 8:
-            print "Unable to set motor gains, exiting."
+            print "Unable to read telemetry header, exiting."
             xb_safe_exit()
-    
-def setSteeringGains(gains):
+
+# Lists the runs stored in dataflash, oldest first
+def getLogDir():
     count = 1
-    shared.steeringGains = gains
-    while not (shared.steering_gains_set):
-        print "Setting steering gains...   ",count,"/8"
-        xb_send(shared.xb, shared.DEST_ADDR, \
-                0, command.SET_STEERING_GAINS, pack('6h',*gains))
+    shared.logDir = {}
+    shared.log_dir_received = False
+    while not(shared.log_dir_received):
+        xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_LOG_DIR, "")
         time.sleep(0.3)
+        count = count + 1
         if count > 8:
-            print "Unable to set steering gains, exiting."
-            xb_safe_exit()
+            print "Unable to read log directory"
+            return
+    for i in range(shared.logDirCount):
+        (runId, page, pages, mode, samples, mask, start) = shared.logDir[i]
+        print "%2d: run %d, %d samples, %d pages at %d, mask 0x%08X, t=%.1fs" % \
+            (i, runId, samples, pages, page, mask, start/1000.0)
 
-def eraseFlashMem(numSamples):
-    eraseStartTime = time.time()
+# Selects the run read back by downloadTelemetry, index into getLogDir;
+# the robot replies with the header of the run
+def selectLog(index):
+    count = 1
+    shared.telem_header_received = False
+    while not(shared.telem_header_received):
+        xb_send(shared.xb, shared.DEST_ADDR, 0, command.SELECT_LOG, \
+                pack('=H', index))
+        time.sleep(0.3)
+        count = count + 1
+        if count > 8:
+            print "Unable to select log", index
+            return
+
+def clearLogDir():
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.CLEAR_LOG_DIR, "")
+
+def getTelemStats():
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.GET_TELEM_STATS, "")
+
+# Circular logging: keeps preSamples of history and freezes the log
+# postSamples after a trigger; triggers is a mask of TELEM_TRIG_* in telem.h
+# (1 command, 2 estop, 4 accel beyond accelThreshold, 8 log overrun)
+def startCircularLog(preSamples, postSamples, triggers, accelThreshold = 0):
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.CIRCULAR_LOG, \
+            pack('=HHHhbx', preSamples, postSamples, triggers, accelThreshold, 1))
+
+def stopCircularLog():
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.CIRCULAR_LOG, \
+            pack('=HHHhbx', 0, 0, 0, 0, 0))
+
+def triggerLog():
+    xb_send(shared.xb, shared.DEST_ADDR, 0, command.LOG_TRIGGER, "")
+
+# Live telemetry at 300Hz / skip, records arrive in shared.streamdata
+def setTelemStream(onoff, skip):
+    shared.streamLastSeq = -1
+    shared.streamPktsLost = 0
+    shared.streamRecordsLost = 0
     xb_send(shared.xb, shared.DEST_ADDR, \
-            0, command.ERASE_SECTORS, pack('L',numSamples))
-    print "started flash erase ...",
-    while not (shared.flash_erased):
-        time.sleep(0.25)
-        sys.stdout.write('.')
-        if (time.time() - eraseStartTime) > 8:
-            print"\nFlash erase timeout, retrying;"
-            xb_send(shared.xb, shared.DEST_ADDR,0, command.ERASE_SECTORS, pack('L',numSamples))
-            eraseStartTime = time.time()
-    print "\nFlash erase done."
-    
+            0, command.TELEM_STREAM, pack('=bxH', onoff, skip))
+
 def startTelemetrySave(numSamples):
     shared.numSamples = numSamples
+    if sendReliable(command.SPECIAL_TELEMETRY, \
+                    pack('L',numSamples)) != CMD_RESULT_OK:
+        print "Unable to start telemetry save"
+        return
     print "started save"
-    xb_send(shared.xb, shared.DEST_ADDR, \
-            0, command.SPECIAL_TELEMETRY, pack('L',numSamples))
     
 def sendMoveQueue(moveq):
     shared.moveq = moveq
     nummoves = moveq[0]
-    xb_send(shared.xb, shared.DEST_ADDR, \
-            0, command.SET_MOVE_QUEUE, pack('=h'+nummoves*'hhLhhhh', *moveq))
+    if sendReliable(command.SET_MOVE_QUEUE, \
+                    pack('=h'+nummoves*'hhLhhhh', *moveq)) != CMD_RESULT_OK:
+        print "Unable to send move queue"
     
 def setMotorSpeeds(spleft, spright):
     thrust = [spleft, 0, spright, 0, 0]
@@ -0,0 +1,212 @@
+#!/usr/bin/env python
+"""
+Firmware update over the radio: compresses a program memory image from an
+XC16 .hex file and uploads it to one robot after another. Each robot stages
+the image in its dfmem, checks it, then copies it into program flash and
+resets into it (see ota.h). The image must leave the page holding the copy
+routine as in the running firmware.
+
+usage: ota_upload.py firmware.hex [dest addr ...]
+    dest addrs in hex, e.g. 2072 2073; defaults to shared.DEST_ADDR
+
+"""
+from lib import command
+import time,sys
+import binascii
+import serial
+import shared
+
+from or_helpers import *
+
+###### Upload settings ####
+CHUNK = 80          # image bytes per packet, OTA_CHUNK_MAX in ota.h
+WINDOW = 8          # packets sent before waiting for the robot's reply
+PKT_DELAY = 0.004   # s between packets, so the base station keeps up
+MAX_TIMEOUTS = 20
+COPY_TIME = 5.0     # s for the robot to program its flash and restart
+PM_INSTRUCTIONS = 0x15800 / 2  # dsPIC33FJ128, instruction words
+
+# Results and states, see ota.h
+OTA_OK = 0
+OTA_OUT_OF_ORDER = 4
+OTA_RESULTS = ['ok', 'busy', 'too large', 'bad state', 'out of order',
+               'bad crc', 'bad image', 'copy page differs']
+OTA_STATES = ['idle', 'receiving', 'received', 'verified', 'copying', 'done']
+OTA_STATE_DONE = 5
+
+# Program memory image, 3 bytes per instruction word, from an Intel hex file.
+# Hex addresses are twice the program counter, 4 bytes per instruction with
+# a phantom zero byte. Configuration words are left out.
+def readHex(fileName):
+    image = bytearray('\xff' * (3 * PM_INSTRUCTIONS))
+    top = 0
+    base = 0
+    for line in open(fileName):
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        rec = bytearray(binascii.unhexlify(line[1:]))
+        (count, addr, rtype) = (rec[0], (rec[1] << 8) | rec[2], rec[3])
+        data = rec[4:4 + count]
+        if rtype == 4:
+            base = ((data[0] << 8) | data[1]) << 16
+        elif rtype == 1:
+            break
+        elif rtype == 0:
+            for i in range(count):
+                a = base + addr + i
+                (word, byte) = (a / 4, a % 4)
+                if byte == 3 or word >= PM_INSTRUCTIONS:
+                    continue
+                image[3 * word + byte] = data[i]
+                top = max(top, word + 1)
+    return str(image[0:3 * top])
+
+# Run length coding, as decoded by otaVerify() in ota.c: c < 128 is followed
+# by c+1 literal bytes, c >= 128 by one byte repeated c-126 times
+def rleEncode(data):
+    out = []
+    literal = []
+    i = 0
+    while i < len(data):
+        run = 1
+        while i + run < len(data) and run < 129 and data[i + run] == data[i]:
+            run += 1
+        if run >= 3:
+            if literal:
+                out.append(chr(len(literal) - 1) + ''.join(literal))
+                literal = []
+            out.append(chr(run + 126) + data[i])
+            i += run
+        else:
+            literal.append(data[i])
+            i += 1
+            if len(literal) == 128:
+                out.append(chr(127) + ''.join(literal))
+                literal = []
+    if literal:
+        out.append(chr(len(literal) - 1) + ''.join(literal))
+    return ''.join(out)
+
+def crc16(data):
+    return binascii.crc_hqx(data, 0xFFFF)
+
+# Sends an OTA command and waits for the robot's status reply
+def otaRequest(type, data, timeout = 1.0, retries = 5):
+    for i in range(retries):
+        shared.otaStatus = None
+        xb_send(shared.xb, shared.DEST_ADDR, 0, type, data)
+        t = time.time() + timeout
+        while time.time() < t:
+            if shared.otaStatus is not None and shared.otaStatus[0] == type:
+                return shared.otaStatus[1:]
+            time.sleep(0.01)
+    return None
+
+# Streams the image a window at a time; the robot's reply to the last packet
+# of a window says where to carry on from
+def sendImage(image):
+    offset = 0
+    timeouts = 0
+    while offset < len(image):
+        o = offset
+        for k in range(WINDOW):
+            chunk = image[o:o + CHUNK]
+            last = (k == WINDOW - 1) or (o + len(chunk) >= len(image))
+            if last:
+                shared.otaStatus = None
+            xb_send(shared.xb, shared.DEST_ADDR, 0, command.OTA_DATA, \
+                    pack('=LH', o, last and 1 or 0) + chunk)
+            o += len(chunk)
+            time.sleep(PKT_DELAY)
+            if last:
+                break
+        t = time.time() + 0.5
+        while shared.otaStatus is None and time.time() < t:
+            time.sleep(0.005)
+        if shared.otaStatus is None:
+            timeouts += 1
+            if timeouts > MAX_TIMEOUTS:
+                print "\n  no reply from the robot"
+                return False
+            continue
+        (type, result, state, offset) = shared.otaStatus[0:4]
+        if result not in (OTA_OK, OTA_OUT_OF_ORDER):
+            print "\n  upload refused:", OTA_RESULTS[result]
+            return False
+        sys.stdout.write("\r  %d / %d bytes" % (offset, len(image)))
+        sys.stdout.flush()
+    print
+    return True
+
+def updateRobot(image, rawLength, crc, rawCrc):
+    start = time.time()
+    status = otaRequest(command.OTA_BEGIN, \
+                        pack('=LLHH', len(image), rawLength, crc, rawCrc))
+    if status is None or status[0] != OTA_OK:
+        print "  could not start:", status and OTA_RESULTS[status[0]] or "no reply"
+        return False
+    if not sendImage(image):
+        #Release the robot's dfmem buffers for logging
+        otaRequest(command.OTA_ABORT, '', retries = 2)
+        return False
+
+    status = otaRequest(command.OTA_VERIFY, '', timeout = 5.0, retries = 2)
+    if status is None or status[0] != OTA_OK:
+        print "  verify failed:", status and OTA_RESULTS[status[0]] or "no reply"
+        return False
+    print "  %.1f s, staged: %s" % (time.time() - start, OTA_STATES[status[1]])
+
+    #Acknowledged before the copy starts; the robot is silent until it has
+    #restarted into the new firmware, which reports the copy done
+    status = otaRequest(command.CMD_WRITE_PM, '', retries = 2)
+    if status is None or status[0] != OTA_OK:
+        print "  copy refused:", status and OTA_RESULTS[status[0]] or "no reply"
+        return False
+    time.sleep(COPY_TIME)
+    status = otaRequest(command.OTA_STATUS, '', timeout = 2.0)
+    if status is None:
+        print "  no reply after the copy"
+        return False
+    print "  %.1f s, %s" % (time.time() - start, OTA_STATES[status[1]])
+    return status[1] == OTA_STATE_DONE
+
+def main():
+    if len(sys.argv) < 2:
+        print __doc__
+        sys.exit(1)
+    raw = readHex(sys.argv[1])
+    image = rleEncode(raw)
+    (crc, rawCrc) = (crc16(image), crc16(raw))
+    print "Image: %d bytes, %d compressed, crc 0x%04X" % \
+          (len(raw), len(image), crc)
+
+    dests = [pack('>H', int(a, 16)) for a in sys.argv[2:]] or [shared.DEST_ADDR]
+    setupSerial()
+    failed = []
+    for dest in dests:
+        shared.DEST_ADDR = dest
+        print "Robot 0x%04X" % unpack('>H', dest)
+        if not updateRobot(image, len(raw), crc, rawCrc):
+            failed.append(dest)
+
+    print "%d of %d robots updated" % (len(dests) - len(failed), len(dests))
+    shared.xb.halt()
+    shared.ser.close()
+
+#Provide a try-except over the whole main function
+# for clean exit. The Xbee module should have better
+# provisions for handling a clean exit, but it doesn't.
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print "\nRecieved Ctrl+C, exiting."
+        shared.xb.halt()
+        shared.ser.close()
+    except Exception as args:
+        print "\nGeneral exception:",args
+        print "Attemping to exit cleanly..."
+        shared.xb.halt()
+        shared.ser.close()
+        sys.exit()
@@ -12,7 +12,41 @@ BS_BAUDRATE = 230400
 motor_gains_set = False
 steering_gains_set = False
 steering_rate_set = False
+multi_ack = None  # types dispatched from the last MULTI frame
+# Sequenced commands: last sequence number used, and the replies received
+# {seq: (type, result, duplicate)}; see or_helpers.sendReliable
+cmdSeq = 0
+cmdAcks = {}
+cmdStats = None  # see cmdStatsStruct in cmd.h
+poolStats = None  # see payPoolStatsStruct in pay_pool.h
+echoTimes = {}  # {data: time received}, for round trip timing
+echoQuiet = False
+teleopSeq = 0  # stream counter of TELEOP packets
+# Parameter block replies: [result][source][magic][version][length]
+# [leg gains x10][hall gains x10][steering gains x5][steering mode]
+# [telem skip][stride um][radio channel, src addr, pan id, dst addr]
+# [pid zeroing][bemf iir][gyro avg samples][crc]
+NV_PARAM_FORMAT = '=2H3H10h10h5hhHL9H'
+nvParams = None
+# Parameter registry, in firmware id order (enum NVPARAM_IDS, nvparams.h)
+PARAM_NAMES = ['legKpL', 'legKiL', 'legKdL', 'legKawL', 'legKffL',
+    'legKpR', 'legKiR', 'legKdR', 'legKawR', 'legKffR',
+    'hallKpL', 'hallKiL', 'hallKdL', 'hallKawL', 'hallKffL',
+    'hallKpR', 'hallKiR', 'hallKdR', 'hallKawR', 'hallKffR',
+    'steerKp', 'steerKi', 'steerKd', 'steerKaw', 'steerKff', 'steerMode',
+    'telemSkip', 'strideUm', 'radioChannel', 'radioSrcAddr', 'radioPanId',
+    'radioDstAddr', 'pidZeroing', 'bemfIIR', 'gyroAvgSamples', 'gyroFilter']
+PARAM_INFO_FORMAT = '=HBBlll'
+PARAM_FLAG_RESET = 0x01  # takes effect after a reset
+paramInfo = {}  # {id: (type, flags, min, max, value)}
+paramCount = None  # registry size, from LIST_PARAMS
+paramSetResult = None  # (result, index of the rejected value)
+# Firmware update progress, see otaStatusStruct in ota.h
+OTA_STATUS_FORMAT = '=HHLHHL'
+otaStatus = None  # (reply type, result, state, offset, crc, rawCrc, rawLength)
+steering_heading_set = False
 flash_erased = 0
+eraseProgress = (0, 0) # blocks erased, blocks to erase
 pkts = 0
 deg2count = 14.375
 count2deg = 1/deg2count
@@ -25,6 +59,42 @@ awake = True;
 
 # Cross-module variable sharing; these need default values
 imudata = []
+halledges = []
+hallEdgeOverflows = 0
+odometry = []
+
+# Telemetry record fields, in firmware id order (enum TELEM_FIELDS, telem.h)
+TELEM_FIELDS = [('time','L'), ('Llegs','h'), ('Rlegs','h'), ('DCL','h'),
+    ('DCR','h'), ('GyroX','h'), ('GyroY','h'), ('GyroZ','h'), ('GryoZAvg','h'),
+    ('AccelX','h'), ('AccelY','h'), ('AccelZ','h'), ('LBEMF','h'),
+    ('RBEMF','h'), ('SteerOut','h'), ('Vbatt','h'), ('SteerAngle','h'),
+    ('PosX','h'), ('PosY','h'), ('Heading','h'), ('LCount','l'),
+    ('RCount','l'), ('LPError','l'), ('RPError','l'), ('LHallVel','h'),
+    ('RHallVel','h')]
+# Layout of the logged records; set from the log header before a download.
+# Defaults to TELEM_FIELDS_DEFAULT, everything but the hall fields.
+telemFields = range(20)
+telemFormat = ''.join([TELEM_FIELDS[i][1] for i in telemFields])
+telemEncoding = 0  # 0 raw, 1 delta; see TELEM_ENCODINGS in telem.h
+telemHeader = None
+telemStats = None  # (logged, dropped, ringMax, pages)
+# (mode, oldestPage, numPages, triggerSource, postTrigger), see telem.h
+telemLogInfo = (0, 0, 0, 0, 0)
+# Windowed readback: chunks received {seq: data}, and end of the log
+rbChunks = {}
+rbEnd = 0
+telem_fields_set = False
+# Live telemetry stream
+streamdata = []
+streamLastSeq = -1
+streamPktsLost = 0     # from gaps in the sequence numbers
+streamRecordsLost = 0  # dropped on the robot, TX ring full
+telem_header_received = False
+# Runs stored in dataflash {index: (runId, headerPage, numPages, mode,
+#  numSamples, fieldMask, startTime)}, see telemLogDirEntryStruct
+logDir = {}
+logDirCount = 0
+log_dir_received = False
 dataFileName = ''
 leadinTime = 0
 leadoutTime = 0